@@ -1,3 +1,7 @@
 @echo off
+rem always rebuilt, the data might have changed since the last pack was made
+mkpack data data\rawpsx.pak
+if errorlevel 1 goto end
 mkpsxiso -y -q iso.xml
+:end
 pause
@@ -1,2 +1,4 @@
 #!/bin/sh
+# always rebuilt, the data might have changed since the last pack was made
+mkpack data data/rawpsx.pak || exit 1
 mkpsxiso -y -q iso.xml
@@ -5,9 +5,12 @@
 #include "util.h"
 
 /* taken from psxsdk, 16-bit support thrown out */
+/* since the input is always 8-bit, the predictor search is done on the 8-bit samples
+ * directly: the psxsdk encoder worked on (x << 8), and every filter output it looked at
+ * was (x0 + x1 * f0 + x2 * f1) << 8, so comparing the unshifted values gives the same
+ * answer. the output is bit-identical to the original, quirks and all. */
 
 #define PCM_CHUNK_SIZE   28 // num pcm samples for one adpcm block
-#define PCM_BUFFER_SIZE  (PCM_CHUNK_SIZE * 128) // size of conversion buffer
 
 #define ADPCM_BLOCK_SIZE 16 // size of one ADPCM block in bytes
 #define FLAG_LOOP_END    (1 << 0)
@@ -24,7 +27,7 @@
  * bit 2: loop start  - save current address to voice->sample_repeataddr
  */
 
-static const int factors[5][2] = { 
+static const int factors[5][2] = {
   {   0,   0 },
   {  60,   0 },
   { 115, -52 },
@@ -32,102 +35,131 @@ static const int factors[5][2] = {
   { 122, -60 }
 };
 
-static s16 pcm_buffer[PCM_BUFFER_SIZE];
+// shift factor for a block whose largest filter output is (m << 8): the original search
+// only ever looked at bits 8-14 of that plus a rounding constant, so it only depends on m & 0x7F
+static const u8 shift_tab[128] = {
+  12,  6,  5,  5,  4,  4,  4,  3,  3,  3,  3,  3,  3,  3,  2,  2,
+   2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  1,  1,  1,  1,
+   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+   1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  2,  2,  3,  4,
+};
 
 // TODO: get rid of these globals
 // they used to be as statics in their corresponding functions,
 // but they were never getting reset
-static s32 find_s1 = 0;
+static s32 find_s1 = 0; // last two input samples of the previous block
 static s32 find_s2 = 0;
 static s32 pack_s1 = 0;
 static s32 pack_s2 = 0;
 
-static inline void adpcm_find_predict(const s16 *pcm, s32 *d_samples, s32 *predict_nr, s32 *shift_factor) {
-  register int i, j;
+static inline void adpcm_find_predict(const s8 *pcm, s32 *d_samples, s32 *predict_nr, s32 *shift_factor) {
+  register int i;
   register s32 s0, s1, s2;
-  s32 buffer[PCM_CHUNK_SIZE][5];
-  s32 min = 0x7FFFFFFF;
   s32 max[5];
-  s32 ds;
-  s32 min2;
-  s32 shift_mask;
+  s32 min;
+
+  // filter 0 is just the input; if it never goes above 0 (silence or quiet negative stretches),
+  // the original would stop right there, so don't bother with the rest
+  max[0] = 0;
+  for (i = 0; i < PCM_CHUNK_SIZE; ++i)
+    if (pcm[i] > max[0]) max[0] = pcm[i];
 
-  for (i = 0; i < 5; i++) {
-    max[i] = 0.0;
+  min = max[0];
+  *predict_nr = 0;
+
+  if (min > 0) {
+    // the other four filters in one pass, sharing the history
+    register s32 m1 = 0, m2 = 0, m3 = 0, m4 = 0, d;
     s1 = find_s1;
     s2 = find_s2;
-    for (j = 0; j < PCM_CHUNK_SIZE; j ++) {
-      s0 = (s32)pcm[j];
-      if (s0 > 32767)
-        s0 = 32767;
-      if (s0 < - 32768)
-        s0 = -32768;
-      ds = s0 + s1 * factors[i][0] + s2 * factors[i][1];
-      buffer[j][i] = ds;
-      if (ds > max[i])
-        max[i] = ds;
+    for (i = 0; i < PCM_CHUNK_SIZE; ++i) {
+      s0 = pcm[i];
+      d = s0 + s1 * 60;
+      if (d > m1) m1 = d;
+      d = s0 + s1 * 115 - s2 * 52;
+      if (d > m2) m2 = d;
+      d = s0 + s1 * 98 - s2 * 55;
+      if (d > m3) m3 = d;
+      d = s0 + s1 * 122 - s2 * 60;
+      if (d > m4) m4 = d;
       s2 = s1;
       s1 = s0;
     }
-    if (max[i] <= min) {
-      min = max[i];
-      *predict_nr = i;
-    }
-    if (min <= 7) {
-      *predict_nr = 0;
-      break;
+    max[1] = m1; max[2] = m2; max[3] = m3; max[4] = m4;
+
+    // same decision the original made filter by filter: ties go to the later filter,
+    // and once the best output is small enough it gives up and uses filter 0
+    for (i = 1; i < 5; ++i) {
+      if (max[i] <= min) {
+        min = max[i];
+        *predict_nr = i;
+      }
+      if (min <= 0) {
+        *predict_nr = 0;
+        break;
+      }
     }
   }
 
+  // the history is always just the last two input samples, no matter which filter won
+  s1 = find_s1;
+  s2 = find_s2;
+  const s32 f0 = factors[*predict_nr][0];
+  const s32 f1 = factors[*predict_nr][1];
+  for (i = 0; i < PCM_CHUNK_SIZE; ++i) {
+    s0 = pcm[i];
+    d_samples[i] = (s0 + s1 * f0 + s2 * f1) << 8;
+    s2 = s1;
+    s1 = s0;
+  }
   find_s1 = s1;
   find_s2 = s2;
-  
-  for ( i = 0; i < PCM_CHUNK_SIZE; i++ )
-    d_samples[i] = buffer[i][*predict_nr];
-
-  // if (min > 32767)
-  //   min = 32767;
-
-  min2 = ( int ) min;
-  shift_mask = 0x4000;
-  *shift_factor = 0;
-
-  while (*shift_factor < 12) {
-    if (shift_mask & (min2 + (shift_mask >> 3)))
-      break;
-    (*shift_factor)++;
-    shift_mask = shift_mask >> 1;
-  }
+
+  *shift_factor = shift_tab[min & 0x7F];
 }
 
-static inline void adpcm_do_pack(const s32 *d_samples, s16 *four_bit, const s32 predict_nr, const s32 shift_factor) {
+static inline void adpcm_do_pack(const s32 *d_samples, u8 *out, const s32 predict_nr, const s32 shift_factor) {
   register int i;
   register s32 s0, di, ds;
+  register s32 s1 = pack_s1, s2 = pack_s2;
+  register u32 nib = 0;
+  const s32 f0 = factors[predict_nr][0];
+  const s32 f1 = factors[predict_nr][1];
   for (i = 0; i < PCM_CHUNK_SIZE; ++i) {
-    s0 = d_samples[i] + pack_s1 * factors[predict_nr][0] + pack_s2 * factors[predict_nr][1];
+    s0 = d_samples[i] + s1 * f0 + s2 * f1;
     ds = s0 * (s32)(1 << shift_factor);
     di = ((s32) ds + 0x800) & 0xFFFFF000;
     if (di > 32767)
       di = 32767;
     if (di < -32768)
       di = -32768;
-    four_bit[i] = (s32)di;
+    // even samples go in the low nibble
+    if (i & 1)
+      *out++ = nib | ((di >> 8) & 0xF0);
+    else
+      nib = (di >> 12) & 0xF;
     di = di >> shift_factor;
-    pack_s2 = pack_s1;
-    pack_s1 = (s32)di - s0;
+    s2 = s1;
+    s1 = (s32)di - s0;
   }
+  pack_s1 = s1;
+  pack_s2 = s2;
 }
 
 int adpcm_pack_mono_s8(u8 *out, int out_size, const s8 *pcm, int pcm_size, int loopstart, int loopend) {
-  register int i, j, k;
-  register s16 *inptr;
+  register int i;
   register u8 *outptr;
-  register u8 d;
   register int pcmpos = 0;
   s32 d_samples[PCM_CHUNK_SIZE];
-  s16 four_bit[PCM_CHUNK_SIZE];
-  s32 predict_nr;
-  s32 shift_factor;
+  s8 last[PCM_CHUNK_SIZE];
+  // the end block repeats the last block's filter and shift, so with no samples at all
+  // it gets 0 for both (the psxsdk encoder left them uninitialized in that case)
+  s32 predict_nr = 0;
+  s32 shift_factor = 0;
   int flags = 0;
   const int doloop = (loopstart >= 0 && loopend > loopstart && loopend <= pcm_size);
 
@@ -141,60 +173,47 @@ int adpcm_pack_mono_s8(u8 *out, int out_size, const s8 *pcm, int pcm_size, int l
   pack_s1 = pack_s2 = 0;
   find_s1 = find_s2 = 0;
 
+  // check if it's going to fit, including the extra empty block
+  const int num_blocks = (pcm_size + PCM_CHUNK_SIZE - 1) / PCM_CHUNK_SIZE;
+  if ((num_blocks + 1) * ADPCM_BLOCK_SIZE > out_size) {
+    printf("adpcm_pack(out_size=%d pcm_size=%d): adpcm data too large for out\n", out_size, pcm_size);
+    return -1;
+  }
+
   outptr = out;
   while (pcm_size > 0) {
-    // refill buffer
-    int size = (pcm_size >= PCM_BUFFER_SIZE) ? PCM_BUFFER_SIZE : pcm_size;
-    for (i = 0; i < size; ++i) {
-      pcm_buffer[i] = *pcm++;
-      pcm_buffer[i] <<= 8;
-    }
-    // round up to chunk size
-    i = size / PCM_CHUNK_SIZE;
-    j = size % PCM_CHUNK_SIZE;
-    if (j) {
+    const s8 *inptr = pcm;
+    if (pcm_size < PCM_CHUNK_SIZE) {
       // fill the rest of the last chunk with silence
-      for (; j < PCM_CHUNK_SIZE; ++j)
-        pcm_buffer[i * PCM_CHUNK_SIZE + j] = 0;
-      ++i;
+      for (i = 0; i < pcm_size; ++i)
+        last[i] = pcm[i];
+      for (; i < PCM_CHUNK_SIZE; ++i)
+        last[i] = 0;
+      inptr = last;
     }
-    // check if it's going to fit
-    if (outptr + i * ADPCM_BLOCK_SIZE > out + out_size)
-      goto _err_too_big;
-    // write out the blocks
-    for (j = 0; j < i; ++j) {
-      inptr = pcm_buffer + j * PCM_CHUNK_SIZE;
-      adpcm_find_predict(inptr, d_samples, &predict_nr, &shift_factor);
-      adpcm_do_pack(d_samples, four_bit, predict_nr, shift_factor);
-      if (doloop) {
-        // TODO: can probably do this outside of the loop but eh
-        if (loopstart >= 0 && pcmpos >= loopstart) {
-          // reached block where the start of the loop is, set loop start flag
-          flags = FLAG_LOOP_START;
-          loopstart = -1;
-        } else if (loopend >= 0 && pcmpos >= loopend) {
-          // reached block where the end of the loop is, set loop end flag
-          flags = FLAG_LOOP_END | FLAG_LOOP_REPEAT;
-          loopend = -1;
-        }
-      }
-      d = (predict_nr << 4) | shift_factor;
-      *outptr++ = d;
-      *outptr++ = flags;
-      for (k = 0; k < PCM_CHUNK_SIZE; k += 2) {
-        d = ((four_bit[k + 1] >> 8) & 0xF0) | ((four_bit[k] >> 12) & 0xF);
-        *outptr++ = d;
+    adpcm_find_predict(inptr, d_samples, &predict_nr, &shift_factor);
+    if (doloop) {
+      // TODO: can probably do this outside of the loop but eh
+      if (loopstart >= 0 && pcmpos >= loopstart) {
+        // reached block where the start of the loop is, set loop start flag
+        flags = FLAG_LOOP_START;
+        loopstart = -1;
+      } else if (loopend >= 0 && pcmpos >= loopend) {
+        // reached block where the end of the loop is, set loop end flag
+        flags = FLAG_LOOP_END | FLAG_LOOP_REPEAT;
+        loopend = -1;
       }
-      flags = 0;
-      ++pcmpos; // in chunks
-      pcm_size -= PCM_CHUNK_SIZE;
     }
+    *outptr++ = (predict_nr << 4) | shift_factor;
+    *outptr++ = flags;
+    adpcm_do_pack(d_samples, outptr, predict_nr, shift_factor);
+    outptr += PCM_CHUNK_SIZE / 2;
+    flags = 0;
+    ++pcmpos; // in chunks
+    pcm += PCM_CHUNK_SIZE;
+    pcm_size -= PCM_CHUNK_SIZE;
   }
 
-  // check if we've run out of space for our extra empty block
-  if (outptr + ADPCM_BLOCK_SIZE > out + out_size)
-    goto _err_too_big;
-
   // loop endlessly in this null block
   flags = FLAG_LOOP_END | FLAG_LOOP_REPEAT;
   if (!doloop) flags |= FLAG_LOOP_START;
@@ -204,8 +223,4 @@ int adpcm_pack_mono_s8(u8 *out, int out_size, const s8 *pcm, int pcm_size, int l
     *outptr++ = 0;
 
   return outptr - out;
-
-_err_too_big:
-  printf("adpcm_pack(out_size=%d pcm_size=%d): adpcm data too large for out\n", out_size, pcm_size);
-  return -1;
 }
@@ -0,0 +1,199 @@
+#include <stdio.h>
+
+#include "types.h"
+#include "util.h"
+#include "arena.h"
+
+static u8 *arena_mem;
+static u32 arena_size;
+static u8 *arena_lo;       // bottom of free space, end of the transient region
+static u8 *arena_part_top; // boundary between part and transient regions
+static u8 *arena_hi;       // top of free space, start of the pinned region
+static u8 *arena_scratch;  // start of the scratch region
+static u32 arena_scratch_used;
+
+static u32 arena_peak_total; // most memory in use at once
+static u32 arena_min_free;   // least free memory there ever was
+
+static arena_stats_t arena_stats[ARENA_NUM_REGIONS];
+
+static const char *arena_names[ARENA_NUM_REGIONS] = {
+  "part", "transient", "pinned", "scratch"
+};
+
+static void arena_update_stats(void) {
+  arena_stats[ARENA_PART].used = arena_part_top - arena_mem;
+  arena_stats[ARENA_TRANSIENT].used = arena_lo - arena_part_top;
+  arena_stats[ARENA_PINNED].used = arena_scratch - arena_hi;
+  arena_stats[ARENA_SCRATCH].used = arena_scratch_used;
+  u32 total = 0;
+  for (int i = 0; i < ARENA_NUM_REGIONS; ++i) {
+    arena_stats_t *st = arena_stats + i;
+    if (st->used > st->peak) st->peak = st->used;
+    total += st->used;
+  }
+  if (total > arena_peak_total) arena_peak_total = total;
+  const u32 avail = arena_hi - arena_lo;
+  if (avail < arena_min_free) arena_min_free = avail;
+}
+
+void arena_init(u8 *mem, const u32 size, const u32 scratch_size) {
+  ASSERT(scratch_size < size);
+  arena_mem = mem;
+  arena_size = size;
+  arena_lo = arena_part_top = mem;
+  arena_hi = arena_scratch = mem + size - scratch_size;
+  arena_scratch_used = 0;
+  arena_peak_total = 0;
+  arena_min_free = arena_hi - arena_lo;
+  for (int i = 0; i < ARENA_NUM_REGIONS; ++i) {
+    arena_stats[i].used = arena_stats[i].peak = 0;
+    arena_stats[i].allocs = arena_stats[i].fails = 0;
+  }
+}
+
+// returns NULL if there's not enough space; everything is kept word aligned
+u8 *arena_alloc(const int region, const u32 size) {
+  const u32 asize = ALIGN(size, 4);
+  const u32 avail = arena_hi - arena_lo;
+  arena_stats_t *st = arena_stats + region;
+  u8 *ptr = NULL;
+
+  switch (region) {
+    case ARENA_PART:
+      // part resources are only loaded when there's nothing transient on top of them
+      ASSERT(arena_lo == arena_part_top);
+      /* fallthrough */
+    case ARENA_TRANSIENT:
+      if (asize <= avail) {
+        ptr = arena_lo;
+        arena_lo += asize;
+        if (region == ARENA_PART)
+          arena_part_top = arena_lo;
+      }
+      break;
+    case ARENA_PINNED:
+      if (asize <= avail) {
+        arena_hi -= asize;
+        ptr = arena_hi;
+      }
+      break;
+    case ARENA_SCRATCH:
+      if (asize <= (u32)(arena_mem + arena_size - arena_scratch)) {
+        ptr = arena_scratch;
+        arena_scratch_used = asize;
+      }
+      break;
+    default:
+      panic("arena_alloc(%d, %u): invalid region", region, size);
+  }
+
+  if (!ptr) {
+    ++st->fails;
+    printf("arena_alloc(%s, %u): out of memory, %u bytes free\n", arena_names[region], size, avail);
+    return NULL;
+  }
+
+  ++st->allocs;
+  arena_update_stats();
+  return ptr;
+}
+
+// undoes the last allocation from `region`, which has to be the one at `ptr`
+void arena_rollback(const int region, u8 *ptr, const u32 size) {
+  const u32 asize = ALIGN(size, 4);
+  switch (region) {
+    case ARENA_PART:
+      ASSERT(ptr + asize == arena_part_top && arena_lo == arena_part_top);
+      arena_lo = arena_part_top = ptr;
+      break;
+    case ARENA_TRANSIENT:
+      ASSERT(ptr + asize == arena_lo);
+      arena_lo = ptr;
+      break;
+    case ARENA_PINNED:
+      ASSERT(ptr == arena_hi);
+      arena_hi += asize;
+      break;
+    case ARENA_SCRATCH:
+      arena_scratch_used = 0;
+      break;
+  }
+  arena_update_stats();
+}
+
+void arena_reset(const int region) {
+  switch (region) {
+    case ARENA_PART:
+      // transient stuff lives on top of the part, so it goes too
+      arena_lo = arena_part_top = arena_mem;
+      break;
+    case ARENA_TRANSIENT:
+      arena_lo = arena_part_top;
+      break;
+    case ARENA_PINNED:
+      arena_hi = arena_scratch;
+      break;
+    case ARENA_SCRATCH:
+      arena_scratch_used = 0;
+      break;
+  }
+  arena_update_stats();
+}
+
+// everything that's been loaded so far becomes part of the part region
+void arena_commit_part(void) {
+  arena_part_top = arena_lo;
+  arena_update_stats();
+}
+
+u8 *arena_get_base(const int region) {
+  switch (region) {
+    case ARENA_PART:      return arena_mem;
+    case ARENA_TRANSIENT: return arena_part_top;
+    case ARENA_PINNED:    return arena_hi;
+    case ARENA_SCRATCH:   return arena_scratch;
+  }
+  return NULL;
+}
+
+u8 *arena_get_top(const int region) {
+  switch (region) {
+    case ARENA_PART:      return arena_part_top;
+    case ARENA_TRANSIENT: return arena_lo;
+    case ARENA_PINNED:    return arena_scratch;
+    case ARENA_SCRATCH:   return arena_mem + arena_size;
+  }
+  return NULL;
+}
+
+u32 arena_get_free(void) {
+  return arena_hi - arena_lo;
+}
+
+const arena_stats_t *arena_get_stats(const int region) {
+  return arena_stats + region;
+}
+
+const char *arena_get_region_name(const int region) {
+  return arena_names[region];
+}
+
+// returns the region `ptr` is in, or -1 if it's in free space or not in the arena at all
+int arena_find_region(const u8 *ptr) {
+  for (int i = 0; i < ARENA_NUM_REGIONS; ++i) {
+    if (ptr >= arena_get_base(i) && ptr < arena_get_top(i))
+      return i;
+  }
+  return -1;
+}
+
+void arena_dump(void) {
+  printf("arena_dump(): %u bytes at %p, %u free (min %u), peak use %u\n",
+    arena_size, arena_mem, arena_get_free(), arena_min_free, arena_peak_total);
+  for (int i = 0; i < ARENA_NUM_REGIONS; ++i) {
+    const arena_stats_t *st = arena_stats + i;
+    printf("  %-9s %p-%p used %7u peak %7u allocs %5u fails %u\n",
+      arena_names[i], arena_get_base(i), arena_get_top(i), st->used, st->peak, st->allocs, st->fails);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+// resource memory is one static block split into regions, bottom to top:
+//   part      - code, palette and video segments of the current part (res_setup_part)
+//   transient - resources loaded by op_update_memlist, dropped by res_invalidate_res
+//   <free>
+//   pinned    - resources shared between parts, grows down
+//   scratch   - fixed size bitmap buffer at the very top
+// part and transient share the bottom stack, pinned is the top stack;
+// every region is a stack, so freeing is done by resetting or rolling back
+
+enum arena_region_e {
+  ARENA_PART,
+  ARENA_TRANSIENT,
+  ARENA_PINNED,
+  ARENA_SCRATCH,
+  ARENA_NUM_REGIONS
+};
+
+typedef struct {
+  u32 used;
+  u32 peak;    // high-water mark
+  u32 allocs;
+  u32 fails;
+} arena_stats_t;
+
+void arena_init(u8 *mem, const u32 size, const u32 scratch_size);
+u8 *arena_alloc(const int region, const u32 size);
+void arena_rollback(const int region, u8 *ptr, const u32 size);
+void arena_reset(const int region);
+void arena_commit_part(void);
+u8 *arena_get_base(const int region);
+u8 *arena_get_top(const int region);
+u32 arena_get_free(void);
+const arena_stats_t *arena_get_stats(const int region);
+const char *arena_get_region_name(const int region);
+int arena_find_region(const u8 *ptr);
+void arena_dump(void);
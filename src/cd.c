@@ -1,90 +1,165 @@
 #include <stdio.h>
 #include <string.h>
-#include <psxetc.h>
-#include <psxapi.h>
-#include <psxgpu.h>
-#include <psxcd.h>
 
 #include "types.h"
 #include "cd.h"
 #include "util.h"
 
 // TEMPORARY CD FILE READING API WITH BUFFERS AND SHIT
-// copied straight from d2d-psx and converted to only use one static handle
+// copied straight from d2d-psx
+// file handles don't have buffers of their own, instead they point into a shared
+// LRU cache of BUFSECS-sector chunks keyed by LBA, so switching between files
+// doesn't throw away sectors that are already in memory
+// the drive itself is behind a cd_backend_t, so none of this depends on libpsxcd
 
 #define SECSIZE 2048
 #define BUFSECS 4
 #define BUFSIZE (BUFSECS * SECSIZE)
-#define MAX_FHANDLES 1
+#define MAX_FHANDLES 4
+#define CACHE_SLOTS 6 // has to be more than MAX_FHANDLES
 
-static const u32 cdmode = CdlModeSpeed;
+typedef struct {
+  s32 lba;      // first sector in the buffer, -1 if empty
+  u32 last_use;
+  u16 refs;     // number of handles currently reading from this
+  unsigned char buf[BUFSIZE];
+} cd_cache_slot_t;
 
 struct cd_file_s {
   char fname[64];
-  CdlFILE cdf;
+  s32 size;
   s32 secstart, secend, seccur;
   s32 fp, bufp;
   s32 bufleft;
-  unsigned char buf[BUFSIZE];
+  int used;
+  cd_cache_slot_t *slot;
 };
 
-// lmao 1handle
-static cd_file_t fhandle;
+static cd_file_t fhandles[MAX_FHANDLES];
 static s32 num_fhandles = 0;
 
-void cd_init(void) {
-  CdInit();
-  // look alive
-  CdControl(CdlNop, 0, 0);
-  CdStatus();
-  // set hispeed mode
-  CdControlB(CdlSetmode, (u8 *)&cdmode, 0);
-  VSync(3); // have to do this to not explode the drive apparently
+static cd_cache_slot_t cd_cache[CACHE_SLOTS];
+static u32 cd_cache_clock = 0;
+static u32 cd_cache_hits = 0;
+static u32 cd_cache_misses = 0;
+
+// set while a background read started by cd_read_async() might still be running
+static int cd_async_busy = 0;
+
+static const cd_backend_t *cd_drv;
+
+void cd_init(const cd_backend_t *backend) {
+  cd_drv = backend;
+  if (!cd_drv->init())
+    panic("cd_init(): could not init CD backend");
+
+  num_fhandles = 0;
+  memset(fhandles, 0, sizeof(fhandles));
+  cd_cache_clock = cd_cache_hits = cd_cache_misses = 0;
+  cd_async_busy = 0;
+  for (int i = 0; i < CACHE_SLOTS; ++i) {
+    cd_cache[i].lba = -1;
+    cd_cache[i].refs = 0;
+  }
 }
 
-cd_file_t *cd_fopen(const char *fname, const int reopen) {
-  // check if the same file was just open and return it if allowed
-  if (reopen && !strncmp(fhandle.fname, fname, sizeof(fhandle.fname))) {
-    num_fhandles++;
-    return &fhandle;
+static cd_cache_slot_t *cd_cache_get(const s32 lba) {
+  cd_cache_slot_t *victim = NULL;
+  ++cd_cache_clock;
+
+  for (int i = 0; i < CACHE_SLOTS; ++i) {
+    cd_cache_slot_t *slot = cd_cache + i;
+    if (slot->lba == lba) {
+      ++cd_cache_hits;
+      slot->last_use = cd_cache_clock;
+      return slot;
+    }
+    // evict the least recently used chunk that's not being read from
+    if (!slot->refs && (!victim || slot->lba < 0 || (victim->lba >= 0 && slot->last_use < victim->last_use)))
+      victim = slot;
+  }
+
+  ASSERT(victim != NULL);
+  ++cd_cache_misses;
+
+  cd_drv->read(lba, BUFSECS, victim->buf);
+  cd_drv->sync(0);
+
+  victim->lba = lba;
+  victim->last_use = cd_cache_clock;
+  return victim;
+}
+
+// points the handle's buffer at the chunk starting at `sec`
+static void cd_fbuffer(cd_file_t *f, const s32 sec) {
+  if (f->slot) {
+    if (f->slot->lba == sec) {
+      f->seccur = sec;
+      return;
+    }
+    --f->slot->refs;
   }
+  f->slot = cd_cache_get(sec);
+  ++f->slot->refs;
+  f->seccur = sec;
+}
+
+void cd_get_cache_stats(u32 *hits, u32 *misses) {
+  *hits = cd_cache_hits;
+  *misses = cd_cache_misses;
+}
+
+cd_file_t *cd_fopen(const char *fname, const int reopen) {
+  cd_read_wait();
 
   if (num_fhandles >= MAX_FHANDLES) {
     printf("cd_fopen(%s): too many file handles\n", fname);
     return NULL;
   }
 
-  cd_file_t *f = &fhandle;
-  memset(f, 0, sizeof(*f));
+  cd_file_t *f = NULL;
+  const cd_file_t *known = NULL;
+  for (int i = 0; i < MAX_FHANDLES; ++i) {
+    // closed handles remember what file they had open, so it can be reopened without a search if allowed
+    if (reopen && fhandles[i].fname[0] && !strncmp(fhandles[i].fname, fname, sizeof(fhandles[i].fname)))
+      known = fhandles + i;
+    if (!fhandles[i].used && (!f || f->fname[0]))
+      f = fhandles + i;
+  }
 
-  if (CdSearchFile(&f->cdf, fname) == NULL) {
+  s32 lba, size;
+  if (known) {
+    lba = known->secstart;
+    size = known->size;
+  } else if (!cd_drv->locate(fname, &lba, &size)) {
     printf("cd_fopen(%s): file not found\n", fname);
     return NULL;
   }
 
-  // read first sector of the file
-  CdControl(CdlSetloc, (u8 *)&f->cdf.pos, 0);
-  CdRead(BUFSECS, (u32 *)f->buf, CdlModeSpeed);
-  CdReadSync(0, NULL);
+  memset(f, 0, sizeof(*f));
 
   // set fp and shit
-  f->secstart = CdPosToInt(&f->cdf.pos);
-  f->seccur = f->secstart;
-  f->secend = f->secstart + (f->cdf.size + SECSIZE-1) / SECSIZE;
+  f->size = size;
+  f->secstart = lba;
+  f->secend = f->secstart + (f->size + SECSIZE-1) / SECSIZE;
   f->fp = 0;
   f->bufp = 0;
-  f->bufleft = (f->cdf.size >= BUFSIZE) ? BUFSIZE : f->cdf.size;
-  strncpy(fhandle.fname, fname, sizeof(fhandle.fname) - 1);
+  f->bufleft = (f->size >= BUFSIZE) ? BUFSIZE : f->size;
+  strncpy(f->fname, fname, sizeof(f->fname) - 1);
+
+  // read first sector of the file
+  cd_fbuffer(f, f->secstart);
 
+  f->used = 1;
   num_fhandles++;
-  printf("cd_fopen(%s): size %u bufleft %d secs %d %d\n", fname, f->cdf.size, f->bufleft, f->secstart, f->secend);
 
   return f;
 }
 
 int cd_fexists(const char *fname) {
-  CdlFILE cdf;
-  if (CdSearchFile(&cdf, (char *)fname) == NULL) {
+  s32 lba, size;
+  cd_read_wait();
+  if (!cd_drv->locate(fname, &lba, &size)) {
     printf("cd_fexists(%s): file not found\n", fname);
     return 0;
   }
@@ -92,25 +167,31 @@ int cd_fexists(const char *fname) {
 }
 
 void cd_fclose(cd_file_t *f) {
-  if (!f) return;
+  if (!f || !f->used) return;
+  if (f->slot) {
+    --f->slot->refs;
+    f->slot = NULL;
+  }
+  f->used = 0;
   num_fhandles--;
 }
 
 s32 cd_fread(void *ptr, s32 size, s32 num, cd_file_t *f) {
   s32 rx, rdbuf;
   s32 fleft;
-  CdlLOC pos;
 
   if (!f || !ptr) return -1;
   if (!size) return 0;
 
+  cd_read_wait();
+
   size *= num;
   rx = 0;
 
   while (size) {
     // first empty the buffer
     rdbuf = (size > f->bufleft) ? f->bufleft : size;
-    memcpy(ptr, f->buf + f->bufp, rdbuf);
+    memcpy(ptr, f->slot->buf + f->bufp, rdbuf);
     rx += rdbuf;
     ptr += rdbuf;
     f->fp += rdbuf;
@@ -120,16 +201,13 @@ s32 cd_fread(void *ptr, s32 size, s32 num, cd_file_t *f) {
 
     // if we went over, load next sector
     if (f->bufleft == 0) {
-      f->seccur += BUFSECS;
       // check if we have reached the end
-      if (f->seccur >= f->secend)
+      if (f->seccur + BUFSECS >= f->secend) {
+        f->seccur += BUFSECS;
         return rx;
-      // looks like you need to seek every time when you use CdRead
-      CdIntToPos(f->seccur, &pos);
-      CdControl(CdlSetloc, (u8 *)&pos, 0);
-      CdRead(BUFSECS, (u32 *)f->buf, CdlModeSpeed);
-      CdReadSync(0, 0);
-      fleft = f->cdf.size - f->fp;
+      }
+      cd_fbuffer(f, f->seccur + BUFSECS);
+      fleft = f->size - f->fp;
       f->bufleft = (fleft >= BUFSIZE) ? BUFSIZE: fleft;
       f->bufp = 0;
     }
@@ -140,15 +218,16 @@ s32 cd_fread(void *ptr, s32 size, s32 num, cd_file_t *f) {
 
 void cd_freadordie(void *ptr, s32 size, s32 num, cd_file_t *f) {
   if (cd_fread(ptr, size, num, f) < 0)
-    panic("cd_freadordie(%.16s, %d, %d): fucking died", f->cdf.name, size, num);
+    panic("cd_freadordie(%.16s, %d, %d): fucking died", f->fname, size, num);
 }
 
 s32 cd_fseek(cd_file_t *f, s32 ofs, s32 whence) {
   s32 fsec, bofs;
-  CdlLOC pos;
 
   if (!f) return -1;
 
+  cd_read_wait();
+
   if (whence == SEEK_CUR)
     ofs = f->fp + ofs;
 
@@ -161,11 +240,7 @@ s32 cd_fseek(cd_file_t *f, s32 ofs, s32 whence) {
 
   if (fsec != f->seccur) {
     // sector changed; seek to new one and buffer it
-    CdIntToPos(fsec, &pos);
-    CdControl(CdlSetloc, (u8 *)&pos, 0);
-    CdRead(BUFSECS, (u32 *)f->buf, CdlModeSpeed);
-    CdReadSync(0, 0);
-    f->seccur = fsec;
+    cd_fbuffer(f, fsec);
     f->bufp = -1; // hack: see below
   }
 
@@ -188,7 +263,7 @@ s32 cd_ftell(cd_file_t *f) {
 
 s32 cd_fsize(cd_file_t *f) {
   if (!f) return -1;
-  return f->cdf.size;
+  return f->size;
 }
 
 int cd_feof(cd_file_t *f) {
@@ -196,6 +271,35 @@ int cd_feof(cd_file_t *f) {
   return (f->seccur >= f->secend);
 }
 
+int cd_flocate(const char *fname, s32 *lba, s32 *size) {
+  cd_read_wait();
+  if (!cd_drv->locate(fname, lba, size)) {
+    printf("cd_flocate(%s): file not found\n", fname);
+    return 0;
+  }
+  return 1;
+}
+
+void cd_read_async(const s32 lba, const s32 nsecs, void *buf) {
+  cd_read_wait();
+  cd_drv->read(lba, nsecs, buf);
+  cd_async_busy = 1;
+}
+
+int cd_read_done(void) {
+  // sync(1) returns the number of sectors left, or -1 on error
+  if (cd_async_busy && cd_drv->sync(1) <= 0)
+    cd_async_busy = 0;
+  return !cd_async_busy;
+}
+
+void cd_read_wait(void) {
+  if (cd_async_busy) {
+    cd_drv->sync(0);
+    cd_async_busy = 0;
+  }
+}
+
 u8 cd_fread_u8(cd_file_t *f) {
   u8 res = 0;
   cd_freadordie(&res, 1, 1, f);
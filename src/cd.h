@@ -5,7 +5,23 @@
 
 typedef struct cd_file_s cd_file_t;
 
-void cd_init(void);
+// where the sectors come from; cd.c only talks to the drive through this,
+// so the buffering on top of it can be run on the host against a disc image
+typedef struct {
+  int (*init)(void);
+  // finds a file by its ISO name ("\\DATA\\BANK01;1"), returns 0 if it's not there
+  int (*locate)(const char *fname, s32 *lba, s32 *size);
+  // starts reading `nsecs` 2048-byte sectors at `lba` into `buf`
+  void (*read)(const s32 lba, const s32 nsecs, void *buf);
+  // same as CdReadSync: mode 0 waits for the read to finish and returns 0,
+  // mode 1 returns the number of sectors left; -1 on error in both cases
+  int (*sync)(const int mode);
+} cd_backend_t;
+
+// the real drive, through libpsxcd (see cd_psx.c)
+extern const cd_backend_t cd_psx_backend;
+
+void cd_init(const cd_backend_t *backend);
 cd_file_t *cd_fopen(const char *fname, const int reopen);
 int cd_fexists(const char *fname);
 void cd_fclose(cd_file_t *f);
@@ -15,6 +31,13 @@ s32 cd_fseek(cd_file_t *f, s32 ofs, int whence);
 s32 cd_ftell(cd_file_t *f);
 s32 cd_fsize(cd_file_t *f);
 int cd_feof(cd_file_t *f);
+void cd_get_cache_stats(u32 *hits, u32 *misses);
+
+// raw sector reads that run in the background; any other CD access waits for them to finish
+int cd_flocate(const char *fname, s32 *lba, s32 *size);
+void cd_read_async(const s32 lba, const s32 nsecs, void *buf);
+int cd_read_done(void);
+void cd_read_wait(void);
 
 u8 cd_fread_u8(cd_file_t *f);
 u16 cd_fread_u16be(cd_file_t *f);
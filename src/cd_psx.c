@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <psxetc.h>
+#include <psxapi.h>
+#include <psxgpu.h>
+#include <psxcd.h>
+
+#include "types.h"
+#include "cd.h"
+#include "util.h"
+
+// the actual CD drive, through libpsxcd
+
+static const u32 cdmode = CdlModeSpeed;
+
+static int cd_psx_init(void) {
+  CdInit();
+  // look alive
+  CdControl(CdlNop, 0, 0);
+  CdStatus();
+  // set hispeed mode
+  CdControlB(CdlSetmode, (u8 *)&cdmode, 0);
+  VSync(3); // have to do this to not explode the drive apparently
+  return 1;
+}
+
+static int cd_psx_locate(const char *fname, s32 *lba, s32 *size) {
+  CdlFILE cdf;
+  if (CdSearchFile(&cdf, (char *)fname) == NULL)
+    return 0;
+  *lba = CdPosToInt(&cdf.pos);
+  *size = cdf.size;
+  return 1;
+}
+
+static void cd_psx_read(const s32 lba, const s32 nsecs, void *buf) {
+  // looks like you need to seek every time when you use CdRead
+  CdlLOC pos;
+  CdIntToPos(lba, &pos);
+  CdControl(CdlSetloc, (u8 *)&pos, 0);
+  CdRead(nsecs, (u32 *)buf, CdlModeSpeed);
+}
+
+static int cd_psx_sync(const int mode) {
+  return CdReadSync(mode, NULL);
+}
+
+const cd_backend_t cd_psx_backend = {
+  cd_psx_init,
+  cd_psx_locate,
+  cd_psx_read,
+  cd_psx_sync,
+};
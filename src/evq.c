@@ -0,0 +1,41 @@
+#include <stdio.h>
+
+#include "types.h"
+#include "timer.h"
+#include "evq.h"
+
+static evq_event_t evq_ring[EVQ_SIZE];
+static volatile u32 evq_head = 0; // next slot to write, only touched by the producer
+static volatile u32 evq_tail = 0; // next slot to read, only touched by the consumer
+static volatile u32 evq_dropped = 0;
+
+int evq_push(const u8 type, const u8 gen, const u16 arg) {
+  const u32 head = evq_head;
+  if (head - evq_tail >= EVQ_SIZE) {
+    // the main loop is stuck loading or something; not much else to do
+    ++evq_dropped;
+    return 0;
+  }
+  evq_event_t *ev = evq_ring + (head & (EVQ_SIZE - 1));
+  ev->type = type;
+  ev->gen = gen;
+  ev->arg = arg;
+  // this runs in the music IRQ, so the RCNT2 wrap IRQ can't; timer_get_ticks() counts it if it's pending
+  ev->time = timer_get_ticks();
+  // the slot has to be filled in before the consumer can see it
+  evq_head = head + 1;
+  return 1;
+}
+
+int evq_pop(evq_event_t *ev) {
+  const u32 tail = evq_tail;
+  if (tail == evq_head)
+    return 0;
+  *ev = evq_ring[tail & (EVQ_SIZE - 1)];
+  evq_tail = tail + 1;
+  return 1;
+}
+
+u32 evq_get_dropped(void) {
+  return evq_dropped;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "types.h"
+
+// queue for things that happen in interrupt handlers and have to be dealt with by the game
+// interrupt handlers push (they don't nest, so there's only ever one producer at a time),
+// the main loop pops; the producer only writes the head and the consumer only writes the tail,
+// so neither side has to disable interrupts
+
+#define EVQ_SIZE 32 // must be a power of two
+
+enum evq_type_e {
+  EVQ_MUS_MARK, // module hit a mark, arg is the value for VAR_MUS_MARK
+  EVQ_MUS_END,  // module ran out of orders
+};
+
+typedef struct {
+  u8 type;
+  u8 gen;   // generation of whatever queued it, so stale events can be told apart
+  u16 arg;
+  u32 time; // timer ticks when it was queued
+} evq_event_t;
+
+int evq_push(const u8 type, const u8 gen, const u16 arg);
+int evq_pop(evq_event_t *ev);
+u32 evq_get_dropped(void);
@@ -58,6 +58,7 @@ static int gfx_cur_height;
 
 static fb_t gfx_fb[NUM_BUFFERS];
 static int gfx_fb_idx;
+static u32 gfx_frames; // number of times the display was updated
 
 static u8 *gfx_data_base;
 static u8 *gfx_data;
@@ -187,6 +188,11 @@ static inline void gfx_load_palette(const u8 n) {
   register u16 *out = gfx_pal;
   register const u8 *p = res_seg_video_pal + n * NUM_COLORS * sizeof(u16);
   register u16 c;
+  if (res_have_pack) {
+    // already converted by mkpack
+    memcpy(gfx_pal, p, sizeof(gfx_pal));
+    return;
+  }
   for (register int i = 0; i < NUM_COLORS; ++i, p += 2, ++out) {
     c = read16be(p); // BGR444
     // convert to RGB555X
@@ -248,6 +254,7 @@ void gfx_update_display(const int page) {
   }
   // now we can swap buffers
   gfx_fb_idx ^= 1;
+  ++gfx_frames;
   PutDispEnv(&gfx_fb[gfx_fb_idx].disp);
   PutDrawEnv(&gfx_fb[gfx_fb_idx].draw);
 }
@@ -459,6 +466,11 @@ void gfx_blit_bitmap(const u8 *ptr, const u32 size) {
   }
 }
 
+// bitmaps from the data pack are already chunky and get loaded directly in here
+u8 *gfx_get_bitmap_buffer(void) {
+  return gfx_page[0];
+}
+
 static inline void gfx_draw_char(const u8 color, char ch, const s16 x, const s16 y) {
   const u8 *fchbase = gfx_font + ((ch - 0x20) << 3);
   const int ofs = x + y * PAGE_W;
@@ -472,15 +484,14 @@ static inline void gfx_draw_char(const u8 color, char ch, const s16 x, const s16
 }
 
 void gfx_draw_string(const u8 col, s16 x, s16 y, const u16 strid) {
-  const char *str = res_get_string(NULL, strid);
-  if (!str) str = res_get_string(str_tab_demo, strid);
+  u16 len;
+  const char *str = res_get_string(strid, &len);
   if (!str) {
     printf("gfx_draw_string(%d, %d, %d, %d): unknown strid\n", (int)col, (int)x, (int)y, (int)strid);
     return;
   }
 
   const u16 startx = x;
-  const int len = strlen(str);
 
   for (int i = 0; i < len; ++i) {
     if (str[i] == '\n' || str[i] == '\r') {
@@ -501,6 +512,10 @@ int gfx_get_default_mode(void) {
   return gfx_start_mode;
 }
 
+u32 gfx_get_frame_count(void) {
+  return gfx_frames;
+}
+
 int gfx_get_current_mode(void) {
   return gfx_cur_mode;
 }
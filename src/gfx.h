@@ -22,9 +22,11 @@ void gfx_set_palette(const u8 palnum);
 void gfx_set_next_palette(const u8 palnum);
 void gfx_invalidate_palette(void);
 void gfx_blit_bitmap(const u8 *ptr, const u32 size);
+u8 *gfx_get_bitmap_buffer(void);
 void gfx_draw_string(const u8 col, s16 x, s16 y, const u16 strid);
 void gfx_set_font(const u8 *data);
 void gfx_show_pause(void);
 u16 gfx_get_current_palette(void);
 int gfx_get_default_mode(void);
 int gfx_get_current_mode(void);
+u32 gfx_get_frame_count(void);
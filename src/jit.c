@@ -0,0 +1,504 @@
+#ifdef VM_JIT
+
+#include <stdio.h>
+#include <string.h>
+#include <psxapi.h>
+
+#include "types.h"
+#include "util.h"
+#include "jit.h"
+
+#define JIT_HALT      0x10000 // set in what a block returns if the task should stop there
+#define JIT_NEVER     0xFFFF  // block count for blocks that can't be translated
+#define JIT_BUF_WORDS (JIT_BUF_SIZE / 4)
+#define JIT_OP_WORDS  24      // most words one script instruction turns into, block exit included
+#define JIT_EPI_WORDS 4
+#define JIT_MAX_FIX   4
+
+// R3000 registers
+#define R_ZERO 0
+#define R_V0   2
+#define R_A0   4
+#define R_T0   8
+#define R_T1   9
+#define R_T2   10
+#define R_T3   11
+#define R_T4   12
+#define R_S0   16 // vars
+#define R_T9   25
+#define R_SP   29
+#define R_RA   31
+
+// R3000 opcodes and SPECIAL functions
+#define M_BEQ   0x04
+#define M_BNE   0x05
+#define M_ADDIU 0x09
+#define M_ANDI  0x0C
+#define M_ORI   0x0D
+#define M_LUI   0x0F
+#define M_LH    0x21
+#define M_LW    0x23
+#define M_LBU   0x24
+#define M_LHU   0x25
+#define M_SB    0x28
+#define M_SH    0x29
+#define M_SW    0x2B
+#define F_SLL   0x00
+#define F_SRL   0x02
+#define F_JR    0x08
+#define F_JALR  0x09
+#define F_ADDU  0x21
+#define F_SUBU  0x23
+#define F_SLT   0x2A
+
+#define I_TYPE(op, rs, rt, imm) (((u32)(op) << 26) | ((rs) << 21) | ((rt) << 16) | ((u32)(imm) & 0xFFFF))
+#define R_TYPE(rs, rt, rd, sa, fn) (((rs) << 21) | ((rt) << 16) | ((rd) << 11) | ((sa) << 6) | (fn))
+#define NOP 0
+// halves of an address for lui + a signed 16-bit offset
+#define HI(p) ((((u32)(p)) + 0x8000) >> 16)
+#define LO(p) ((u32)(p) & 0xFFFF)
+
+typedef struct {
+  u32 key;   // pc + 1, 0 if the slot is free
+  u16 count; // times entered while not translated
+  u16 ninsns;
+  u32 (* fn)(void);
+} jit_block_t;
+
+static jit_vm_t jit_vm;
+
+static u8 *jit_code;
+static u32 jit_size;
+
+static jit_block_t jit_blocks[JIT_MAX_BLOCKS];
+static u32 jit_nkeys;
+
+// the reserved region the blocks go in; nothing else is ever written here
+static u32 jit_buf[JIT_BUF_WORDS] __attribute__((aligned(16)));
+static u32 jit_used;
+static int jit_full;
+
+// stats for the current part
+static u32 jit_nblocks;
+static u32 jit_runs;
+
+// the block being translated
+static u32 *jit_out;
+static u32 *jit_body;
+static u32 jit_start;
+static u32 *jit_fix[JIT_MAX_FIX];
+static int jit_nfix;
+
+void jit_init(const jit_vm_t *vm) {
+  jit_vm = *vm;
+  ASSERT(jit_vm.num_vars <= 0x100 && jit_vm.stack_depth <= 0x100 && jit_vm.num_tasks <= 0x100);
+}
+
+void jit_reset(u8 *code, const u32 size) {
+  if (jit_nblocks)
+    printf("jit_reset(): last part had %u blocks in %u bytes, ran them %u times\n", jit_nblocks, jit_used * 4, jit_runs);
+  memset(jit_blocks, 0, sizeof(jit_blocks));
+  jit_nkeys = 0;
+  jit_used = 0;
+  jit_full = 0;
+  jit_nblocks = 0;
+  jit_runs = 0;
+  jit_code = code;
+  jit_size = size;
+}
+
+static jit_block_t *jit_lookup(const u32 pos) {
+  u32 i = (pos ^ (pos >> 7)) & (JIT_MAX_BLOCKS - 1);
+  while (1) {
+    jit_block_t *b = jit_blocks + i;
+    if (b->key == pos + 1)
+      return b;
+    if (!b->key) {
+      // keep some room so the lookups stay short
+      if (jit_nkeys >= JIT_MAX_BLOCKS * 3 / 4)
+        return NULL;
+      ++jit_nkeys;
+      b->key = pos + 1;
+      return b;
+    }
+    i = (i + 1) & (JIT_MAX_BLOCKS - 1);
+  }
+}
+
+// length of the instruction at pos, 0 if it's invalid or doesn't fit; see vm_run_task()
+static u32 jit_op_len(const u32 pos) {
+  // operand bytes of opcodes 0x00-0x1A, the one for 0x0A is the shortest it can be
+  static const u8 op_len[0x1B] = {
+    3, 2, 2, 3, 2, 0, 0, 2, 3, 3, 5, 2, 3, 1, 2, 2, 1, 0, 5, 2, 3, 3, 3, 3, 5, 2, 5
+  };
+  const u8 *p = jit_code + pos;
+  const u32 left = jit_size - pos;
+  const u8 op = p[0];
+  u32 len;
+  if (op & 0x80) {
+    len = 3;
+  } else if (op & 0x40) {
+    len = 2;
+    len += ((op & 0x30) == 0) ? 2 : 1;
+    len += ((op & 0x0C) == 0) ? 2 : 1;
+    len += ((op & 3) == 1 || (op & 3) == 2) ? 1 : 0;
+  } else if (op < sizeof(op_len)) {
+    len = op_len[op];
+    if (op == 0x0A && left > 1 && (p[1] & 0xC0) == 0x40)
+      ++len;
+    // op_reset_script() doesn't read the last operand if the range is backwards
+    if (op == 0x0C && left > 2 && (s8)((p[2] & 0x3F) - p[1]) < 0)
+      --len;
+  } else {
+    return 0;
+  }
+  return (len + 1 <= left) ? len + 1 : 0;
+}
+
+static inline void emit(const u32 w) {
+  *jit_out++ = w;
+}
+
+static inline void emit_la(const u32 r, const void *p) {
+  emit(I_TYPE(M_LUI, R_ZERO, r, HI(p)));
+  emit(I_TYPE(M_ADDIU, r, r, LO(p)));
+}
+
+// leaves the block with val in v0; the branch gets pointed at the epilogue once it's there
+static void emit_exit(const u32 val) {
+  if (val & JIT_HALT)
+    emit(I_TYPE(M_LUI, R_ZERO, R_V0, val >> 16));
+  jit_fix[jit_nfix++] = jit_out;
+  emit(I_TYPE(M_BEQ, R_ZERO, R_ZERO, 0));
+  emit(I_TYPE(M_ORI, (val & JIT_HALT) ? R_V0 : R_ZERO, R_V0, val));
+}
+
+// br is a beq/bne without the offset; taken, it goes to target, otherwise leaves the block at next
+// the delay slot sets v0 for the taken case either way, which is fine since the other exit sets it again
+static void emit_branch(const u32 br, const u32 target, const u32 next) {
+#ifndef VM_JIT_LOCKSTEP
+  if (target == jit_start) {
+    // loops that don't leave the block don't have to go through jit_run() every time
+    emit(br | ((jit_body - (jit_out + 1)) & 0xFFFF));
+    emit(NOP);
+  } else
+#endif
+  {
+    jit_fix[jit_nfix++] = jit_out;
+    emit(br);
+    emit(I_TYPE(M_ORI, R_ZERO, R_V0, target));
+  }
+  if (next != (u32)-1)
+    emit_exit(next);
+}
+
+// sets vm.pc to the operands and calls into vm.c, with the opcode as the argument if arg >= 0
+static void emit_call(const void *fn, const u32 pos, const s32 arg) {
+  emit(I_TYPE(M_LUI, R_ZERO, R_T0, HI(jit_vm.pc)));
+  emit_la(R_T1, jit_code + pos);
+  emit(I_TYPE(M_SW, R_T0, R_T1, LO(jit_vm.pc)));
+  emit_la(R_T9, fn);
+  emit(R_TYPE(R_T9, 0, R_RA, 0, F_JALR));
+  emit((arg >= 0) ? I_TYPE(M_ORI, R_ZERO, R_A0, arg) : NOP);
+}
+
+#define VAR(i) ((i) * 2)
+
+// returns 0 to go on, 1 if the block ends with this instruction, -1 if it ends right before it
+static int jit_emit_op(const u32 pos, const u32 len) {
+  const u8 op = jit_code[pos];
+  const u8 *a = jit_code + pos + 1;
+  const u32 next = pos + len;
+
+  if (op & 0xC0) {
+#ifdef VM_JIT_LOCKSTEP
+    emit_exit(pos);
+    return -1;
+#else
+    emit_call((op & 0x80) ? (const void *)jit_vm.draw_shape_short : (const void *)jit_vm.draw_shape, pos + 1, op);
+    return 0;
+#endif
+  }
+
+  switch (op) {
+    case 0x00: // mov_const
+      emit(I_TYPE(M_ADDIU, R_ZERO, R_T0, read16be(a + 1)));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x01: // mov
+      emit(I_TYPE(M_LH, R_S0, R_T0, VAR(a[1])));
+      emit(NOP);
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x02: // add
+    case 0x13: // sub
+      emit(I_TYPE(M_LH, R_S0, R_T0, VAR(a[0])));
+      emit(I_TYPE(M_LH, R_S0, R_T1, VAR(a[1])));
+      emit(NOP);
+      emit(R_TYPE(R_T0, R_T1, R_T0, 0, (op == 0x02) ? F_ADDU : F_SUBU));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x03: // add_const
+      emit(I_TYPE(M_LH, R_S0, R_T0, VAR(a[0])));
+      emit(NOP);
+      emit(I_TYPE(M_ADDIU, R_T0, R_T0, read16be(a + 1)));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x14: // and
+    case 0x15: // or
+      emit(I_TYPE(M_LHU, R_S0, R_T0, VAR(a[0])));
+      emit(NOP);
+      emit(I_TYPE((op == 0x14) ? M_ANDI : M_ORI, R_T0, R_T0, read16be(a + 1)));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x16: // shl
+    case 0x17: // shr
+      // sllv/srlv in the interpreter only look at the low 5 bits too
+      emit(I_TYPE(M_LHU, R_S0, R_T0, VAR(a[0])));
+      emit(NOP);
+      emit(R_TYPE(0, R_T0, R_T0, read16be(a + 1) & 31, (op == 0x16) ? F_SLL : F_SRL));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      return 0;
+    case 0x08: // set_script_slot
+      emit(I_TYPE(M_ORI, R_ZERO, R_T0, read16be(a + 1)));
+      emit(I_TYPE(M_LUI, R_ZERO, R_T1, HI(jit_vm.next_script_pos + a[0])));
+      emit(I_TYPE(M_SH, R_T1, R_T0, LO(jit_vm.next_script_pos + a[0])));
+      return 0;
+    case 0x04: // call
+      emit(I_TYPE(M_LUI, R_ZERO, R_T1, HI(jit_vm.sp)));
+      emit(I_TYPE(M_LBU, R_T1, R_T0, LO(jit_vm.sp)));
+      emit(I_TYPE(M_ORI, R_ZERO, R_T4, next));
+      emit(R_TYPE(0, R_T0, R_T2, 1, F_SLL));
+      emit(I_TYPE(M_ADDIU, R_T0, R_T0, 1));
+      emit(I_TYPE(M_SB, R_T1, R_T0, LO(jit_vm.sp)));
+      emit(I_TYPE(M_LUI, R_ZERO, R_T3, HI(jit_vm.callstack)));
+      emit(R_TYPE(R_T3, R_T2, R_T3, 0, F_ADDU));
+      emit(I_TYPE(M_SH, R_T3, R_T4, LO(jit_vm.callstack)));
+      emit_branch(I_TYPE(M_BEQ, R_ZERO, R_ZERO, 0), read16be(a), (u32)-1);
+      return 1;
+    case 0x05: // ret
+      emit(I_TYPE(M_LUI, R_ZERO, R_T1, HI(jit_vm.sp)));
+      emit(I_TYPE(M_LBU, R_T1, R_T0, LO(jit_vm.sp)));
+      emit(NOP);
+      emit(I_TYPE(M_ADDIU, R_T0, R_T0, -1));
+      emit(I_TYPE(M_ANDI, R_T0, R_T0, 0xFF));
+      emit(I_TYPE(M_SB, R_T1, R_T0, LO(jit_vm.sp)));
+      emit(R_TYPE(0, R_T0, R_T2, 1, F_SLL));
+      emit(I_TYPE(M_LUI, R_ZERO, R_T3, HI(jit_vm.callstack)));
+      emit(R_TYPE(R_T3, R_T2, R_T3, 0, F_ADDU));
+      jit_fix[jit_nfix++] = jit_out;
+      emit(I_TYPE(M_BEQ, R_ZERO, R_ZERO, 0));
+      emit(I_TYPE(M_LHU, R_T3, R_V0, LO(jit_vm.callstack)));
+      return 1;
+    case 0x06: // break
+      emit_exit(next | JIT_HALT);
+      return 1;
+    case 0x07: // jmp
+      emit_branch(I_TYPE(M_BEQ, R_ZERO, R_ZERO, 0), read16be(a), (u32)-1);
+      return 1;
+    case 0x09: // jnz
+      emit(I_TYPE(M_LH, R_S0, R_T0, VAR(a[0])));
+      emit(NOP);
+      emit(I_TYPE(M_ADDIU, R_T0, R_T0, -1));
+      emit(I_TYPE(M_SH, R_S0, R_T0, VAR(a[0])));
+      emit_branch(I_TYPE(M_BNE, R_T0, R_ZERO, 0), read16be(a + 1), next);
+      return 1;
+    case 0x0A: { // condjmp
+      const u8 cop = a[0];
+      const u32 target = read16be(jit_code + next - 2);
+      emit(I_TYPE(M_LH, R_S0, R_T0, VAR(a[1])));
+      if (cop & 0x80) {
+        emit(I_TYPE(M_LH, R_S0, R_T1, VAR(a[2])));
+        emit(NOP);
+      } else if (cop & 0x40) {
+        emit(I_TYPE(M_ADDIU, R_ZERO, R_T1, (a[2] << 8) | a[3]));
+      } else {
+        emit(I_TYPE(M_ADDIU, R_ZERO, R_T1, a[2]));
+      }
+      // t0 is the var, t1 what it's compared to
+      switch (cop & 7) {
+        case 0: emit_branch(I_TYPE(M_BEQ, R_T0, R_T1, 0), target, next); break;
+        case 1: emit_branch(I_TYPE(M_BNE, R_T0, R_T1, 0), target, next); break;
+        case 2: // t1 < t0
+          emit(R_TYPE(R_T1, R_T0, R_T2, 0, F_SLT));
+          emit_branch(I_TYPE(M_BNE, R_T2, R_ZERO, 0), target, next);
+          break;
+        case 3: // !(t0 < t1)
+          emit(R_TYPE(R_T0, R_T1, R_T2, 0, F_SLT));
+          emit_branch(I_TYPE(M_BEQ, R_T2, R_ZERO, 0), target, next);
+          break;
+        case 4: // t0 < t1
+          emit(R_TYPE(R_T0, R_T1, R_T2, 0, F_SLT));
+          emit_branch(I_TYPE(M_BNE, R_T2, R_ZERO, 0), target, next);
+          break;
+        case 5: // !(t1 < t0)
+          emit(R_TYPE(R_T1, R_T0, R_T2, 0, F_SLT));
+          emit_branch(I_TYPE(M_BEQ, R_T2, R_ZERO, 0), target, next);
+          break;
+        default: // never jumps
+          emit_exit(next);
+          break;
+      }
+      return 1;
+    }
+    case 0x11: // halt
+      emit_exit(0xFFFF | JIT_HALT);
+      return 1;
+    default:
+#ifdef VM_JIT_LOCKSTEP
+      emit_exit(pos);
+      return -1;
+#else
+      emit_call(jit_vm.ops[op], pos + 1, -1);
+      return 0;
+#endif
+  }
+}
+
+static int jit_compile(jit_block_t *b, const u32 start) {
+  if (jit_used + JIT_OP_WORDS * 2 + JIT_EPI_WORDS + 8 > JIT_BUF_WORDS) {
+    if (!jit_full) printf("jit_compile(%04x): out of code space\n", start);
+    jit_full = 1;
+    return 0;
+  }
+
+  u32 *begin = jit_buf + jit_used;
+  jit_out = begin;
+  jit_start = start;
+  jit_nfix = 0;
+
+  // u32 block(void), with vars in s0
+  emit(I_TYPE(M_ADDIU, R_SP, R_SP, -24));
+  emit(I_TYPE(M_SW, R_SP, R_RA, 20));
+  emit(I_TYPE(M_SW, R_SP, R_S0, 16));
+  emit_la(R_S0, jit_vm.vars);
+  jit_body = jit_out;
+
+  u32 pos = start;
+  u32 n = 0;
+  while (1) {
+    const u32 len = (pos < jit_size) ? jit_op_len(pos) : 0;
+    if (!len || n == JIT_MAX_INSNS || jit_out + JIT_OP_WORDS + JIT_EPI_WORDS > jit_buf + JIT_BUF_WORDS) {
+      // let the interpreter deal with it
+      emit_exit(pos);
+      break;
+    }
+    const int end = jit_emit_op(pos, len);
+    if (end < 0) break;
+    ++n;
+    if (end > 0) break;
+    pos += len;
+  }
+
+  if (n == 0) {
+    jit_out = begin;
+    return 0;
+  }
+
+  u32 *epi = jit_out;
+  emit(I_TYPE(M_LW, R_SP, R_RA, 20));
+  emit(I_TYPE(M_LW, R_SP, R_S0, 16));
+  emit(R_TYPE(R_RA, 0, 0, 0, F_JR));
+  emit(I_TYPE(M_ADDIU, R_SP, R_SP, 24));
+  for (int i = 0; i < jit_nfix; ++i)
+    *jit_fix[i] |= (epi - (jit_fix[i] + 1)) & 0xFFFF;
+
+  // the new code might be in the I-cache as whatever was there before
+  FlushCache();
+
+  b->fn = (u32 (*)(void))begin;
+  b->ninsns = n;
+  jit_used = jit_out - jit_buf;
+  ++jit_nblocks;
+  return 1;
+}
+
+static inline u32 jit_call(const jit_block_t *b) {
+  return b->fn();
+}
+
+#ifdef VM_JIT_LOCKSTEP
+
+typedef struct {
+  s16 vars[0x100];
+  u16 callstack[0x100];
+  u16 next_script_pos[0x100];
+  u8 *pc;
+  u8 sp;
+  u8 halt;
+} jit_state_t;
+
+static void jit_save(jit_state_t *st) {
+  memset(st, 0, sizeof(*st));
+  memcpy(st->vars, jit_vm.vars, jit_vm.num_vars * sizeof(s16));
+  memcpy(st->callstack, jit_vm.callstack, jit_vm.stack_depth * sizeof(u16));
+  memcpy(st->next_script_pos, jit_vm.next_script_pos, jit_vm.num_tasks * sizeof(u16));
+  st->pc = *jit_vm.pc;
+  st->sp = *jit_vm.sp;
+  st->halt = *jit_vm.halt;
+}
+
+static void jit_restore(const jit_state_t *st) {
+  memcpy(jit_vm.vars, st->vars, jit_vm.num_vars * sizeof(s16));
+  memcpy(jit_vm.callstack, st->callstack, jit_vm.stack_depth * sizeof(u16));
+  memcpy(jit_vm.next_script_pos, st->next_script_pos, jit_vm.num_tasks * sizeof(u16));
+  *jit_vm.pc = st->pc;
+  *jit_vm.sp = st->sp;
+  *jit_vm.halt = st->halt;
+}
+
+// runs the block natively, then the same instructions in the interpreter from the same state
+static void jit_run_lockstep(const jit_block_t *b, const u32 pos) {
+  static jit_state_t before, native, interp;
+  jit_save(&before);
+  const u32 r = jit_call(b);
+  *jit_vm.pc = jit_code + (r & 0xFFFF);
+  if (r & JIT_HALT) *jit_vm.halt = 1;
+  jit_save(&native);
+
+  jit_restore(&before);
+  for (u32 i = 0; i < b->ninsns; ++i)
+    jit_vm.step();
+  jit_save(&interp);
+
+  if (memcmp(&native, &interp, sizeof(native))) {
+    printf("jit: block %04x (%u insns): native pc=%04x halt=%u sp=%u, interpreter pc=%04x halt=%u sp=%u\n",
+      pos, b->ninsns, (u32)(native.pc - jit_code), native.halt, native.sp, (u32)(interp.pc - jit_code), interp.halt, interp.sp);
+    for (u32 i = 0; i < jit_vm.num_vars; ++i)
+      if (native.vars[i] != interp.vars[i]) printf("jit: var %02x native %d interpreter %d\n", i, native.vars[i], interp.vars[i]);
+    for (u32 i = 0; i < jit_vm.stack_depth; ++i)
+      if (native.callstack[i] != interp.callstack[i]) printf("jit: callstack[%u] native %04x interpreter %04x\n", i, native.callstack[i], interp.callstack[i]);
+    for (u32 i = 0; i < jit_vm.num_tasks; ++i)
+      if (native.next_script_pos[i] != interp.next_script_pos[i]) printf("jit: script_pos[1][%u] native %04x interpreter %04x\n", i, native.next_script_pos[i], interp.next_script_pos[i]);
+    panic("jit: block %04x does not match the interpreter", pos);
+  }
+}
+
+#endif
+
+void jit_run(void) {
+  while (!*jit_vm.halt) {
+    const u32 pos = *jit_vm.pc - jit_code;
+    if (pos >= jit_size) return;
+    jit_block_t *b = jit_lookup(pos);
+    if (!b) return;
+    if (!b->fn) {
+      if (b->count == JIT_NEVER || ++b->count < JIT_HOT_COUNT)
+        return;
+      if (!jit_compile(b, pos)) {
+        b->count = JIT_NEVER;
+        return;
+      }
+    }
+#ifdef VM_JIT_LOCKSTEP
+    jit_run_lockstep(b, pos);
+#else
+    const u32 r = jit_call(b);
+    *jit_vm.pc = jit_code + (r & 0xFFFF);
+    if (r & JIT_HALT) *jit_vm.halt = 1;
+#endif
+    ++jit_runs;
+  }
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.h"
+
+// translates the script blocks that run often into R3000 code at runtime, for data that
+// tools/aot.c hasn't seen; only built with VM_JIT
+// a block starts wherever a task starts or a jump lands and runs up to the next control flow op,
+// the rest of the opcodes are called into vm.c with vm.pc pointing at their operands
+// build with VM_JIT_LOCKSTEP as well to run every native block through the interpreter again
+// and panic if they don't agree; the blocks stop before any op with side effects in that mode
+
+#define JIT_HOT_COUNT  16       // times a block has to be entered before it's translated
+#define JIT_MAX_BLOCKS 1024     // power of 2
+#define JIT_MAX_INSNS  128      // script instructions per block
+#ifndef JIT_BUF_SIZE
+#define JIT_BUF_SIZE   0x10000  // bytes of native code per part
+#endif
+
+// what the generated code needs to know about the VM, see vm_init()
+typedef struct {
+  s16 *vars;
+  u16 *callstack;
+  u8 *sp;
+  u16 *next_script_pos;
+  u8 **pc;
+  u8 *halt;
+  void (* const *ops)(void);
+  void (* draw_shape_short)(const u8 op);
+  void (* draw_shape)(const u8 op);
+  void (* step)(void); // runs one instruction in the interpreter, for VM_JIT_LOCKSTEP
+  u16 num_vars;
+  u16 stack_depth;
+  u16 num_tasks;
+} jit_vm_t;
+
+void jit_init(const jit_vm_t *vm);
+// forgets all blocks; call when the code segment changes
+void jit_reset(u8 *code, const u32 size);
+// runs translated blocks from vm.pc on until it gets to one that isn't, counting it and
+// translating it if it's hot enough; returns with vm.pc at where the interpreter should continue
+void jit_run(void);
+
+// does the interpreter have to ask jit_run() for a block after running this op
+static inline int jit_ends_block(const u8 op) {
+#ifdef VM_JIT_LOCKSTEP
+  // anything but arithmetic
+  if (op & 0xC0) return 1;
+  return !(op <= 0x03 || op == 0x08 || (op >= 0x13 && op <= 0x17));
+#else
+  return op == 0x04 || op == 0x05 || op == 0x07 || op == 0x09 || op == 0x0A;
+#endif
+}
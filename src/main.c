@@ -10,8 +10,26 @@
 #include "util.h"
 #include "game.h"
 #include "menu.h"
+#include "timer.h"
+#include "evq.h"
+
+// applies whatever the interrupt handlers have queued up since the last frame
+static void handle_events(void) {
+  evq_event_t ev;
+  while (evq_pop(&ev)) {
+    switch (ev.type) {
+      case EVQ_MUS_MARK:
+      case EVQ_MUS_END:
+        mus_handle_event(&ev);
+        break;
+      default:
+        break;
+    }
+  }
+}
 
 int main(int argc, const char *argv[]) {
+  timer_init();
   gfx_init();
   res_init();
   snd_init();
@@ -22,15 +40,30 @@ int main(int argc, const char *argv[]) {
   // show our own intro and menu
   const int start_part = menu_run();
 
-  // start the actual game
+  // start the actual game; the menu has been prefetching the first part,
+  // so hopefully it's mostly in memory already
+  const u32 t_start = timer_get_ticks();
   vm_restart_at(start_part, 0);
+  const u32 t_loaded = timer_get_ticks();
+  const u32 start_frame = gfx_get_frame_count();
+  int first_frame = 1;
 
   while (1) {
+    handle_events();
     vm_setup_tasks();
-    vm_update_input(pad_get_input());
+    vm_begin_frame();
+    const u32 input = pad_get_input();
+    pad_latency_sample(input);
+    vm_update_input(input);
     vm_run();
     snd_update();
-    mus_update();
+    res_update();
+    if (first_frame && gfx_get_frame_count() != start_frame) {
+      const u32 t_frame = timer_get_ticks();
+      printf("main(): first frame up %u ms after leaving the menu, %u ms of that loading\n",
+        timer_ticks_to_us(t_frame - t_start) / 1000, timer_ticks_to_us(t_loaded - t_start) / 1000);
+      first_frame = 0;
+    }
   }
 
   return 0;
@@ -7,7 +7,6 @@
 #include "gfx.h"
 #include "res.h"
 #include "util.h"
-#include "tables.h"
 #include "vm.h"
 #include "pad.h"
 #include "menu.h"
@@ -24,6 +23,7 @@
 static inline int wait_vblanks(int n, const int interrupt) {
   while (n--) {
     VSync(0);
+    res_update(); // keep the prefetch going
     if (interrupt) {
       const u32 mask = pad_get_input() | pad_get_special_input();
       if (mask) return 1;
@@ -51,6 +51,11 @@ static inline void menu_init(void) {
   res_setup_part(PART_COPY_PROTECTION);
   // set font palette
   gfx_set_next_palette(TEXT_PALETTE);
+#ifndef NO_PREFETCH
+  // the game is most likely going to start with the intro, so stream that in
+  // while the player is looking at the logos and the menus
+  res_prefetch(START_PART);
+#endif
 }
 
 static inline void menu_intro(void) {
@@ -99,6 +104,7 @@ static inline int menu_choice(const int numstr, const u16 str[]) {
 
   while (1) {
     VSync(0);
+    res_update();
 
     const u32 mask = pad_get_input() | pad_get_special_input();
 
@@ -142,7 +148,7 @@ static inline int menu_start_password(void) {
 
 int menu_run(void) {
   menu_init();
-  res_str_tab = menu_language() ? str_tab_fr : str_tab_en;
+  res_str_tab = res_get_str_index(menu_language() ? LANG_FR : LANG_EN);
   if (res_have_password)
     menu_intro(); // demo already has an intro in itself
   const int part = (res_have_password && menu_start_password()) ?
@@ -12,55 +12,77 @@
 #include "game.h"
 #include "gfx.h"
 #include "vm.h"
+#include "evq.h"
 #include "music.h"
 
 #define NUM_INST 15
 #define NUM_CH 4
 #define MAX_ORDER 0x80
 #define PAT_SIZE 1024
+#define PAT_ROWS (PAT_SIZE / (4 * NUM_CH))
+
+// mus_load() compiles every pattern the order table uses into events in place: each 4-byte
+// note cell becomes one u32, so the IRQ doesn't have to decode anything or divide
+#define EV_VOL  (1u << 28) // set the channel volume
+#define EV_PLAY (1u << 29) // play the instrument at the given pitch
+#define EV_STOP (1u << 30) // key off the channel
+#define EV_MARK (1u << 31) // set VAR_MUS_MARK to the low 16 bits
+#define EV_INST(ev)  (((ev) >> 24) & 0xF)
+#define EV_VOLUME(ev) (((ev) >> 16) & 0xFF)
+#define EV_PITCH(ev) ((ev) & 0xFFFF)
+
+// set in the num_order field of a module that's already been compiled
+#define MOD_COMPILED 0x8000
 
 typedef struct {
-  const u8 *data;
+  u8 sound; // handle, SND_NONE if there's no instrument
   u16 vol;
 } mus_inst_t;
 
 typedef struct {
-  const u8 *data;
-  u16 pos;
+  const u32 *events; // PAT_ROWS * NUM_CH events per pattern
+  u16 pos;           // in events
   u8 cur_order;
   u8 num_order;
   u8 order_tab[MAX_ORDER];
   mus_inst_t inst[NUM_INST];
 } mus_module_t;
 
+#define RCNT1_TARGET ((volatile u32 *)(0x1F801118))
+
 static mus_module_t mus_mod;
-static u32 mus_delay = 0;
+static u32 mus_delay = 0;     // RCnt1 ticks until the next tick
+static u32 mus_period_fx = 0; // exact tick period in 16.16 RCnt1 ticks
+static u32 mus_period_acc = 0; // fraction of an RCnt1 tick carried over
 static u32 mus_base_clock = 0;
 
 static volatile int mus_playing = 0;
-static volatile int mus_request_stop = 0;
+static u8 mus_gen = 0; // bumped on every start and stop so events from the last module get ignored
 
 static void mus_callback(void);
 
-// https://github.com/grumpycoders/pcsx-redux/blob/main/src/mips/modplayer/modplayer.c:195
 static inline u32 mus_get_base_clock(void) {
-  static const u32 hblanks_per_sec[4] = {
-    15734, // !mode && !bios => 262.5 * 59.940
-    15591, // !mode &&  bios => 262.5 * 59.393
-    15769, //  mode && !bios => 312.5 * 50.460
-    15625, //  mode &&  bios => 312.5 * 50.000
-  };
   const u32 is_pal_bios = gfx_get_default_mode() == MODE_PAL;
   const u32 is_pal_mode = gfx_get_current_mode() == MODE_PAL;
-  const u32 clk = hblanks_per_sec[(is_pal_mode << 1) | is_pal_bios];
-  return is_pal_mode ? clk : (clk * 5 / 6);
+  return mus_base_clock_for_mode(is_pal_mode, is_pal_bios);
 }
 
-static inline u32 mus_get_delay_ticks(const u32 delay) {
-  // get our hblank clock ticks from meme amiga ticks and hope it doesn't overflow
-  const u32 ms = delay * 60 / 7050;
-  const u32 bpm = 60000 / ms;
-  return mus_base_clock * 60 / bpm;
+// RCnt1 can only count whole hblanks, so the period alternates between the two nearest
+// counts in a way that keeps the average exact
+static inline u32 mus_next_period(void) {
+  mus_period_acc += mus_period_fx;
+  u32 ticks = mus_period_acc >> 16;
+  mus_period_acc &= 0xFFFF;
+  if (ticks == 0) ticks = 1;
+  else if (ticks > 0xFFFF) ticks = 0xFFFF;
+  return ticks;
+}
+
+// sets the tempo and returns the length of the first period
+static inline u32 mus_set_period(const u32 delay) {
+  mus_period_fx = mus_delay_to_period_fx(mus_base_clock, delay);
+  mus_period_acc = 0;
+  return mus_next_period();
 }
 
 void mus_init(void) {
@@ -78,11 +100,12 @@ static inline void mus_load_instruments(const u8 *p) {
   for (int i = 0; i < NUM_INST; ++i) {
     mus_inst_t *inst = mus_mod.inst + i;
     const u16 resid = read16be(p); p += 2;
+    inst->sound = SND_NONE;
     if (resid != 0) {
       inst->vol = read16be(p);
       const mementry_t *me = res_get_entry(resid);
       if (me && me->status == RS_LOADED && me->type == RT_SOUND)
-        inst->data = me->bufptr;
+        inst->sound = me->sound;
       else
         printf("mus_load_instruments(): %04x is not a sound resource\n", resid);
     }
@@ -90,6 +113,64 @@ static inline void mus_load_instruments(const u8 *p) {
   }
 }
 
+static inline u32 mus_compile_cell(const u8 *data) {
+  const u16 note1 = read16be(data + 0);
+  const u16 note2 = read16be(data + 2);
+  u32 ev = 0;
+
+  if (note1 == 0xFFFD)
+    return EV_MARK | note2;
+
+  // whether the instrument actually has a sound is only checked when it plays,
+  // since the handles can change every time the module is loaded
+  const u16 inst = (note2 & 0xF000) >> 12;
+  if (inst != 0) {
+    s16 sndvol = mus_mod.inst[inst - 1].vol;
+    const u8 effect = (note2 & 0x0F00) >> 8;
+    if (effect == 6) {
+      // volume down
+      sndvol -= (note2 & 0xFF);
+      if (sndvol < 0) sndvol = 0;
+    } else if (effect == 5) {
+      // volume up
+      sndvol += (note2 & 0xFF);
+      if (sndvol > 0x3F) sndvol = 0x3F;
+    }
+    ev = EV_VOL | ((u32)(inst - 1) << 24) | ((u32)(u8)sndvol << 16);
+  }
+
+  if (note1 == 0xFFFE) {
+    ev |= EV_STOP;
+  } else if (note1 && inst != 0) {
+    const u16 sndfreq = 7159092 / (note1 << 1);
+    ev |= EV_PLAY | snd_get_pitch(sndfreq);
+  }
+
+  return ev;
+}
+
+static void mus_compile(u8 *buf, const u32 size) {
+  u8 done[256 / 8] = { 0 };
+  for (u32 i = 0; i < mus_mod.num_order; ++i) {
+    const u8 pat = mus_mod.order_tab[i];
+    if (done[pat >> 3] & (1 << (pat & 7)))
+      continue;
+    if (0xC0 + ((u32)pat + 1) * PAT_SIZE > size) {
+      // the original would've just played garbage past the end, but this would write there
+      printf("mus_compile(): pattern %02x is past the end of the module, cutting it at order %u\n", pat, i);
+      mus_mod.num_order = i;
+      break;
+    }
+    done[pat >> 3] |= 1 << (pat & 7);
+    u8 *data = buf + 0xC0 + (u32)pat * PAT_SIZE;
+    for (u32 n = 0; n < PAT_ROWS * NUM_CH; ++n, data += 4)
+      *(u32 *)data = mus_compile_cell(data);
+  }
+  // mark it so loading the same module again doesn't try to compile it twice
+  buf[0x3E] = (mus_mod.num_order | MOD_COMPILED) >> 8;
+  buf[0x3F] = mus_mod.num_order & 0xFF;
+}
+
 void mus_load(const u16 resid, const u16 delay, const u8 pos) {
   const mementry_t *me = res_get_entry(resid);
   ASSERT(me != NULL);
@@ -102,27 +183,27 @@ void mus_load(const u16 resid, const u16 delay, const u8 pos) {
   memset(&mus_mod, 0, sizeof(mus_mod));
 
   mus_mod.cur_order = pos;
-  mus_mod.num_order = read16be(me->bufptr + 0x3E);
+  mus_mod.num_order = read16be(me->bufptr + 0x3E) & ~MOD_COMPILED;
   memcpy(mus_mod.order_tab, me->bufptr + 0x40, sizeof(mus_mod.order_tab));
 
-  if (delay == 0)
-    mus_delay = read16be(me->bufptr);
-  else
-    mus_delay = delay;
-
-  mus_delay = mus_get_delay_ticks(mus_delay);
-
-  mus_mod.data = me->bufptr + 0xC0;
+  mus_delay = mus_set_period(delay ? delay : read16be(me->bufptr));
 
-  printf("mus_load(%04x, %04x, %02x): loading module, delay=%u\n", resid, delay, pos, mus_delay);
+  printf("mus_load(%04x, %04x, %02x): loading module, period=%u+%u/65536\n",
+    resid, delay, pos, mus_period_fx >> 16, mus_period_fx & 0xFFFF);
 
   mus_load_instruments(me->bufptr + 0x02);
+
+  if (!(read16be(me->bufptr + 0x3E) & MOD_COMPILED))
+    mus_compile(me->bufptr, me->unpacked_size);
+  mus_mod.events = (const u32 *)(me->bufptr + 0xC0);
 }
 
 void mus_start(void) {
   mus_mod.pos = 0;
+  mus_period_acc = 0;
+  mus_delay = mus_next_period();
+  ++mus_gen;
   mus_playing = 1;
-  mus_request_stop = 0;
   EnterCriticalSection();
   SetRCnt(RCntCNT1, mus_delay, RCntMdINTR);
   StartRCnt(RCntCNT1);
@@ -131,9 +212,9 @@ void mus_start(void) {
 }
 
 void mus_set_delay(const u16 delay) {
-  mus_delay = mus_get_delay_ticks(delay);
   // restart the timer
   EnterCriticalSection();
+  mus_delay = mus_set_period(delay);
   StopRCnt(RCntCNT1);
   SetRCnt(RCntCNT1, mus_delay, RCntMdINTR);
   StartRCnt(RCntCNT1);
@@ -143,7 +224,7 @@ void mus_set_delay(const u16 delay) {
 
 void mus_stop(void) {
   mus_playing = 0;
-  mus_request_stop = 0;
+  ++mus_gen;
   EnterCriticalSection();
   StopRCnt(RCntCNT1);
   ExitCriticalSection();
@@ -151,69 +232,71 @@ void mus_stop(void) {
   snd_stop_all();
 }
 
-void mus_update(void) {
-  if (mus_request_stop)
-    mus_stop();
+void mus_handle_event(const evq_event_t *ev) {
+  if (ev->gen != mus_gen)
+    return;
+  switch (ev->type) {
+    case EVQ_MUS_MARK:
+      vm_set_var(VAR_MUS_MARK, ev->arg);
+      break;
+    case EVQ_MUS_END:
+      mus_stop();
+      break;
+    default:
+      break;
+  }
 }
 
-static inline void mus_handle_pattern(const u8 ch, const u8 *data) {
-  const u16 note1 = read16be(data + 0);
-  const u16 note2 = read16be(data + 2);
-  const u8 *sndptr = NULL;
-  s16 sndvol = 0;
-
-  if (note1 == 0xFFFD) {
-    vm_set_var(VAR_MUS_MARK, note2);
+static inline void mus_play_event(const u8 ch, const u32 ev) {
+  if (ev & EV_MARK) {
+    // scripts might be in the middle of reading it, so it gets set between frames
+    evq_push(EVQ_MUS_MARK, mus_gen, ev & 0xFFFF);
     return;
   }
 
-  const u16 inst = (note2 & 0xF000) >> 12;
-  if (inst != 0) {
-    sndptr = mus_mod.inst[inst - 1].data;
-    if (sndptr) {
-      sndvol = mus_mod.inst[inst - 1].vol;
-      const u8 effect = (note2 & 0x0F00) >> 8;
-      if (effect == 6) {
-        // volume down
-        sndvol -= (note2 & 0xFF);
-        if (sndvol < 0) sndvol = 0;
-      } else if (effect == 5) {
-        // volume up
-        sndvol += (note2 & 0xFF);
-        if (sndvol > 0x3F) sndvol = 0x3F;
-      }
-      snd_set_sound_vol(ch, sndvol);
+  if (ev & EV_VOL) {
+    const u8 snd = mus_mod.inst[EV_INST(ev)].sound;
+    if (snd != SND_NONE) {
+      if (ev & EV_PLAY)
+        snd_play_sound_pitch(ch, snd, EV_PITCH(ev), EV_VOLUME(ev));
+      else
+        snd_set_sound_vol(ch, EV_VOLUME(ev));
     }
   }
 
-  if (note1 == 0xFFFE) {
+  if (ev & EV_STOP)
     snd_stop_sound(ch);
-  } else if (note1 && sndptr) {
-    const u16 sndfreq = 7159092 / (note1 << 1);
-    snd_play_sound(ch, sndptr, sndfreq, sndvol);
-  }
 }
 
 // interrupt callback
 static void mus_callback(void)  {
-  if (!mus_playing || mus_request_stop) return;
+  if (!mus_playing) return;
+
+  // the counter has already started over, so this sets the length of the period that just began
+  *RCNT1_TARGET = mus_next_period();
 
   u8 order = mus_mod.order_tab[mus_mod.cur_order];
-  const u8 *patdata = mus_mod.data + mus_mod.pos + ((u32)order * PAT_SIZE);
+  const u32 *ev = mus_mod.events + mus_mod.pos + (u32)order * (PAT_ROWS * NUM_CH);
 
   for (u8 ch = 0; ch < NUM_CH; ++ch) {
-    mus_handle_pattern(ch, patdata);
-    patdata += 4;
+    if (ev[ch])
+      mus_play_event(ch, ev[ch]);
   }
 
-  mus_mod.pos += 4 * NUM_CH;
+  mus_mod.pos += NUM_CH;
 
-  if (mus_mod.pos >= PAT_SIZE) {
+  if (mus_mod.pos >= PAT_ROWS * NUM_CH) {
     mus_mod.pos = 0;
     order = mus_mod.cur_order + 1;
-    if (order == mus_mod.num_order)
-      mus_request_stop = 1; // game loop will fix the rest, since we can't fuck with events from here
-    else
+    if (order == mus_mod.num_order) {
+      // game loop will fix the rest, since we can't fuck with events from here
+      mus_playing = 0;
+      evq_push(EVQ_MUS_END, mus_gen, 0);
+    } else {
       mus_mod.cur_order = order;
+    }
   }
+
+  // start this tick's notes all at once
+  snd_flush();
 }
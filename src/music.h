@@ -1,10 +1,30 @@
 #pragma once
 
 #include "types.h"
+#include "evq.h"
+
+// RCnt1 counts hblanks; these are the rates it runs at, see mus_get_base_clock()
+// https://github.com/grumpycoders/pcsx-redux/blob/main/src/mips/modplayer/modplayer.c:195
+static inline u32 mus_base_clock_for_mode(const int is_pal_mode, const int is_pal_bios) {
+  static const u32 hblanks_per_sec[4] = {
+    15734, // !mode && !bios => 262.5 * 59.940
+    15591, // !mode &&  bios => 262.5 * 59.393
+    15769, //  mode && !bios => 312.5 * 50.460
+    15625, //  mode &&  bios => 312.5 * 50.000
+  };
+  const u32 clk = hblanks_per_sec[(is_pal_mode << 1) | is_pal_bios];
+  return is_pal_mode ? clk : (clk * 5 / 6);
+}
+
+// the original player ticks every delay * 60 / 7050 ms; this is that period in RCnt1 ticks
+// as 16.16 fixed point, and the fraction gets carried over from tick to tick so it never drifts
+static inline u32 mus_delay_to_period_fx(const u32 base_clock, const u32 delay) {
+  return (u32)(((unsigned long long)base_clock * delay * 60 << 16) / 7050000);
+}
 
 void mus_init(void);
 void mus_load(const u16 resid, const u16 delay, const u8 pos);
 void mus_start(void);
 void mus_set_delay(const u16 delay);
 void mus_stop(void);
-void mus_update(void);
+void mus_handle_event(const evq_event_t *ev);
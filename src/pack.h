@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+
+// load-ready data pack produced by tools/mkpack.c from MEMLIST.BIN and BANKxx
+// layout: header, immediately followed by an index of `num_entries` entries (one
+// per memlist entry), then the data for every present entry, each starting on a
+// sector boundary so it can be read without touching neighbouring sectors
+// all fields are little endian
+
+#define PACK_FILENAME "\\DATA\\RAWPSX.PAK;1"
+#define PACK_MAGIC    0x4B505752 // "RWPK"
+#define PACK_VERSION  2
+#define PACK_SECSIZE  2048
+
+enum pack_format_e {
+  PF_NONE    = 0, // resource is missing from the source data
+  PF_RAW     = 1, // unpacked resource data (code, shapes, music)
+  PF_PALETTE = 2, // palettes converted to RGB555 with the PSX black substitution applied
+  PF_BITMAP  = 3, // chunky 320x200 bitmap, one byte per pixel
+  PF_ADPCM   = 4, // SPU ADPCM, size aligned to 64 bytes
+};
+
+typedef struct {
+  u32 magic;
+  u16 version;
+  u16 num_entries;
+  u32 memlist_hash; // FNV-1a of the MEMLIST.BIN entries it was built from, terminator included
+} pack_header_t;
+
+typedef struct {
+  u32 offset; // in bytes from the start of the pack
+  u32 size;
+  u8 format;
+  u8 pad[3];
+} pack_entry_t;
@@ -1,17 +1,70 @@
+#include <stdio.h>
 #include <psxpad.h>
 #include <psxapi.h>
+#include <psxgpu.h>
 
 #include "types.h"
 #include "pad.h"
 
+#define LATENCY_REPORT_EVERY 16
+
 static PADTYPE *pad;
 static u8 pad_buf[2][34];
 
+#ifdef INPUT_LATENCY
+static volatile u32 lat_press = 0; // vblank the pending press happened on, 0 if there's none
+static volatile u32 lat_seen = 0;  // vblank the scripts got to see it on, 0 if they haven't yet
+static u32 lat_prev_mask = 0;
+static u32 lat_count, lat_missed;
+static u32 lat_sum_sample, lat_sum_flip, lat_min_flip, lat_max_flip;
+
+static void pad_vblank_callback(void) {
+  const u32 mask = pad_get_input();
+  if (!lat_press && (mask & ~lat_prev_mask)) {
+    lat_press = VSync(-1);
+  } else if (lat_press && !lat_seen && !mask) {
+    // let go before the game even looked
+    lat_press = 0;
+    ++lat_missed;
+  }
+  lat_prev_mask = mask;
+}
+
+void pad_latency_sample(const u32 mask) {
+  if (lat_press && !lat_seen && mask)
+    lat_seen = VSync(-1);
+}
+
+void pad_latency_flip(void) {
+  if (!lat_seen) return;
+
+  // the new frame is scanned out starting with the next vblank
+  const u32 flip = VSync(-1) + 1 - lat_press;
+  const u32 sample = lat_seen - lat_press;
+  lat_press = lat_seen = 0;
+
+  if (!lat_count || flip < lat_min_flip) lat_min_flip = flip;
+  if (!lat_count || flip > lat_max_flip) lat_max_flip = flip;
+  lat_sum_flip += flip;
+  lat_sum_sample += sample;
+  if (++lat_count == LATENCY_REPORT_EVERY) {
+    printf("pad_latency(): %u presses, press to photon %u-%u vblanks (avg %u.%02u), press to sample avg %u.%02u, %u missed\n",
+      lat_count, lat_min_flip, lat_max_flip,
+      lat_sum_flip / lat_count, lat_sum_flip * 100 / lat_count % 100,
+      lat_sum_sample / lat_count, lat_sum_sample * 100 / lat_count % 100, lat_missed);
+    lat_count = lat_missed = lat_sum_flip = lat_sum_sample = 0;
+  }
+}
+#endif
+
 void pad_init(void) {
   InitPAD(pad_buf[0], sizeof(pad_buf[0]), pad_buf[1], sizeof(pad_buf[1]));
   StartPAD();
   ChangeClearPAD(0);
   pad = (PADTYPE *)pad_buf[0];
+#ifdef INPUT_LATENCY
+  VSyncCallback(pad_vblank_callback);
+#endif
 }
 
 u32 pad_get_input(void) {
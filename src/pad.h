@@ -17,3 +17,13 @@ enum input_mask_e {
 void pad_init(void);
 u32 pad_get_input(void);
 u32 pad_get_special_input(void);
+
+#ifdef INPUT_LATENCY
+// press-to-photon measurement: a vblank handler notes when a button goes down, the main loop
+// tells when the scripts got to see it and when the next frame went up; prints a summary every so often
+void pad_latency_sample(const u32 mask);
+void pad_latency_flip(void);
+#else
+static inline void pad_latency_sample(const u32 mask) { (void)mask; }
+static inline void pad_latency_flip(void) { }
+#endif
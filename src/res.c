@@ -9,25 +9,49 @@
 #include "tables.h"
 #include "snd.h"
 #include "game.h"
+#include "pack.h"
+#include "arena.h"
+#include "timer.h"
+#include "trace.h"
 
 u8 *res_seg_code;
+u32 res_seg_code_size;
 u8 *res_seg_video[2];
 u8 *res_seg_video_pal;
 int res_vidseg_idx;
 u16 res_next_part;
 u16 res_cur_part;
 int res_have_password;
-const string_t *res_str_tab;
+int res_have_pack;
+const strindex_t *res_str_tab;
 
 static mementry_t res_memlist[NUM_MEMLIST_ENTRIES + 1];
 static u16 res_memlist_num;
 
+static pack_entry_t res_pack[NUM_MEMLIST_ENTRIES + 1];
+
+static strindex_t res_str_index[LANG_COUNT];
+
+static s32 res_bank_lba[0x100]; // first sector of each bank, 0 if not located yet
+static s32 res_pack_lba;
+static trace_load_t *res_trace; // record for the load that's in progress
+
+#define RES_SCRATCH_SIZE (0x800 * 16) // enough for a planar bitmap
+#define RES_SECSIZE      2048
+
+// per-load logging, off by default because TTY output is slow on hardware
+#ifdef RES_VERBOSE
+#define res_log(...) printf(__VA_ARGS__)
+#else
+#define res_log(...) do { } while (0)
+#endif
+
 static u8 res_mem[MEMBLOCK_SIZE];
 
-static u8 *res_script_ptr;
-static u8 *res_script_membase;
-static u8 *res_vid_ptr;
-static u8 *res_vid_membase;
+#ifndef NO_PREFETCH
+static u16 res_pf_tried; // last part we tried to prefetch
+static u16 res_idle_frames; // frames since the last load
+#endif
 
 typedef struct {
   u8 me_pal;
@@ -49,8 +73,79 @@ static const mempart_t res_memlist_parts[] = {
   { 0x7D, 0x7E, 0x7F, 0x00 }  // 16009 - password screen
 };
 
+#define NUM_PARTS (sizeof(res_memlist_parts) / sizeof(*res_memlist_parts))
+#define PART_MASK(id) (1 << ((id) - PART_BASE))
+
+// for each memlist entry, a bitmask of the parts that reference it
+static u16 res_part_refs[NUM_MEMLIST_ENTRIES + 1];
+
+static void res_init_part_refs(void) {
+  for (u16 i = 0; i < NUM_PARTS; ++i) {
+    const mempart_t *part = res_memlist_parts + i;
+    const u16 mask = 1 << i;
+    res_part_refs[part->me_pal] |= mask;
+    res_part_refs[part->me_code] |= mask;
+    res_part_refs[part->me_vid1] |= mask;
+    if (part->me_vid2 != 0)
+      res_part_refs[part->me_vid2] |= mask;
+  }
+}
+
+// resources referenced by more than one part get loaded into the pinned region,
+// so they can survive part transitions
+static inline int res_is_shared(const u16 resnum) {
+  const u16 refs = res_part_refs[resnum];
+  return (refs & (refs - 1)) != 0;
+}
+
+// adds every string in `strtab` that's not in `idx` yet
+static void res_index_strings(strindex_t *idx, const string_t *strtab) {
+  for (const string_t *s = strtab; s->id != 0xFFFF; ++s) {
+    ASSERT(s->id < STR_MAX_ID);
+    if (idx->slot[s->id])
+      continue;
+    ASSERT(idx->num < STR_MAX_ENTRIES);
+    idx->ent[idx->num].str = s->str;
+    idx->ent[idx->num].len = strlen(s->str);
+    idx->slot[s->id] = ++idx->num;
+  }
+}
+
+static void res_init_strings(void) {
+  static const string_t *tabs[LANG_COUNT] = { str_tab_en, str_tab_fr };
+  for (int i = 0; i < LANG_COUNT; ++i) {
+    memset(&res_str_index[i], 0, sizeof(res_str_index[i]));
+    res_index_strings(&res_str_index[i], tabs[i]);
+    // strings that only the demo has are the same in both languages
+    res_index_strings(&res_str_index[i], str_tab_demo);
+  }
+}
+
+static int res_open_pack(const u32 memlist_hash) {
+  cd_file_t *f = cd_fopen(PACK_FILENAME, 0);
+  if (!f) return 0;
+
+  pack_header_t hdr;
+  cd_freadordie(&hdr, sizeof(hdr), 1, f);
+  if (hdr.magic != PACK_MAGIC || hdr.version != PACK_VERSION || hdr.num_entries != res_memlist_num || hdr.memlist_hash != memlist_hash) {
+    printf("res_open_pack(): pack does not match memlist (magic %08x ver %d num %d hash %08x, want %08x), ignoring\n",
+      hdr.magic, (int)hdr.version, (int)hdr.num_entries, hdr.memlist_hash, memlist_hash);
+    cd_fclose(f);
+    return 0;
+  }
+
+  cd_freadordie(res_pack, sizeof(*res_pack), res_memlist_num, f);
+  cd_fclose(f);
+
+  s32 fsize;
+  cd_flocate(PACK_FILENAME, &res_pack_lba, &fsize);
+
+  printf("res_open_pack(): using data pack\n");
+  return 1;
+}
+
 void res_init(void) {
-  cd_init();
+  cd_init(&cd_psx_backend);
 
   // read memlist
   cd_file_t *f = cd_fopen(MEMLIST_FILENAME, 0);
@@ -58,10 +153,13 @@ void res_init(void) {
 
   res_memlist_num = 0;
   mementry_t *me = res_memlist;
+  u32 memlist_hash = FNV1A_INIT; // to check the pack against
   while (!cd_feof(f)) {
     ASSERT(res_memlist_num < NUM_MEMLIST_ENTRIES + 1);
-    cd_freadordie(me, sizeof(*me), 1, f);
+    cd_freadordie(me, MEMENTRY_FILE_SIZE, 1, f);
+    memlist_hash = hash_fnv1a_update(memlist_hash, (const u8 *)me, MEMENTRY_FILE_SIZE);
     me->bufptr = NULL;
+    me->sound = SND_NONE;
     me->bank_pos = bswap32(me->bank_pos);
     me->packed_size = bswap32(me->packed_size);
     me->unpacked_size = bswap32(me->unpacked_size);
@@ -75,19 +173,33 @@ void res_init(void) {
 
   printf("res_init(): memlist_num=%d\n", (int)res_memlist_num);
 
+  // prefer the pre-processed pack if there is one, otherwise read the banks directly
+  res_have_pack = res_open_pack(memlist_hash);
+
   // check if there's a password screen
   const int pwnum = res_memlist_parts[PART_PASSWORD - PART_BASE].me_code;
-  char bank[16];
   ASSERT(pwnum < res_memlist_num);
-  snprintf(bank, sizeof(bank), BANK_FILENAME, res_memlist[pwnum].bank);
-  res_have_password = cd_fexists(bank);
+  if (res_have_pack) {
+    res_have_password = (res_pack[pwnum].format != PF_NONE);
+  } else {
+    char bank[16];
+    snprintf(bank, sizeof(bank), BANK_FILENAME, res_memlist[pwnum].bank);
+    res_have_password = cd_fexists(bank);
+  }
+
+  res_init_part_refs();
 
   // set up memory work areas
-  res_script_membase = res_script_ptr = res_mem;
-  res_vid_membase = res_vid_ptr = res_mem + MEMBLOCK_SIZE - 0x800 * 16;
+  arena_init(res_mem, MEMBLOCK_SIZE, RES_SCRATCH_SIZE);
 
   // assume english
-  res_str_tab = str_tab_en;
+  res_init_strings();
+  res_str_tab = res_get_str_index(LANG_EN);
+}
+
+// how much memory the resource takes up once it's loaded
+static inline u32 res_get_load_size(const mementry_t *me) {
+  return res_have_pack ? res_pack[me - res_memlist].size : me->unpacked_size;
 }
 
 void res_invalidate_res(void) {
@@ -96,40 +208,440 @@ void res_invalidate_res(void) {
     if (me->type <= RT_BITMAP || me->type > RT_BANK)
       me->status = RS_NULL;
   }
-  res_script_ptr = res_script_membase;
+  arena_reset(ARENA_TRANSIENT);
   gfx_invalidate_palette();
-  snd_clear_cache();
+  snd_detach_all();
+#ifndef NO_PREFETCH
+  // might have enough memory to prefetch now
+  res_pf_tried = 0;
+#endif
 }
 
 void res_invalidate_all(void) {
   for (u16 i = 0; i < res_memlist_num; ++i)
     res_memlist[i].status = RS_NULL;
-  res_script_ptr = res_mem;
+  arena_reset(ARENA_PART);
+  arena_reset(ARENA_PINNED);
   gfx_invalidate_palette();
-  snd_clear_cache();
+  snd_detach_all();
 }
 
+// same as res_invalidate_all(), but keeps pinned resources that are also used by `part_id`
+// returns the amount of bytes that won't have to be reloaded
+static u32 res_invalidate_part(const u16 part_id) {
+  const u16 mask = PART_MASK(part_id);
+  u32 kept = 0;
+
+  // drop everything that's not pinned or not needed by the next part
+  for (u16 i = 0; i < res_memlist_num; ++i) {
+    mementry_t *me = res_memlist + i;
+    if (me->status == RS_LOADED && arena_find_region(me->bufptr) == ARENA_PINNED && (res_part_refs[i] & mask))
+      continue;
+    me->status = RS_NULL;
+  }
+
+  // compact what's left towards the top of the pinned region, highest address first,
+  // so that nothing gets overwritten before it's moved
+  u8 *limit = arena_get_top(ARENA_PINNED);
+  arena_reset(ARENA_PART);
+  arena_reset(ARENA_PINNED);
+  while (1) {
+    mementry_t *next = NULL;
+    for (u16 i = 0; i < res_memlist_num; ++i) {
+      mementry_t *me = res_memlist + i;
+      if (me->status == RS_LOADED && me->bufptr < limit && (!next || me->bufptr > next->bufptr))
+        next = me;
+    }
+    if (!next) break;
+    const u32 size = res_get_load_size(next);
+    u8 *top = arena_alloc(ARENA_PINNED, size);
+    limit = next->bufptr;
+    if (top != next->bufptr) {
+      memmove(top, next->bufptr, size);
+      next->bufptr = top;
+    }
+    kept += size;
+  }
+
+  gfx_invalidate_palette();
+
+  // the sounds stay in SPU RAM either way, but the ones that were kept need to be attached to where they are now
+  snd_detach_all();
+  for (u16 i = 0; i < res_memlist_num; ++i) {
+    mementry_t *me = res_memlist + i;
+    if (me->status == RS_LOADED && me->type == RT_SOUND)
+      me->sound = snd_cache_sound(i, me->bufptr, res_get_load_size(me), res_have_pack ? SND_TYPE_ADPCM : SND_TYPE_PCM_WITH_HEADER);
+  }
+
+  return kept;
+}
+
+static s32 res_get_bank_lba(const u8 bank) {
+  s32 *lba = res_bank_lba + bank;
+  if (*lba == 0) {
+    char fname[16];
+    s32 fsize;
+    snprintf(fname, sizeof(fname), BANK_FILENAME, (int)bank);
+    if (!cd_flocate(fname, lba, &fsize))
+      *lba = 0;
+  }
+  return *lba;
+}
+
+#ifndef NO_PIPELINED_LOAD
+
+// packed resources are read tail first in chunks through a pair of sector buffers;
+// the decoder walks the stream backwards, so it can start on the last chunk while
+// the one before it is still being read
+// every chunk costs a short seek backwards, so don't make them too small
+
+#define PIPE_CHUNK_SECS 8
+#define PIPE_CHUNK_SIZE (PIPE_CHUNK_SECS * RES_SECSIZE)
+
+typedef struct {
+  s32 lba;       // first sector of the packed data
+  u32 skip;      // offset of the packed data in its first sector
+  u32 len;       // packed size
+  s32 nsecs;
+  s16 pending;   // chunk being read, -1 if none
+  u32 t_issue;   // when the pending read was started
+  u32 t_wait;    // total time spent waiting for reads
+  u32 t_overlap; // total time spent unpacking while a read was still running
+  s16 early;     // chunks that were already in when the decoder got to them
+} res_pipe_t;
+
+static u8 res_pipe_buf[2][PIPE_CHUNK_SIZE] __attribute__((aligned(4)));
+
+static void res_pipe_issue(res_pipe_t *p, const s16 chunk) {
+  const s32 first = chunk * PIPE_CHUNK_SECS;
+  s32 n = p->nsecs - first;
+  if (n > PIPE_CHUNK_SECS) n = PIPE_CHUNK_SECS;
+  cd_read_async(p->lba + first, n, res_pipe_buf[chunk & 1]);
+  p->pending = chunk;
+  p->t_issue = timer_get_ticks();
+}
+
+// waits for the pending chunk, makes it the current window and starts reading the one before it,
+// into the buffer the decoder just finished with
+static int res_pipe_refill(unpack_stream_t *s) {
+  res_pipe_t *p = s->user;
+  if (p->pending < 0)
+    return 0;
+
+  // if the read is still going, all of the unpacking since it was issued was hidden behind it
+  // if it's already done, only the read itself was, and there's no telling how long it took,
+  // so those chunks are only counted
+  const u32 t0 = timer_get_ticks();
+  if (cd_read_done())
+    ++p->early;
+  else
+    p->t_overlap += t0 - p->t_issue;
+  cd_read_wait();
+  p->t_wait += timer_get_ticks() - t0;
+
+  const s16 chunk = p->pending;
+  u8 *buf = res_pipe_buf[chunk & 1];
+  const s32 start = chunk * PIPE_CHUNK_SIZE - p->skip; // stream offset of buf[0]
+  s->lo = (start < 0) ? buf - start : buf;
+  s->hi = (start + PIPE_CHUNK_SIZE > (s32)p->len) ? buf + (p->len - start) : buf + PIPE_CHUNK_SIZE;
+
+  p->pending = -1;
+  if (chunk > 0)
+    res_pipe_issue(p, chunk - 1);
+
+  return 1;
+}
+
+static int res_read_bank_pipelined(const mementry_t *me, u8 *out) {
+  const s32 lba = res_get_bank_lba(me->bank);
+  if (!lba)
+    return 0;
+
+  res_pipe_t p;
+  p.lba = lba + me->bank_pos / RES_SECSIZE;
+  p.skip = me->bank_pos % RES_SECSIZE;
+  p.len = me->packed_size;
+  p.nsecs = (p.skip + p.len + RES_SECSIZE - 1) / RES_SECSIZE;
+  p.t_wait = p.t_overlap = 0;
+  p.early = 0;
+
+  unpack_stream_t s;
+  s.refill = res_pipe_refill;
+  s.user = &p;
+
+  const s16 nchunks = (p.nsecs + PIPE_CHUNK_SECS - 1) / PIPE_CHUNK_SECS;
+  const u32 t_start = timer_get_ticks();
+  res_pipe_issue(&p, nchunks - 1);
+  res_pipe_refill(&s);
+  const int ret = bytekiller_unpack_stream(out, me->unpacked_size, &s);
+  cd_read_wait(); // the stream might have ended early if it's broken
+  const u32 t_total = timer_get_ticks() - t_start;
+
+  trace_set_read(res_trace, p.lba, p.len);
+  res_trace->t_cd = p.t_wait;
+  res_trace->t_unpack = t_total - p.t_wait;
+
+  res_log("res_read_bank(%d, %p): bank %d ofs %d packed %d unpacked %d, %d chunks\n",
+    me - res_memlist, out, me->bank, me->bank_pos, me->packed_size, me->unpacked_size, (int)nchunks);
+  res_log("res_read_bank(%d): %u us total, %u us waiting for CD, %u us unpacking, at least %u us of that hidden behind reads (%d chunks were in before they were needed)\n",
+    me - res_memlist, timer_ticks_to_us(t_total), timer_ticks_to_us(p.t_wait),
+    timer_ticks_to_us(t_total - p.t_wait), timer_ticks_to_us(p.t_overlap), (int)p.early);
+
+  return ret;
+}
+
+#endif
+
 static int res_read_bank(const mementry_t *me, u8 *out) {
+#ifndef NO_PIPELINED_LOAD
+  if (me->packed_size != me->unpacked_size)
+    return res_read_bank_pipelined(me, out);
+#endif
   int ret = 0;
   char fname[16];
   u32 count = 0;
+  const u32 t_start = timer_get_ticks();
+  u32 t_read = 0;
   snprintf(fname, sizeof(fname), BANK_FILENAME, (int)me->bank);
   cd_file_t *f = cd_fopen(fname, 1); // allow reopening same handle because we fseek immediately afterwards
   if (f) {
     cd_fseek(f, me->bank_pos, SEEK_SET);
     count = cd_fread(out, me->packed_size, 1, f);
     cd_fclose(f);
+    t_read = timer_get_ticks() - t_start;
+    trace_set_read(res_trace, res_get_bank_lba(me->bank) + me->bank_pos / RES_SECSIZE, me->packed_size);
     ret = (count == me->packed_size);
     if (ret && (me->packed_size != me->unpacked_size)) {
-      printf("res_read_bank(%d, %p): unpacking %d to %d (%p)\n", me - res_memlist, out, me->packed_size, me->unpacked_size, out);
+      res_log("res_read_bank(%d, %p): unpacking %d to %d (%p)\n", me - res_memlist, out, me->packed_size, me->unpacked_size, out);
       ret = bytekiller_unpack(out, me->unpacked_size, out, me->packed_size);
     }
   }
-  printf("res_read_bank(%d, %p): bank %d ofs %d count %d packed %d unpacked %d\n", me - res_memlist, out, me->bank, me->bank_pos, count, me->packed_size, me->unpacked_size);
+  const u32 t_total = timer_get_ticks() - t_start;
+  res_trace->t_cd = t_read;
+  res_trace->t_unpack = t_total - t_read;
+  res_log("res_read_bank(%d, %p): bank %d ofs %d count %d packed %d unpacked %d\n", me - res_memlist, out, me->bank, me->bank_pos, count, me->packed_size, me->unpacked_size);
+  res_log("res_read_bank(%d): %u us total, %u us reading, %u us unpacking\n", me - res_memlist,
+    timer_ticks_to_us(t_total), timer_ticks_to_us(t_read), timer_ticks_to_us(t_total - t_read));
   return ret;
 }
 
-static void res_do_load(void) {
+#ifndef NO_PREFETCH
+
+// the prefetcher streams the resources of the part we're probably going to
+// transition to next into a staging area at the top of free memory, using
+// background reads while the game is running; res_setup_part() then takes them
+// from there instead of going to the disc
+
+#define PREFETCH_MAX_ENTRIES 4
+#define PREFETCH_SECSIZE     2048
+#define PREFETCH_CHUNK_SECS  16 // sectors per background read
+#define PREFETCH_IDLE_FRAMES 30 // how long the loader has to be idle before we start
+#define PREFETCH_HEADROOM    (64 * 1024) // memory left for loads during gameplay
+
+typedef struct {
+  u16 resnum;
+  u16 nsecs;
+  u16 secs_read; // sectors requested so far
+  u16 skip;      // offset of the resource data in its first sector
+  s32 lba;       // first sector of the resource data on disc
+  u8 *buf;       // sector copy in the staging area
+  u8 *data;      // where the resource data begins in buf
+} prefetch_entry_t;
+
+static struct {
+  u16 part; // part being prefetched, 0 if none
+  u8 num;
+  u8 cur;
+  u8 done;
+  u8 *base; // staging area
+  u8 *end;
+  prefetch_entry_t ent[PREFETCH_MAX_ENTRIES];
+} res_pf;
+
+static inline u16 res_predict_next_part(const u16 part_id) {
+  // parts go in order, the password screen could lead anywhere
+  if (part_id >= PART_COPY_PROTECTION && part_id < PART_FINAL)
+    return part_id + 1;
+  return 0;
+}
+
+static void res_prefetch_cancel(void) {
+  if (res_pf.part) {
+    cd_read_wait();
+    res_pf.part = 0;
+  }
+}
+
+void res_prefetch(const u16 part_id) {
+  if (res_pf.part == part_id || part_id == res_cur_part)
+    return;
+
+  res_prefetch_cancel();
+  res_pf_tried = part_id;
+
+  if (part_id < PART_BASE || part_id > PART_LAST)
+    return;
+
+  const mempart_t *part = res_memlist_parts + (part_id - PART_BASE);
+  const u8 list[] = { part->me_pal, part->me_code, part->me_vid1, part->me_vid2 };
+  char fname[24] = { 0 };
+  char lastfname[24] = { 0 };
+  s32 lba = 0, fsize = 0;
+  u32 total = 0;
+  u32 reserve = 0;
+
+  res_pf.num = 0;
+  for (u32 i = 0; i < sizeof(list); ++i) {
+    const u16 resnum = list[i];
+    const mementry_t *me = res_memlist + resnum;
+    if (resnum == 0 || me->bank == 0 || (res_have_pack && res_pack[resnum].format == PF_NONE))
+      continue;
+
+    if (res_is_shared(resnum)) {
+      // shared resources that are already loaded will stay resident
+      if (me->status == RS_LOADED)
+        continue;
+      // the rest go to the pinned region right above the staging area, so leave room for them
+      reserve += ALIGN(res_get_load_size(me), 4);
+    }
+
+    u32 ofs, len;
+    if (res_have_pack) {
+      strncpy(fname, PACK_FILENAME, sizeof(fname) - 1);
+      ofs = res_pack[resnum].offset;
+      len = res_pack[resnum].size;
+    } else {
+      snprintf(fname, sizeof(fname), BANK_FILENAME, (int)me->bank);
+      ofs = me->bank_pos;
+      len = me->packed_size;
+    }
+
+    if (strcmp(fname, lastfname)) {
+      if (!cd_flocate(fname, &lba, &fsize))
+        return;
+      strcpy(lastfname, fname);
+    }
+
+    prefetch_entry_t *e = res_pf.ent + res_pf.num++;
+    e->resnum = resnum;
+    e->lba = lba + ofs / PREFETCH_SECSIZE;
+    e->skip = ofs % PREFETCH_SECSIZE;
+    e->nsecs = (e->skip + len + PREFETCH_SECSIZE - 1) / PREFETCH_SECSIZE;
+    e->secs_read = 0;
+    total += e->nsecs * PREFETCH_SECSIZE;
+  }
+
+  if (!res_pf.num)
+    return;
+
+  if (reserve + total + PREFETCH_HEADROOM > arena_get_free()) {
+    printf("res_prefetch(%05d): not enough memory to stage %u bytes\n", (int)part_id, total);
+    return;
+  }
+
+  u8 *base = arena_get_base(ARENA_PINNED) - reserve - total;
+  res_pf.base = base;
+  res_pf.end = base + total;
+  for (u8 i = 0; i < res_pf.num; ++i) {
+    prefetch_entry_t *e = res_pf.ent + i;
+    e->buf = base;
+    e->data = base + e->skip;
+    base += e->nsecs * PREFETCH_SECSIZE;
+  }
+
+  res_pf.cur = 0;
+  res_pf.done = 0;
+  res_pf.part = part_id;
+
+  res_log("res_prefetch(%05d): staging %d entries, %u bytes at %p\n", (int)part_id, (int)res_pf.num, total, res_pf.base);
+}
+
+// issues the next background read if the previous one is done; returns 1 when everything is in
+static int res_prefetch_step(void) {
+  if (res_pf.done)
+    return 1;
+
+  if (!cd_read_done())
+    return 0;
+
+  while (res_pf.cur < res_pf.num) {
+    prefetch_entry_t *e = res_pf.ent + res_pf.cur;
+    if (e->secs_read < e->nsecs) {
+      u16 n = e->nsecs - e->secs_read;
+      if (n > PREFETCH_CHUNK_SECS) n = PREFETCH_CHUNK_SECS;
+      cd_read_async(e->lba + e->secs_read, n, e->buf + e->secs_read * PREFETCH_SECSIZE);
+      e->secs_read += n;
+      return 0;
+    }
+    ++res_pf.cur;
+  }
+
+  res_pf.done = 1;
+  res_log("res_prefetch_step(): part %05d is staged\n", (int)res_pf.part);
+  return 1;
+}
+
+// copies the resource from the staging area if it's there
+static int res_prefetch_take(const mementry_t *me, u8 *out) {
+  if (!res_pf.part || !res_pf.done)
+    return 0;
+
+  const u16 resnum = me - res_memlist;
+  for (u8 i = 0; i < res_pf.num; ++i) {
+    const prefetch_entry_t *e = res_pf.ent + i;
+    if (e->resnum != resnum)
+      continue;
+    const u32 t_start = timer_get_ticks();
+    int ret = 1;
+    res_trace->source = TRACE_SRC_PREFETCH;
+    if (res_have_pack || me->packed_size == me->unpacked_size) {
+      memcpy(out, e->data, res_get_load_size(me));
+      res_log("res_prefetch_take(%d, %p): copied from staging\n", (int)resnum, out);
+    } else {
+      res_log("res_prefetch_take(%d, %p): unpacking from staging\n", (int)resnum, out);
+      ret = bytekiller_unpack(out, me->unpacked_size, e->data, me->packed_size);
+    }
+    res_trace->t_unpack = timer_get_ticks() - t_start;
+    return ret;
+  }
+
+  return 0;
+}
+
+#endif
+
+static int res_read_pack(const mementry_t *me, u8 *out) {
+  const pack_entry_t *pe = res_pack + (me - res_memlist);
+  const u32 t_start = timer_get_ticks();
+  u32 count = 0;
+  if (pe->format != PF_NONE) {
+    cd_file_t *f = cd_fopen(PACK_FILENAME, 1);
+    if (f) {
+      cd_fseek(f, pe->offset, SEEK_SET);
+      count = cd_fread(out, pe->size, 1, f);
+      cd_fclose(f);
+      trace_set_read(res_trace, res_pack_lba + pe->offset / RES_SECSIZE, pe->size);
+    }
+  }
+  res_trace->t_cd = timer_get_ticks() - t_start;
+  res_log("res_read_pack(%d, %p): ofs %d count %d size %d format %d\n", me - res_memlist, out, pe->offset, count, pe->size, (int)pe->format);
+  return (pe->format != PF_NONE && count == pe->size);
+}
+
+static int res_read(const mementry_t *me, u8 *out) {
+#ifndef NO_PREFETCH
+  if (res_prefetch_take(me, out))
+    return 1;
+#endif
+  return res_have_pack ? res_read_pack(me, out) : res_read_bank(me, out);
+}
+
+// non-shared resources go to `region`
+static void res_do_load(const int region) {
+#ifndef NO_PREFETCH
+  res_idle_frames = 0;
+#endif
+
   while (1) {
     // find pending entry with max rank
     mementry_t *me = NULL;
@@ -144,46 +656,79 @@ static void res_do_load(void) {
     if (!me) break;
 
     const int resnum = me - res_memlist;
-    u8 *memptr = NULL;
-    if (me->type == RT_BITMAP) {
-      memptr = res_vid_ptr;
+    if (me->bank == 0) {
+      res_log("res_do_load(): res %d has NULL banknum\n", resnum);
+      me->status = RS_NULL;
+      continue;
+    }
+
+    const u32 size = res_get_load_size(me);
+    int rgn;
+    u8 *memptr;
+    if (me->type == RT_BITMAP && res_have_pack) {
+      // pack bitmaps are already chunky and can go straight to the screen page
+      rgn = -1;
+      memptr = gfx_get_bitmap_buffer();
     } else {
-      memptr = res_script_ptr;
-      // video data seg is after the script data seg, check if they'll intersect
-      if (me->unpacked_size > (u32)(res_vid_membase - res_script_ptr)) {
+      if (me->type == RT_BITMAP)
+        rgn = ARENA_SCRATCH;
+      else
+        rgn = res_is_shared(resnum) ? ARENA_PINNED : region;
+      memptr = arena_alloc(rgn, size);
+      if (!memptr) {
         printf("res_do_load(): not enough memory to load resource %d\n", resnum);
         me->status = RS_NULL;
         continue;
       }
+#ifndef NO_PREFETCH
+      // actual loads always take priority over the staging area
+      if (res_pf.part && memptr < res_pf.end && memptr + size > res_pf.base) {
+        res_log("res_do_load(): resource %d needs the staging area, dropping prefetch\n", resnum);
+        res_prefetch_cancel();
+      }
+#endif
     }
 
-    if (me->bank == 0) {
-      printf("res_do_load(): res %d has NULL banknum\n", resnum);
-      me->status = RS_NULL;
-    } else {
-      if (res_read_bank(me, memptr)) {
-        printf("res_do_load(): read res %d (type %d) from bank %d\n", me - res_memlist, me->type, me->bank);
-        if (me->type == RT_BITMAP) {
-          gfx_blit_bitmap(res_vid_ptr, me->unpacked_size);
-          me->status = RS_NULL;
-        } else {
-          me->bufptr = memptr;
-          me->status = RS_LOADED;
-          res_script_ptr += me->unpacked_size;
-          if (me->type == RT_SOUND) {
-            printf("res_do_load(): precaching sound %d size %d\n", resnum, me->unpacked_size);
-            snd_cache_sound(me->bufptr, me->unpacked_size, SND_TYPE_PCM_WITH_HEADER);
-          }
+    res_trace = trace_begin_load(res_cur_part, resnum, me->type, me->bank);
+    res_trace->source = res_have_pack ? TRACE_SRC_PACK : TRACE_SRC_BANK;
+    const int ok = res_read(me, memptr);
+    if (ok) {
+      res_log("res_do_load(): read res %d (type %d) from bank %d\n", me - res_memlist, me->type, me->bank);
+      if (me->type == RT_BITMAP) {
+        if (!res_have_pack) {
+          const u32 t_start = timer_get_ticks();
+          gfx_blit_bitmap(memptr, me->unpacked_size);
+          res_trace->t_unpack += timer_get_ticks() - t_start;
+          arena_reset(ARENA_SCRATCH);
+        }
+        me->status = RS_NULL;
+      } else {
+        me->bufptr = memptr;
+        me->status = RS_LOADED;
+        if (me->type == RT_SOUND) {
+          res_log("res_do_load(): precaching sound %d size %d\n", resnum, size);
+          const u32 t_start = timer_get_ticks();
+          me->sound = snd_cache_sound(resnum, me->bufptr, size, res_have_pack ? SND_TYPE_ADPCM : SND_TYPE_PCM_WITH_HEADER);
+          res_trace->t_spu = timer_get_ticks() - t_start;
         }
-      } else if (me->bank == 12 && me->type == RT_BANK) {
+      }
+    }
+    trace_end_load(res_trace, ok);
+
+    if (!ok) {
+      if (me->bank == 12 && me->type == RT_BANK) {
         // DOS demo does not have this resource, ignore it
+        arena_rollback(rgn, memptr, size);
         me->status = RS_NULL;
-        continue;
       } else {
         panic("res_do_load(): could not load resource %d from bank %d", resnum, (int)me->bank);
       }
     }
   }
+
+  // sounds upload in the background while the next resource is loaded, but the
+  // script is going to want to play them as soon as this returns
+  snd_flush_uploads();
 }
 
 void res_setup_part(const u16 part_id) {
@@ -191,26 +736,54 @@ void res_setup_part(const u16 part_id) {
     if (part_id < PART_BASE || part_id > PART_LAST)
       panic("res_setup_part(%05d): invalid part", (int)part_id);
 
+    trace_begin_part();
+
+#ifndef NO_PREFETCH
+    // if we guessed right, finish the prefetch, otherwise it's useless
+    if (res_pf.part == part_id) {
+      while (!res_prefetch_step());
+    } else {
+      res_prefetch_cancel();
+    }
+#endif
+
     const mempart_t part = res_memlist_parts[part_id - PART_BASE];
-    res_invalidate_all();
+    const u32 kept = res_invalidate_part(part_id);
+    // loads from here on are traced as belonging to the new part
+    res_cur_part = part_id;
 
-    res_memlist[part.me_pal ].status = RS_TOLOAD;
-    res_memlist[part.me_code].status = RS_TOLOAD;
-    res_memlist[part.me_vid1].status = RS_TOLOAD;
-    if (part.me_vid2 != 0)
+    // anything that's still loaded is already resident in the pinned area
+    if (res_memlist[part.me_pal].status == RS_NULL)
+      res_memlist[part.me_pal].status = RS_TOLOAD;
+    if (res_memlist[part.me_code].status == RS_NULL)
+      res_memlist[part.me_code].status = RS_TOLOAD;
+    if (res_memlist[part.me_vid1].status == RS_NULL)
+      res_memlist[part.me_vid1].status = RS_TOLOAD;
+    if (part.me_vid2 != 0 && res_memlist[part.me_vid2].status == RS_NULL)
       res_memlist[part.me_vid2].status = RS_TOLOAD;
-    res_do_load();
+    res_do_load(ARENA_PART);
 
     res_seg_video_pal = res_memlist[part.me_pal].bufptr;
     res_seg_code = res_memlist[part.me_code].bufptr;
+    res_seg_code_size = res_memlist[part.me_code].unpacked_size;
     res_seg_video[0] = res_memlist[part.me_vid1].bufptr;
     if (part.me_vid2 != 0)
       res_seg_video[1] = res_memlist[part.me_vid2].bufptr;
-  
-    res_cur_part = part_id;
+
+#ifndef NO_PREFETCH
+    // staging area is free game now
+    res_prefetch_cancel();
+    res_pf_tried = 0;
+#endif
+
+    trace_end_part(part_id, kept);
+#ifdef RES_VERBOSE
+    res_dump_layout();
+#endif
   }
 
-  res_script_membase = res_script_ptr;
+  // anything loaded after this point gets dropped by res_invalidate_res()
+  arena_commit_part();
 }
 
 void res_load(const u16 res_id) {
@@ -221,8 +794,54 @@ void res_load(const u16 res_id) {
   mementry_t *me = res_memlist + res_id;
   if (me->status == RS_NULL) {
     me->status = RS_TOLOAD;
-    res_do_load();
+    res_do_load(ARENA_TRANSIENT);
+  }
+}
+
+void res_update(void) {
+#ifndef NO_PREFETCH
+  if (res_pf.part) {
+    res_prefetch_step();
+  } else if (res_idle_frames < PREFETCH_IDLE_FRAMES) {
+    ++res_idle_frames;
+  } else {
+    const u16 next = res_predict_next_part(res_cur_part);
+    if (next && next != res_pf_tried)
+      res_prefetch(next);
   }
+#endif
+}
+
+// prints the arena state and where every loaded resource is, along with how
+// much of each region is taken up by alignment and idle pinned resources, then the SPU RAM state
+void res_dump_layout(void) {
+  u32 live[ARENA_NUM_REGIONS] = { 0 };
+  u32 idle = 0;
+  const u16 mask = (res_cur_part >= PART_BASE) ? PART_MASK(res_cur_part) : 0;
+
+  arena_dump();
+
+  for (u16 i = 0; i < res_memlist_num; ++i) {
+    const mementry_t *me = res_memlist + i;
+    if (me->status != RS_LOADED)
+      continue;
+    const u32 size = res_get_load_size(me);
+    const int rgn = arena_find_region(me->bufptr);
+    printf("  res %3d type %d at %p size %6u in %s\n", (int)i, (int)me->type, me->bufptr, size,
+      (rgn < 0) ? "???" : arena_get_region_name(rgn));
+    if (rgn < 0)
+      continue;
+    live[rgn] += size;
+    if (rgn == ARENA_PINNED && !(res_part_refs[i] & mask))
+      idle += size;
+  }
+
+  for (int i = ARENA_PART; i <= ARENA_PINNED; ++i) {
+    const u32 used = arena_get_stats(i)->used;
+    printf("  %-9s %7u live, %5u lost to alignment\n", arena_get_region_name(i), live[i], used - live[i]);
+  }
+  printf("  %u bytes pinned for other parts, largest free block %u\n", idle, arena_get_free());
+  snd_dump_stats();
 }
 
 const mementry_t *res_get_entry(const u16 res_id) {
@@ -231,12 +850,15 @@ const mementry_t *res_get_entry(const u16 res_id) {
   return res_memlist + res_id;
 }
 
-const char *res_get_string(const string_t *strtab, const u16 str_id) {
-  if (strtab == NULL) strtab = res_str_tab;
-  if (strtab == NULL) return NULL;
-  for (u16 i = 0; i < 0x100 && strtab[i].id != 0xFFFF; ++i) {
-    if (strtab[i].id == str_id)
-      return strtab[i].str;
-  }
-  return NULL;
+const strindex_t *res_get_str_index(const int lang) {
+  return res_str_index + lang;
+}
+
+const char *res_get_string(const u16 str_id, u16 *len) {
+  if (res_str_tab == NULL || str_id >= STR_MAX_ID) return NULL;
+  const u8 slot = res_str_tab->slot[str_id];
+  if (!slot) return NULL;
+  const strentry_t *ent = res_str_tab->ent + slot - 1;
+  if (len) *len = ent->len;
+  return ent->str;
 }
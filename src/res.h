@@ -7,6 +7,7 @@
 #define MEMLIST_FILENAME    "\\DATA\\MEMLIST.BIN;1"
 #define BANK_FILENAME       "\\DATA\\BANK%02X;1"
 #define MEMBLOCK_SIZE       1 * 1024 * 1024
+#define MEMENTRY_FILE_SIZE  0x14 // size of a memlist entry on disk
 
 #pragma pack(push, 1)
 
@@ -19,6 +20,8 @@ typedef struct {
   u32 bank_pos;      // 0x8
   u32 packed_size;   // 0xC
   u32 unpacked_size; // 0x12
+  // not in the file:
+  u8 sound;          // 0x14 sound handle (see snd.h) if this is a loaded sound, SND_NONE otherwise
 } mementry_t;
 
 #pragma pack(pop)
@@ -33,6 +36,27 @@ enum res_type_e {
   RT_BANK     = 6, // common part shapes (bank2.mat)
 };
 
+enum res_lang_e {
+  LANG_EN = 0,
+  LANG_FR = 1,
+  LANG_COUNT
+};
+
+#define STR_MAX_ID      0x412 // highest string id + 1
+#define STR_MAX_ENTRIES 255
+
+// dense id -> string lookup built from a string table at startup
+typedef struct {
+  const char *str;
+  u16 len;
+} strentry_t;
+
+typedef struct {
+  u8 slot[STR_MAX_ID]; // index into ent + 1, 0 if there's no such string
+  u8 num;
+  strentry_t ent[STR_MAX_ENTRIES];
+} strindex_t;
+
 enum res_status_e {
   RS_NULL   = 0,
   RS_LOADED = 1,
@@ -40,18 +64,24 @@ enum res_status_e {
 };
 
 extern u8 *res_seg_code;
+extern u32 res_seg_code_size;
 extern u8 *res_seg_video[2];
 extern u8 *res_seg_video_pal;
 extern int res_vidseg_idx;
 extern u16 res_next_part;
 extern u16 res_cur_part;
-extern const string_t *res_str_tab;
+extern const strindex_t *res_str_tab;
 extern int res_have_password;
+extern int res_have_pack;
 
 void res_init(void);
 void res_invalidate_res(void);
 void res_invalidate_all(void);
 void res_setup_part(const u16 part_id);
 void res_load(const u16 res_id);
-const char *res_get_string(const string_t *strtab, const u16 str_id);
+void res_prefetch(const u16 part_id);
+void res_update(void);
+void res_dump_layout(void);
+const strindex_t *res_get_str_index(const int lang);
+const char *res_get_string(const u16 str_id, u16 *len);
 const mementry_t *res_get_entry(const u16 res_id);
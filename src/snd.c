@@ -1,8 +1,14 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <stdio.h>
+
+// tools/sndtest.c builds this file on the host with its own libpsxspu calls,
+// and IO_ADDR() pointing the registers below at a fake SPU
+#ifndef SNDTEST
 #include <psxapi.h>
 #include <psxspu.h>
+#define IO_ADDR(addr) (addr)
+#endif
 
 #include "types.h"
 #include "util.h"
@@ -16,21 +22,55 @@
 #define SPU_VOL_MIN -0x4000
 #define SPU_VOL_RANGE (SPU_VOL_MAX - SPU_VOL_MIN)
 
+// music has voices 0-3 to itself, the game's 4 sound channels get spread over the rest
 #define CH_SOUND_BASE 4
 #define CH_MUSIC_BASE 0
 #define CH_SOUND_COUNT 4
 #define CH_MUSIC_COUNT 4
+#define CH_NONE 0xFF
+
+#define SFX_VOICE_COUNT (SPU_NUM_VOICES - CH_SOUND_BASE)
+#define SFX_RELEASE_ADSR 0x000A // linear release at shift 10, ~45ms from full volume
+#define SFX_RELEASE_FRAMES 4    // voice is considered free after this many frames of release even if
+                                // the envelope somehow isn't at 0 yet
+
+#define SND_RAMP_FRAMES 2 // stopped sounds fade out over this many frames
 
 #define VAG_DATA_OFFSET 48
 #define PCM_DATA_OFFSET 8
 
-#define SND_CVTBUF_SIZE (64 * 1024)
+#define SND_CVTBUF_SIZE  (40 * 1024) // 64K PCM samples come out at ~37K of ADPCM
+#define SND_CVTBUF_COUNT 2           // so that one can be converted into while the other is uploading
+#define SND_UPLOAD_QUEUE 8
+
+#define SPU_MAX_FREE_BLOCKS (MAX_SOUNDS + 1) // there can't be more holes than sounds
+#define SND_NO_RES 0xFFFF
+
+#define SPU_VOICE_BASE ((volatile u16 *)IO_ADDR(0x1F801C00))
+#define SPU_KEY_ON_LO  ((volatile u16 *)IO_ADDR(0x1F801D88))
+#define SPU_KEY_ON_HI  ((volatile u16 *)IO_ADDR(0x1F801D8A))
+#define SPU_KEY_OFF_LO ((volatile u16 *)IO_ADDR(0x1F801D8C))
+#define SPU_KEY_OFF_HI ((volatile u16 *)IO_ADDR(0x1F801D8E))
+#define SPU_ENDX_LO    ((volatile u16 *)IO_ADDR(0x1F801D9C))
+#define SPU_ENDX_HI    ((volatile u16 *)IO_ADDR(0x1F801D9E))
+#define SPU_STATUS     ((volatile u16 *)IO_ADDR(0x1F801DAE))
+#define SPU_STATUS_XFER_BUSY (1 << 10)
+
+#define DMA_SPU_CHCR   ((volatile u32 *)IO_ADDR(0x1F8010C8))
+#define DMA_CHCR_BUSY  (1 << 24)
+
+#define IRQ_MASK       ((volatile u32 *)IO_ADDR(0x1F801074))
+#define IRQ_RCNT1      (1 << 5)
+
+#define SPU_NUM_VOICES 24
 
-#define SPU_VOICE_BASE ((volatile u16 *)(0x1F801C00))
-#define SPU_KEY_ON_LO  ((volatile u16 *)(0x1F801D88))
-#define SPU_KEY_ON_HI  ((volatile u16 *)(0x1F801D8A))
-#define SPU_KEY_OFF_LO ((volatile u16 *)(0x1F801D8C))
-#define SPU_KEY_OFF_HI ((volatile u16 *)(0x1F801D8E))
+#define SHADOW_VOL   (1 << 0)
+#define SHADOW_PITCH (1 << 1)
+#define SHADOW_ADDR  (1 << 2)
+
+#define ADPCM_FLAG_END    (1 << 0)
+#define ADPCM_FLAG_REPEAT (1 << 1)
+#define ADPCM_FLAG_START  (1 << 2)
 
 struct spu_voice {
   volatile s16 vol_left;
@@ -44,43 +84,248 @@ struct spu_voice {
 };
 #define SPU_VOICE(x) (((volatile struct spu_voice *)SPU_VOICE_BASE) + (x))
 
+// sounds stay in SPU RAM after the resource they came from is dropped ("detached"),
+// so if the same resource gets loaded again it doesn't have to be converted and uploaded;
+// detached sounds are evicted least recently used first when SPU RAM runs out
 struct sound {
-  const u8 *addr;
+  const u8 *addr;  // resource data this is attached to, NULL if detached
   s32 spuaddr;
   s32 size;
+  s32 alloc_size;  // size of the SPU RAM block, 0 if none
+  u16 resid;       // SND_NO_RES if the slot is free
+  u8 ready;        // data is in SPU RAM; 0 while the upload is still queued or running
+  u8 loops;        // jumps back to a loop point, so ENDX doesn't mean it's done
+  u32 last_use;
 };
 
-static u8 snd_cvtbuf[SND_CVTBUF_SIZE] __attribute__((aligned(64)));
+typedef struct {
+  sound_t *snd;
+  const u8 *src;
+  s32 cvtbuf; // conversion buffer the data is in, -1 if it's uploaded straight from the resource
+} snd_upload_t;
+
+typedef struct {
+  s32 addr;
+  s32 size;
+} spu_block_t;
+
+// what the voice registers are supposed to be; changes only hit the SPU in snd_flush()
+typedef struct {
+  s16 vol;
+  u16 pitch;
+  u16 addr;
+  u8 dirty; // SHADOW_ bits
+} spu_shadow_t;
+
+typedef struct {
+  u8 ch;           // sound channel playing on this voice, CH_NONE if it's free or releasing
+  u8 releasing;
+  u32 started;     // for picking the oldest voice to steal
+  u32 release_end; // frame after which the release is surely over
+} sfx_voice_t;
+
+static u8 snd_cvtbuf[SND_CVTBUF_COUNT][SND_CVTBUF_SIZE] __attribute__((aligned(64)));
+static u8 snd_cvtbuf_busy[SND_CVTBUF_COUNT];
+
+// pending SPU transfers, the first one is running if snd_upq_active is set
+static snd_upload_t snd_upq[SND_UPLOAD_QUEUE];
+static int snd_upq_head = 0;
+static int snd_upq_num = 0;
+static int snd_upq_active = 0;
 
 static sound_t snd_cache[MAX_SOUNDS];
-static u32 snd_cache_num = 0;
-static s32 snd_spu_ptr = 0; // current SPU mem address
+static u32 snd_clock = 0;
+
+// free SPU RAM, sorted by address, neighbours always coalesced
+static spu_block_t spu_free[SPU_MAX_FREE_BLOCKS];
+static int spu_num_free = 0;
+
+static snd_stats_t snd_stats;
+
+static u32 snd_key_mask = 0;     // voices that are supposed to be making noise
+static u32 snd_release_mask = 0; // ... of which have been keyed off and are in release
+static u32 snd_ramp_mask = 0;    // voices fading out, see snd_stop_sound()
+static s16 snd_ramp_step[SPU_NUM_VOICES];
+static sound_t *snd_voice_sound[SPU_NUM_VOICES]; // what each voice was last keyed on with
+
+static spu_shadow_t spu_shadow[SPU_NUM_VOICES];
+static u32 spu_dirty_mask = 0;   // voices with changed registers
+static u32 spu_kon_pending = 0;
+static u32 spu_koff_pending = 0;
+static u32 spu_kon_recent = 0;   // voices keyed on since the last snd_update_voices(), see there
+
+static sfx_voice_t sfx_voices[SPU_NUM_VOICES]; // only CH_SOUND_BASE and up are used
+static u8 sfx_ch_voice[CH_SOUND_COUNT];        // voice each sound channel is on, CH_NONE if none
+static u32 sfx_clock = 0;
+static u32 snd_frame = 0;
+static u32 snd_voice_plays[SPU_NUM_VOICES];
+static u32 snd_voice_steals[SPU_NUM_VOICES];
+
+// the music IRQ touches the voice state too, so the main thread keeps it out while it does;
+// masking just the timer interrupt is a lot cheaper than a critical section
+static inline u32 snd_lock(void) {
+  const u32 mask = *IRQ_MASK;
+  *IRQ_MASK = mask & ~IRQ_RCNT1;
+  return mask;
+}
 
-static u32 snd_key_mask = 0;
+static inline void snd_unlock(const u32 mask) {
+  *IRQ_MASK = mask;
+}
 
 static inline u16 freq2pitch(const u32 hz) {
   return (hz << 12) / 44100;
 }
 
+static void spu_free_block(const s32 addr, const s32 size) {
+  // find where it goes
+  int i = 0;
+  while (i < spu_num_free && spu_free[i].addr < addr)
+    ++i;
+
+  const int merge_prev = (i > 0 && spu_free[i - 1].addr + spu_free[i - 1].size == addr);
+  const int merge_next = (i < spu_num_free && addr + size == spu_free[i].addr);
+
+  if (merge_prev && merge_next) {
+    spu_free[i - 1].size += size + spu_free[i].size;
+    for (int j = i; j < spu_num_free - 1; ++j)
+      spu_free[j] = spu_free[j + 1];
+    --spu_num_free;
+  } else if (merge_prev) {
+    spu_free[i - 1].size += size;
+  } else if (merge_next) {
+    spu_free[i].addr = addr;
+    spu_free[i].size += size;
+  } else {
+    ASSERT(spu_num_free < SPU_MAX_FREE_BLOCKS);
+    for (int j = spu_num_free; j > i; --j)
+      spu_free[j] = spu_free[j - 1];
+    spu_free[i].addr = addr;
+    spu_free[i].size = size;
+    ++spu_num_free;
+  }
+
+  snd_stats.used -= size;
+}
+
+// best fit, so that small sounds fill up holes instead of eating into the big free block
+static s32 spu_alloc_block(const s32 size) {
+  int best = -1;
+  for (int i = 0; i < spu_num_free; ++i) {
+    if (spu_free[i].size >= size && (best < 0 || spu_free[i].size < spu_free[best].size))
+      best = i;
+  }
+  if (best < 0)
+    return -1;
+
+  const s32 addr = spu_free[best].addr;
+  spu_free[best].addr += size;
+  spu_free[best].size -= size;
+  if (spu_free[best].size == 0) {
+    for (int j = best; j < spu_num_free - 1; ++j)
+      spu_free[j] = spu_free[j + 1];
+    --spu_num_free;
+  }
+
+  snd_stats.used += size;
+  if (snd_stats.used > snd_stats.peak)
+    snd_stats.peak = snd_stats.used;
+  return addr;
+}
+
+static inline int snd_is_playing(const sound_t *snd) {
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    if (snd_voice_sound[v] == snd && (snd_key_mask & SPU_VOICECH(v)))
+      return 1;
+  }
+  return 0;
+}
+
+static void snd_evict(sound_t *snd) {
+  if (snd->alloc_size)
+    spu_free_block(snd->spuaddr, snd->alloc_size);
+  const u32 lock = snd_lock();
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    if (snd_voice_sound[v] == snd) {
+      // the voice can still be in its release or sitting on the silent block at the end,
+      // and it'll play whatever gets uploaded here next, so shut it up before that instead
+      // of at the next flush
+      SPU_VOICE(v)->vol_left = 0;
+      SPU_VOICE(v)->vol_right = 0;
+      spu_shadow[v].vol = 0;
+      spu_shadow[v].dirty &= ~SHADOW_VOL;
+      snd_voice_sound[v] = NULL;
+    }
+  }
+  snd_unlock(lock);
+  snd->resid = SND_NO_RES;
+  snd->addr = NULL;
+  snd->spuaddr = -1;
+  snd->size = snd->alloc_size = 0;
+}
+
+// drops the least recently used detached sound that's not playing, returns 0 if there's none
+static int snd_evict_lru(void) {
+  sound_t *victim = NULL;
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    sound_t *snd = snd_cache + i;
+    if (snd->resid == SND_NO_RES || snd->addr || !snd->alloc_size || snd_is_playing(snd))
+      continue;
+    if (!victim || snd->last_use < victim->last_use)
+      victim = snd;
+  }
+  if (!victim)
+    return 0;
+  snd_evict(victim);
+  ++snd_stats.evictions;
+  return 1;
+}
+
 static inline s32 spu_alloc(s32 size) {
   // SPU likes 8-byte alignment
   size = ALIGN(size, 8);
-  ASSERT(snd_spu_ptr + size <= SPU_MEM_MAX);
-  const s32 ptr = snd_spu_ptr;
-  snd_spu_ptr += size;
+  s32 ptr;
+  while ((ptr = spu_alloc_block(size)) < 0) {
+    if (!snd_evict_lru()) {
+      snd_dump_stats();
+      panic("spu_alloc(%d): out of SPU memory", size);
+    }
+  }
   return ptr;
 }
 
+static inline void spu_shadow_vol(const u32 v, const s16 vol) {
+  if (spu_shadow[v].vol != vol) {
+    spu_shadow[v].vol = vol;
+    spu_shadow[v].dirty |= SHADOW_VOL;
+    spu_dirty_mask |= SPU_VOICECH(v);
+  }
+}
+
+static inline void spu_shadow_pitch(const u32 v, const u16 pitch) {
+  if (spu_shadow[v].pitch != pitch) {
+    spu_shadow[v].pitch = pitch;
+    spu_shadow[v].dirty |= SHADOW_PITCH;
+    spu_dirty_mask |= SPU_VOICECH(v);
+  }
+}
+
+static inline void spu_shadow_addr(const u32 v, const u16 addr) {
+  if (spu_shadow[v].addr != addr) {
+    spu_shadow[v].addr = addr;
+    spu_shadow[v].dirty |= SHADOW_ADDR;
+    spu_dirty_mask |= SPU_VOICECH(v);
+  }
+}
+
 static inline void spu_key_on(const u32 mask) {
-  SpuWait(); // TODO: is this advisable to do in an interrupt handler?
-  *SPU_KEY_ON_LO = mask;
-  *SPU_KEY_ON_HI = mask >> 16;
+  spu_kon_pending |= mask;
+  spu_koff_pending &= ~mask;
 }
 
 static inline void spu_key_off(const u32 mask) {
-  SpuWait(); // TODO: is this advisable to do in an interrupt handler?
-  *SPU_KEY_OFF_LO = mask;
-  *SPU_KEY_OFF_HI = mask >> 16;
+  spu_koff_pending |= mask;
+  spu_kon_pending &= ~mask;
 }
 
 static inline void spu_clear_voice(const u32 v) {
@@ -92,6 +337,10 @@ static inline void spu_clear_voice(const u32 v) {
   SPU_VOICE(v)->attack_decay = 0x000F;
   SPU_VOICE(v)->sustain_release = 0x0000;
   SPU_VOICE(v)->vol_current = 0;
+  spu_shadow[v].vol = 0;
+  spu_shadow[v].pitch = 0;
+  spu_shadow[v].addr = 0;
+  spu_shadow[v].dirty = 0;
 }
 
 // unfortunately the psn00bsdk function for this is bugged:
@@ -101,58 +350,200 @@ static inline void spu_clear_voice(const u32 v) {
 // so we have to implement the function in assembly (see spu.s)
 extern u32 spu_set_transfer_addr(const u32 addr);
 
+// retires the running transfer if the DMA is done and starts the next one
+// SpuWrite() only kicks off the DMA, so nothing in here ever waits
+static void snd_upload_poll(void) {
+  while (snd_upq_num) {
+    snd_upload_t *up = snd_upq + snd_upq_head;
+    if (snd_upq_active) {
+      if ((*DMA_SPU_CHCR & DMA_CHCR_BUSY) || (*SPU_STATUS & SPU_STATUS_XFER_BUSY))
+        return;
+      up->snd->ready = 1;
+      if (up->cvtbuf >= 0)
+        snd_cvtbuf_busy[up->cvtbuf] = 0;
+      snd_upq_head = (snd_upq_head + 1) % SND_UPLOAD_QUEUE;
+      --snd_upq_num;
+      snd_upq_active = 0;
+      continue;
+    }
+    SpuSetTransferMode(SPU_TRANSFER_BY_DMA);
+    spu_set_transfer_addr(up->snd->spuaddr);
+    SpuWrite((void *)up->src, up->snd->size);
+    snd_upq_active = 1;
+    return;
+  }
+}
+
+static void snd_upload(sound_t *snd, const u8 *src, const s32 cvtbuf) {
+  while (snd_upq_num == SND_UPLOAD_QUEUE)
+    snd_upload_poll();
+  snd_upload_t *up = snd_upq + (snd_upq_head + snd_upq_num) % SND_UPLOAD_QUEUE;
+  up->snd = snd;
+  up->src = src;
+  up->cvtbuf = cvtbuf;
+  snd->ready = 0;
+  ++snd_upq_num;
+  snd_upload_poll();
+}
+
+// returns a conversion buffer that's not being uploaded from, waiting for one if needed
+static s32 snd_get_cvtbuf(void) {
+  while (1) {
+    for (s32 i = 0; i < SND_CVTBUF_COUNT; ++i) {
+      if (!snd_cvtbuf_busy[i]) {
+        snd_cvtbuf_busy[i] = 1;
+        return i;
+      }
+    }
+    snd_upload_poll();
+  }
+}
+
+void snd_flush_uploads(void) {
+  while (snd_upq_num)
+    snd_upload_poll();
+}
+
 void snd_init(void) {
   SpuInit();
   snd_clear_cache();
   snd_stop_all();
-  for (u32 v = 0; v < 24; ++v)
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
     spu_clear_voice(v);
+    // sound effects fade out when they're stopped instead of getting cut
+    if (v >= CH_SOUND_BASE)
+      SPU_VOICE(v)->sustain_release = SFX_RELEASE_ADSR;
+  }
 }
 
 void snd_clear_cache(void) {
+  snd_flush_uploads();
   for (int i = 0; i < MAX_SOUNDS; ++i) {
     // mark as unloaded
+    snd_cache[i].resid = SND_NO_RES;
     snd_cache[i].spuaddr = -1;
     snd_cache[i].addr = NULL;
     snd_cache[i].size = 0;
+    snd_cache[i].alloc_size = 0;
   }
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v)
+    snd_voice_sound[v] = NULL;
   // reset allocator
-  snd_spu_ptr = SPU_MEM_START;
-  snd_cache_num = 0;
+  spu_free[0].addr = SPU_MEM_START;
+  spu_free[0].size = SPU_MEM_MAX - SPU_MEM_START;
+  spu_num_free = 1;
+  snd_stats.used = 0;
+}
+
+void snd_detach_all(void) {
+  // the data might still be needed for an upload
+  snd_flush_uploads();
+  for (int i = 0; i < MAX_SOUNDS; ++i)
+    snd_cache[i].addr = NULL;
 }
 
-static inline sound_t *snd_cache_find(const u8 *ptr) {
+static inline sound_t *snd_cache_find_res(const u16 resid) {
   for (int i = 0; i < MAX_SOUNDS; ++i)
-    if (snd_cache[i].addr == ptr)
+    if (snd_cache[i].resid == resid)
       return snd_cache + i;
   return NULL;
 }
 
+void snd_get_stats(snd_stats_t *st) {
+  *st = snd_stats;
+  st->free = 0;
+  st->largest_free = 0;
+  st->free_blocks = spu_num_free;
+  for (int i = 0; i < spu_num_free; ++i) {
+    st->free += spu_free[i].size;
+    if ((u32)spu_free[i].size > st->largest_free)
+      st->largest_free = spu_free[i].size;
+  }
+  st->active_mask = snd_key_mask;
+  st->voices_active = 0;
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v)
+    st->voices_active += (snd_key_mask >> v) & 1;
+  st->voices_busy = 0;
+  for (u32 v = CH_SOUND_BASE; v < SPU_NUM_VOICES; ++v)
+    st->voices_busy += (sfx_voices[v].ch != CH_NONE || sfx_voices[v].releasing);
+  st->resident = st->detached = 0;
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    if (snd_cache[i].resid == SND_NO_RES) continue;
+    ++st->resident;
+    if (!snd_cache[i].addr) ++st->detached;
+  }
+}
+
+void snd_dump_stats(void) {
+  snd_stats_t st;
+  snd_get_stats(&st);
+  // fragmentation is how much of the free space can't be used for one big sound
+  const u32 frag = st.free ? 100 - st.largest_free * 100 / st.free : 0;
+  printf("snd_dump_stats(): spu ram used %u (peak %u), free %u in %u blocks (largest %u, %u%% fragmented)\n",
+    st.used, st.peak, st.free, st.free_blocks, st.largest_free, frag);
+  printf("  %u sounds resident, %u detached, %u reused, %u uploaded, %u evicted\n",
+    st.resident, st.detached, st.reuses, st.uploads, st.evictions);
+  printf("  voices active now %u (%06x), %u one-shots retired\n", st.voices_active, st.active_mask, st.voices_retired);
+  printf("  sfx voices busy now %u, peak %u, %u steals\n", st.voices_busy, st.voices_peak, st.voice_steals);
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    if (snd_voice_plays[v])
+      printf("  voice %2u: %5u plays, %3u stolen\n", v, snd_voice_plays[v], snd_voice_steals[v]);
+  }
+}
+
+// a sound loops if it has a block that jumps somewhere else when it ends;
+// one-shots end on a block that repeats itself (see adpcm.c) or just stops
+static int snd_adpcm_loops(const u8 *data, const s32 size) {
+  for (s32 i = 0; i + 1 < size; i += 16) {
+    if ((data[i + 1] & (ADPCM_FLAG_END | ADPCM_FLAG_REPEAT | ADPCM_FLAG_START)) == (ADPCM_FLAG_END | ADPCM_FLAG_REPEAT))
+      return 1;
+  }
+  return 0;
+}
+
 static u16 snd_convert_pcm(u8 *out, u32 outsize, const u8 *in, u32 insize, int loop0, int loop1) {
   const s32 adpcm_size = adpcm_pack_mono_s8(out, outsize, (const s8 *)in, insize, loop0, loop1);
   ASSERT(adpcm_size >= 0);
   return adpcm_size;
 }
 
-sound_t *snd_cache_sound(const u8 *data, u16 size, const int type) {
-  sound_t *snd = snd_cache_find(data);
+u8 snd_cache_sound(const u16 resid, const u8 *data, u16 size, const int type) {
+  sound_t *snd = snd_cache_find_res(resid);
   if (snd) {
-    printf("snd_cache_sound(%p): already cached as %d\n", data, snd - snd_cache);
-    return snd;
+    // still in SPU RAM from last time, just point it at the new copy of the resource
+    snd->addr = data;
+    snd->last_use = ++snd_clock;
+    ++snd_stats.reuses;
+    return snd - snd_cache;
   }
 
-  u8 *cvtbuf = NULL; // in case we need to convert the sound
+  snd = snd_cache_find_res(SND_NO_RES);
+  if (!snd && snd_evict_lru())
+    snd = snd_cache_find_res(SND_NO_RES);
+  if (!snd)
+    panic("snd_cache_sound(%04x): too many sounds", (u32)resid);
 
-  snd = &snd_cache[snd_cache_num++];
+  snd->resid = resid;
   snd->addr = data;
+  snd->last_use = ++snd_clock;
+  snd->alloc_size = 0;
+  snd->loops = 0;
+  s32 cvtbuf = -1; // in case we need to convert the sound
   if (size == 0) {
     // NULL sound
     snd->spuaddr = 0;
     snd->size = 0;
-    return snd;
+    snd->ready = 1;
+    return snd - snd_cache;
+  } else if (type == SND_TYPE_ADPCM) {
+    // sound was converted offline, upload it as is
+    snd->size = size;
+    snd->alloc_size = ALIGN(size, 8);
+    snd->spuaddr = spu_alloc(snd->alloc_size);
   } else if (type == SND_TYPE_VAG) {
     // sound is already in VAG format, just load it in
-    snd->spuaddr = spu_alloc(size);
+    snd->alloc_size = ALIGN(size, 8);
+    snd->spuaddr = spu_alloc(snd->alloc_size);
     snd->size = size - VAG_DATA_OFFSET; // skip header
     data += VAG_DATA_OFFSET; // skip header
   } else {
@@ -170,59 +561,275 @@ sound_t *snd_cache_sound(const u8 *data, u16 size, const int type) {
       size = lstart + lsize;
       data += PCM_DATA_OFFSET; // skip header
     }
-    // need to convert it, output will be at most the same size
+    // need to convert it; this can happen while the previous sound is still uploading
     // SPU transfers are done in blocks of 64, so we'll just align all sizes to that
-    const u32 alignedsize = ALIGN(size, 64);
-    ASSERT(alignedsize <= sizeof(snd_cvtbuf));
-    snd->size = snd_convert_pcm(snd_cvtbuf, sizeof(snd_cvtbuf), data, size, loopstart, loopend);
+    cvtbuf = snd_get_cvtbuf();
+    snd->size = snd_convert_pcm(snd_cvtbuf[cvtbuf], SND_CVTBUF_SIZE, data, size, loopstart, loopend);
+    // the padding is whatever the last sound left in the buffer, so don't look at it
+    snd->loops = snd_adpcm_loops(snd_cvtbuf[cvtbuf], snd->size);
     snd->size = ALIGN(snd->size, 64);
-    snd->spuaddr = spu_alloc(snd->size);
-    data = snd_cvtbuf;
+    snd->alloc_size = snd->size;
+    snd->spuaddr = spu_alloc(snd->alloc_size);
+    data = snd_cvtbuf[cvtbuf];
   }
 
-  SpuSetTransferMode(SPU_TRANSFER_BY_DMA);
-  spu_set_transfer_addr(snd->spuaddr);
-  SpuWrite((void *)data, snd->size);
-  SpuWait(); // wait for transfer to complete
+  if (cvtbuf < 0)
+    snd->loops = snd_adpcm_loops(data, snd->size);
+
+  // becomes ready to play once the transfer is done
+  snd_upload(snd, data, cvtbuf);
+  ++snd_stats.uploads;
+
+  return snd - snd_cache;
+}
 
-  return snd;
+u16 snd_get_pitch(const u16 freq) {
+  return freq2pitch(freq);
 }
 
-void snd_play_sound(const u8 ch, const u8 *data, const u16 freq, const u8 vol) {
-  const sound_t *snd = snd_cache_find(data);
-  if (!snd) {
-    // FIXME: this will explode if reached from the music timer handler
-    printf("snd_play_sound(%p): unknown sound\n", data);
+void snd_play_sound(const u8 ch, const u8 handle, const u16 freq, const u8 vol) {
+  snd_play_sound_pitch(ch, handle, freq2pitch(freq), vol);
+}
+
+void snd_play_sound_pitch(const u8 ch, const u8 handle, const u16 pitch, const u8 vol) {
+  // detached sounds might get evicted and their slot reused, so don't play those,
+  // and don't play ones that haven't finished uploading yet either
+  if (handle >= MAX_SOUNDS || !snd_cache[handle].addr || !snd_cache[handle].ready)
     return;
-  }
+  sound_t *snd = snd_cache + handle;
   const u32 chmask = SPU_VOICECH((u32)ch);
+  snd->last_use = ++snd_clock;
   if (snd->size && snd->spuaddr >= 0) {
-    const s16 vvol = (s16)vol << 8;
-    SPU_VOICE(ch)->vol_left = vvol;
-    SPU_VOICE(ch)->vol_right = vvol;
-    SPU_VOICE(ch)->sample_rate = freq2pitch(freq);
-    SPU_VOICE(ch)->sample_startaddr = ((u32)snd->spuaddr >> 3);
+    const u32 lock = snd_lock();
+    spu_shadow_vol(ch, (s16)vol << 8);
+    spu_shadow_pitch(ch, pitch);
+    spu_shadow_addr(ch, (u32)snd->spuaddr >> 3);
     spu_key_on(chmask); // this restarts the channel on the new address
     snd_key_mask |= chmask;
+    snd_release_mask &= ~chmask;
+    snd_ramp_mask &= ~chmask;
+    snd_voice_sound[ch] = snd;
+    ++snd_voice_plays[ch];
+    snd_unlock(lock);
   }
 }
 
 void snd_stop_sound(const u8 ch) {
-  snd_key_mask &= SPU_VOICECH((u32)ch);
-  // just kill the volume, using keyoff produces noticeable pops and delays
-  snd_set_sound_vol(ch, 0);
+  const u32 chmask = SPU_VOICECH((u32)ch);
+  const u32 lock = snd_lock();
+  // using keyoff produces noticeable pops and delays, and so does just killing the volume,
+  // so ramp it down over a couple frames in snd_update() instead
+  const s16 vol = spu_shadow[ch].vol;
+  if ((snd_key_mask & chmask) && vol > 0) {
+    snd_ramp_step[ch] = (vol + SND_RAMP_FRAMES - 1) / SND_RAMP_FRAMES;
+    snd_ramp_mask |= chmask;
+  } else {
+    snd_key_mask &= ~chmask;
+    spu_shadow_vol(ch, 0);
+  }
+  snd_unlock(lock);
 }
 
 void snd_stop_all(void) {
+  const u32 lock = snd_lock();
   spu_key_off(0xFFFFFF); // kill all voices
+  snd_key_mask = 0;
+  snd_release_mask = 0;
+  snd_ramp_mask = 0;
+  snd_unlock(lock);
+  snd_flush();
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    sfx_voices[v].ch = CH_NONE;
+    sfx_voices[v].releasing = 0;
+  }
+  for (u32 i = 0; i < CH_SOUND_COUNT; ++i)
+    sfx_ch_voice[i] = CH_NONE;
 }
 
 void snd_set_sound_vol(const u8 ch, const u8 vol) {
-  const s16 vvol = (s16)vol << 8;
-  SPU_VOICE(ch)->vol_left = vvol;
-  SPU_VOICE(ch)->vol_right = vvol;
+  const u32 chmask = SPU_VOICECH((u32)ch);
+  const u32 lock = snd_lock();
+  // a stopped voice is still running at volume 0, so turning it back up would bring back
+  // whatever it was looping, on a sound that's allowed to be evicted by now
+  if (snd_key_mask & chmask) {
+    snd_ramp_mask &= ~chmask;
+    spu_shadow_vol(ch, (s16)vol << 8);
+  }
+  snd_unlock(lock);
 }
 
-void snd_update(void) {
+// picks a voice for a new sound effect: a free one if there is one, otherwise the one
+// that's been releasing the longest, otherwise the oldest playing one gets cut off
+static u32 sfx_alloc_voice(void) {
+  u32 best = CH_NONE;
+  u32 best_rank = 0;
+  for (u32 v = CH_SOUND_BASE; v < SPU_NUM_VOICES; ++v) {
+    const sfx_voice_t *sv = sfx_voices + v;
+    u32 rank;
+    if (sv->ch == CH_NONE && !sv->releasing)
+      return v;
+    else if (sv->releasing)
+      rank = 2;
+    else
+      rank = 1;
+    if (best == CH_NONE || rank > best_rank || (rank == best_rank && sv->started < sfx_voices[best].started)) {
+      best = v;
+      best_rank = rank;
+    }
+  }
+
+  sfx_voice_t *sv = sfx_voices + best;
+  if (!sv->releasing) {
+    ++snd_stats.voice_steals;
+    ++snd_voice_steals[best];
+    sfx_ch_voice[sv->ch] = CH_NONE;
+  }
+  sv->ch = CH_NONE;
+  sv->releasing = 0;
+  return best;
+}
 
+void snd_play_sfx(const u8 ch, const u8 handle, const u16 freq, const u8 vol) {
+  // empty sounds don't play, so they don't get to cut off what's on the channel either
+  if (ch >= CH_SOUND_COUNT || handle >= MAX_SOUNDS || !snd_cache[handle].addr || !snd_cache[handle].ready || !snd_cache[handle].size)
+    return;
+
+  // whatever was on this channel before fades out on its own voice while the new sound starts
+  snd_stop_sfx(ch);
+
+  const u32 v = sfx_alloc_voice();
+  snd_play_sound(v, handle, freq, vol);
+  sfx_voices[v].ch = ch;
+  sfx_voices[v].started = ++sfx_clock;
+  sfx_ch_voice[ch] = v;
+
+  u32 busy = 0;
+  for (u32 i = CH_SOUND_BASE; i < SPU_NUM_VOICES; ++i)
+    busy += (sfx_voices[i].ch != CH_NONE || sfx_voices[i].releasing);
+  if (busy > snd_stats.voices_peak)
+    snd_stats.voices_peak = busy;
+}
+
+void snd_stop_sfx(const u8 ch) {
+  if (ch >= CH_SOUND_COUNT || sfx_ch_voice[ch] == CH_NONE)
+    return;
+  const u32 v = sfx_ch_voice[ch];
+  const u32 lock = snd_lock();
+  spu_key_off(SPU_VOICECH(v)); // goes into release, see SFX_RELEASE_ADSR
+  snd_release_mask |= SPU_VOICECH(v);
+  snd_unlock(lock);
+  sfx_voices[v].ch = CH_NONE;
+  sfx_voices[v].releasing = 1;
+  sfx_voices[v].release_end = snd_frame + SFX_RELEASE_FRAMES;
+  sfx_ch_voice[ch] = CH_NONE;
+}
+
+// figures out which voices are actually still making noise and steps the volume ramps
+static void snd_update_voices(void) {
+  const u32 lock = snd_lock();
+  // the SPU only clears ENDX on the first sample after a key on, so a voice that the music IRQ
+  // has just started can still have the flag from its last sound; skip those for this pass
+  const u32 endx = (*SPU_ENDX_LO | ((u32)*SPU_ENDX_HI << 16)) & ~spu_kon_recent;
+  spu_kon_recent = 0;
+  // voices that are about to be keyed on or off still have the flags from before
+  const u32 keyed = snd_key_mask & ~(spu_kon_pending | spu_koff_pending);
+  u32 done = 0;
+
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    const u32 chmask = SPU_VOICECH(v);
+    if (!(keyed & chmask))
+      continue;
+    if ((endx & chmask) && !snd_voice_sound[v]->loops) {
+      // one-shot got to the silent block at the end
+      done |= chmask;
+      ++snd_stats.voices_retired;
+    } else if ((snd_release_mask & chmask) && SPU_VOICE(v)->vol_current == 0) {
+      // release is over
+      done |= chmask;
+    }
+  }
+
+  for (u32 v = 0; snd_ramp_mask >> v; ++v) {
+    const u32 chmask = SPU_VOICECH(v);
+    if (!(snd_ramp_mask & chmask))
+      continue;
+    s16 vol = spu_shadow[v].vol - snd_ramp_step[v];
+    if (vol <= 0 || (done & chmask)) {
+      vol = 0;
+      snd_ramp_mask &= ~chmask;
+      done |= chmask;
+    }
+    spu_shadow_vol(v, vol);
+  }
+
+  snd_key_mask &= ~done;
+  snd_release_mask &= snd_key_mask;
+  snd_unlock(lock);
+}
+
+// frees up voices whose sound is over, either on its own or after a release
+static void sfx_update(void) {
+  for (u32 v = CH_SOUND_BASE; v < SPU_NUM_VOICES; ++v) {
+    sfx_voice_t *sv = sfx_voices + v;
+    const int active = (snd_key_mask & SPU_VOICECH(v)) != 0;
+    if (sv->releasing) {
+      if (!active || (s32)(snd_frame - sv->release_end) >= 0) {
+        sv->releasing = 0;
+        if (active) {
+          const u32 lock = snd_lock();
+          snd_key_mask &= ~SPU_VOICECH(v);
+          snd_release_mask &= ~SPU_VOICECH(v);
+          snd_unlock(lock);
+        }
+      }
+    } else if (sv->ch != CH_NONE && !active) {
+      sfx_ch_voice[sv->ch] = CH_NONE;
+      sv->ch = CH_NONE;
+    }
+  }
+}
+
+// writes out the registers that changed since the last flush, then keys everything
+// that was started or stopped in one go, so notes started together start on the same sample
+void snd_flush(void) {
+  const u32 lock = snd_lock();
+
+  u32 mask = spu_dirty_mask;
+  for (u32 v = 0; mask; ++v, mask >>= 1) {
+    if (!(mask & 1)) continue;
+    spu_shadow_t *sh = spu_shadow + v;
+    volatile struct spu_voice *voice = SPU_VOICE(v);
+    if (sh->dirty & SHADOW_VOL) {
+      voice->vol_left = sh->vol;
+      voice->vol_right = sh->vol;
+    }
+    if (sh->dirty & SHADOW_PITCH)
+      voice->sample_rate = sh->pitch;
+    if (sh->dirty & SHADOW_ADDR)
+      voice->sample_startaddr = sh->addr;
+    sh->dirty = 0;
+  }
+  spu_dirty_mask = 0;
+
+  if (spu_koff_pending) {
+    *SPU_KEY_OFF_LO = spu_koff_pending;
+    *SPU_KEY_OFF_HI = spu_koff_pending >> 16;
+    spu_koff_pending = 0;
+  }
+  if (spu_kon_pending) {
+    *SPU_KEY_ON_LO = spu_kon_pending;
+    *SPU_KEY_ON_HI = spu_kon_pending >> 16;
+    spu_kon_recent |= spu_kon_pending;
+    spu_kon_pending = 0;
+  }
+
+  snd_unlock(lock);
+}
+
+void snd_update(void) {
+  ++snd_frame;
+  snd_upload_poll();
+  snd_update_voices();
+  sfx_update();
+  snd_flush();
 }
@@ -3,21 +3,58 @@
 #include "types.h"
 
 #define MAX_SOUNDS 160 // ~110 sounds in game + MOD instruments
+#define SND_NONE 0xFF  // invalid sound handle
 
 enum sound_type {
   SND_TYPE_RAW_PCM,
   SND_TYPE_PCM_WITH_HEADER,
   SND_TYPE_VAG,
+  SND_TYPE_ADPCM, // raw SPU ADPCM with no header, size aligned to 64
 };
 
 typedef struct sound sound_t;
 
+typedef struct {
+  u32 used;         // bytes of SPU RAM taken by sounds
+  u32 peak;
+  u32 free;
+  u32 largest_free; // biggest sound that fits without evicting anything
+  u32 free_blocks;
+  u32 resident;     // sounds in SPU RAM
+  u32 detached;     // ... of which don't belong to a loaded resource anymore
+  u32 uploads;
+  u32 reuses;       // times a resource was loaded again and its sound was still there
+  u32 evictions;
+  u32 active_mask;  // voices that are actually still making noise
+  u32 voices_active;
+  u32 voices_retired; // one-shot sounds that were noticed to have ended on their own
+  u32 voices_busy;  // sfx voices playing or releasing
+  u32 voices_peak;
+  u32 voice_steals; // sounds cut short because all sfx voices were busy
+} snd_stats_t;
+
 void snd_init(void);
-void snd_play_sound(const u8 ch, const u8 *data, const u16 freq, const u8 vol);
+// sounds are referred to by handles returned from snd_cache_sound(), which stay valid
+// until the resource is dropped; playing one is just an array lookup, so it's fine from the music IRQ
+void snd_play_sound(const u8 ch, const u8 snd, const u16 freq, const u8 vol);
 void snd_stop_sound(const u8 ch);
+// same thing, but with the SPU pitch precomputed with snd_get_pitch()
+void snd_play_sound_pitch(const u8 ch, const u8 snd, const u16 pitch, const u8 vol);
+u16 snd_get_pitch(const u16 freq);
+// the game's sound channels (0-3) don't have fixed voices, every sound gets its own
+// so it doesn't cut off the previous one on the same channel or the music
+void snd_play_sfx(const u8 ch, const u8 snd, const u16 freq, const u8 vol);
+void snd_stop_sfx(const u8 ch);
 void snd_stop_all(void);
 void snd_set_sound_vol(const u8 ch, const u8 vol);
+// voice changes are only sent to the SPU here; called every frame and after every music tick
+void snd_flush(void);
+// once a frame: checks which voices have finished, frees them up and steps volume fades
 void snd_update(void);
 
 void snd_clear_cache(void);
-sound_t *snd_cache_sound(const u8 *data, u16 size, const int  type);
+void snd_detach_all(void);
+void snd_flush_uploads(void);
+u8 snd_cache_sound(const u16 resid, const u8 *data, u16 size, const int type);
+void snd_get_stats(snd_stats_t *st);
+void snd_dump_stats(void);
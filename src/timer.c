@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <psxapi.h>
+#include <psxetc.h>
+
+#include "types.h"
+#include "timer.h"
+
+// RCNT2 wraps around every 0x10000 ticks (~15.5ms at sysclock / 8); count the wraps
+// in its IRQ to get a 32-bit tick counter
+
+#define IRQ_STAT        ((volatile u32 *)(0x1F801070))
+#define IRQ_STAT_RCNT2  (1 << 6)
+
+static volatile u32 timer_wraps = 0;
+
+static void timer_callback(void) {
+  ++timer_wraps;
+}
+
+void timer_init(void) {
+  EnterCriticalSection();
+  SetRCnt(RCntCNT2, 0xFFFF, RCntMdINTR | RCntMdSC); // SC is sysclock / 8 for RCNT2
+  InterruptCallback(6, timer_callback); // IRQ6 is RCNT2
+  StartRCnt(RCntCNT2);
+  ChangeClearRCnt(2, 0);
+  ExitCriticalSection();
+}
+
+u32 timer_get_ticks(void) {
+  u32 hi, lo, pending;
+  // if the wrap IRQ ran in the middle of this, try again
+  do {
+    hi = timer_wraps;
+    lo = GetRCnt(RCntCNT2) & 0xFFFF;
+    pending = *IRQ_STAT & IRQ_STAT_RCNT2;
+  } while (hi != timer_wraps);
+  // with interrupts off (e.g. in another IRQ handler) the wrap IRQ can't run, but it's still
+  // pending; lo might be from before or after the wrap, so read it again to be sure it's after
+  if (pending) {
+    ++hi;
+    lo = GetRCnt(RCntCNT2) & 0xFFFF;
+  }
+  return (hi << 16) | lo;
+}
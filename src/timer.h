@@ -0,0 +1,14 @@
+#pragma once
+
+#include "types.h"
+
+// free running timer for profiling, ticks at system clock / 8
+#define TIMER_TICKS_PER_MS 4234 // 33.8688 MHz / 8 / 1000
+
+void timer_init(void);
+u32 timer_get_ticks(void);
+
+static inline u32 timer_ticks_to_us(const u32 ticks) {
+  // split it up so it doesn't overflow for anything longer than a second
+  return (ticks / TIMER_TICKS_PER_MS) * 1000 + (ticks % TIMER_TICKS_PER_MS) * 1000 / TIMER_TICKS_PER_MS;
+}
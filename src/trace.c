@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "timer.h"
+#include "cd.h"
+#include "trace.h"
+
+static trace_load_t trace_ring[TRACE_RING_SIZE];
+static u32 trace_seq = 0;      // number of loads started so far
+static s32 trace_last_end = 0; // sector right after the last one read
+
+static u32 trace_part_seq;     // first load of the current transition
+static u32 trace_part_start;   // when the current transition started
+static u32 trace_part_hits;    // CD cache counters when the current transition started
+static u32 trace_part_misses;
+
+trace_load_t *trace_begin_load(const u16 part, const u16 resnum, const u8 type, const u8 bank) {
+  trace_load_t *t = trace_ring + (trace_seq % TRACE_RING_SIZE);
+  memset(t, 0, sizeof(*t));
+  t->seq = trace_seq++;
+  t->part = part;
+  t->resnum = resnum;
+  t->type = type;
+  t->bank = bank;
+  t->lba = -1;
+  return t;
+}
+
+void trace_set_read(trace_load_t *t, const s32 lba, const u32 bytes) {
+  const s32 nsecs = (bytes + 2047) / 2048;
+  t->lba = lba;
+  t->bytes = bytes;
+  t->seek = lba - trace_last_end;
+  trace_last_end = lba + nsecs;
+}
+
+void trace_end_load(trace_load_t *t, const int ok) {
+  t->ok = ok;
+#ifdef TRACE_LOG
+  // one record per line, for tools/layout.c
+  printf("trace: seq=%u part=%u res=%u type=%u bank=%u src=%u ok=%u lba=%d seek=%d bytes=%u cd=%u unpack=%u spu=%u\n",
+    t->seq, (u32)t->part, (u32)t->resnum, (u32)t->type, (u32)t->bank, (u32)t->source, (u32)t->ok,
+    t->lba, t->seek, t->bytes, timer_ticks_to_us(t->t_cd), timer_ticks_to_us(t->t_unpack),
+    timer_ticks_to_us(t->t_spu));
+#endif
+}
+
+void trace_begin_part(void) {
+  trace_part_seq = trace_seq;
+  trace_part_start = timer_get_ticks();
+  cd_get_cache_stats(&trace_part_hits, &trace_part_misses);
+}
+
+void trace_end_part(const u16 part, const u32 kept) {
+  const u32 t_total = timer_get_ticks() - trace_part_start;
+  u32 hits, misses;
+  cd_get_cache_stats(&hits, &misses);
+  hits -= trace_part_hits;
+  misses -= trace_part_misses;
+
+  u32 num = trace_seq - trace_part_seq;
+  if (num > TRACE_RING_SIZE) num = TRACE_RING_SIZE;
+
+  u32 bytes = 0, seek = 0, t_cd = 0, t_unpack = 0, t_spu = 0;
+  const trace_load_t *slowest[TRACE_NUM_SLOWEST] = { NULL };
+  for (u32 i = trace_seq - num; i != trace_seq; ++i) {
+    const trace_load_t *t = trace_ring + (i % TRACE_RING_SIZE);
+    const u32 t_load = t->t_cd + t->t_unpack + t->t_spu;
+    bytes += t->bytes;
+    seek += (t->seek < 0) ? -t->seek : t->seek;
+    t_cd += t->t_cd;
+    t_unpack += t->t_unpack;
+    t_spu += t->t_spu;
+    // insert into the slowest list
+    for (int j = 0; j < TRACE_NUM_SLOWEST; ++j) {
+      if (!slowest[j] || t_load > slowest[j]->t_cd + slowest[j]->t_unpack + slowest[j]->t_spu) {
+        memmove(slowest + j + 1, slowest + j, (TRACE_NUM_SLOWEST - j - 1) * sizeof(*slowest));
+        slowest[j] = t;
+        break;
+      }
+    }
+  }
+
+  char slow[TRACE_NUM_SLOWEST * 24] = { 0 };
+  for (int j = 0, n = 0; j < TRACE_NUM_SLOWEST && slowest[j]; ++j) {
+    const trace_load_t *t = slowest[j];
+    n += snprintf(slow + n, sizeof(slow) - n, " %u:%ums", (u32)t->resnum,
+      timer_ticks_to_us(t->t_cd + t->t_unpack + t->t_spu) / 1000);
+  }
+
+  printf("part %05u: %u ms, %u loads, %u bytes read, %u sectors seeked, cd %u ms, unpack %u ms, spu %u ms, cache %u/%u hits, %u bytes kept, slowest:%s\n",
+    (u32)part, timer_ticks_to_us(t_total) / 1000, num, bytes, seek, timer_ticks_to_us(t_cd) / 1000,
+    timer_ticks_to_us(t_unpack) / 1000, timer_ticks_to_us(t_spu) / 1000, hits, hits + misses, kept, slow[0] ? slow : " none");
+}
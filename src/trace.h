@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+// resource load instrumentation: every load gets a record in a ring buffer,
+// and every part transition gets a one line summary of the loads it caused
+// build with TRACE_LOG to also print every record as it's finished
+
+#define TRACE_RING_SIZE 64
+#define TRACE_NUM_SLOWEST 3
+
+enum trace_source_e {
+  TRACE_SRC_BANK,
+  TRACE_SRC_PACK,
+  TRACE_SRC_PREFETCH,
+};
+
+typedef struct {
+  u32 seq;       // load number since startup
+  u16 part;      // part that was current when the load started
+  u16 resnum;
+  u8 type;
+  u8 bank;
+  u8 source;
+  u8 ok;
+  s32 lba;       // first sector read, -1 if nothing was read from disc
+  s32 seek;      // distance from the end of the previous read in sectors
+  u32 bytes;     // bytes read from disc
+  u32 t_cd;      // time spent waiting for the CD, in timer ticks
+  u32 t_unpack;  // time spent unpacking or copying
+  u32 t_spu;     // time spent uploading to SPU RAM
+} trace_load_t;
+
+trace_load_t *trace_begin_load(const u16 part, const u16 resnum, const u8 type, const u8 bank);
+void trace_set_read(trace_load_t *t, const s32 lba, const u32 bytes);
+void trace_end_load(trace_load_t *t, const int ok);
+void trace_begin_part(void);
+void trace_end_part(const u16 part, const u32 kept);
@@ -3,101 +3,183 @@
 #include "util.h"
 #include "unpack.h"
 
+// the packed stream is read backwards one 32-bit word at a time and each word is
+// consumed LSB first, while multi-bit fields are assembled MSB first; to get
+// fields out with a single shift we bit-reverse every word as it's loaded and
+// then always take bits off the top of the buffer
+
 typedef struct {
   int size;
   u32 crc;
-  u32 bits;
+  u32 bits;  // bit buffer, next bit to be read is the MSB
+  int nbits; // number of valid bits left in `bits`
   u8 *dst;
-  const u8 *src;
+  const u8 *src; // next word to be read
+  const u8 *lo;  // bottom of the source window
+  unpack_stream_t *stream;
+  int err;
 } unpack_ctx_t;
 
-static int next_bit(unpack_ctx_t *uc) {
-  int carry = (uc->bits & 1) != 0;
-  uc->bits >>= 1;
-  if (uc->bits == 0) { // getnextlwd
-    uc->bits = read32be(uc->src); uc->src -= 4;
-    uc->crc ^= uc->bits;
-    carry = (uc->bits & 1) != 0;
-    uc->bits = (1 << 31) | (uc->bits >> 1);
-  }
-  return carry;
+static inline u32 bitrev32(u32 x) {
+  x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+  x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+  x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+  return (x >> 16) | (x << 16);
 }
 
-static int get_bits(unpack_ctx_t *uc, int count) { // rdd1bits
-  int bits = 0;
-  for (int i = 0; i < count; ++i) {
-    bits <<= 1;
-    if (next_bit(uc)) {
-      bits |= 1;
+// the word at src sticks out of the bottom of the window (or is completely below
+// it), so put it together byte by byte, refilling as needed
+static u32 __attribute__((noinline)) read_word_slow(unpack_ctx_t *uc) {
+  const u8 *p = uc->src + 3;
+  u32 w = 0;
+  for (int i = 0; i < 32; i += 8, --p) {
+    if (p < uc->lo) {
+      if (!uc->stream || !uc->stream->refill(uc->stream)) {
+        uc->err = 1;
+        return 0;
+      }
+      uc->lo = uc->stream->lo;
+      p = uc->stream->hi - 1;
     }
+    w |= *p << i;
   }
-  return bits;
+  uc->src = p - 3;
+  return w;
 }
 
-static void copy_literal(unpack_ctx_t *uc, int num_bits, int len) { // getd3chr
-  int count = get_bits(uc, num_bits) + len + 1;
-  uc->size -= count;
-  if (uc->size < 0) {
-    count += uc->size;
-    uc->size = 0;
-  }
-  for (int i = 0; i < count; ++i) {
-    *(uc->dst - i) = (u8)get_bits(uc, 8);
+static inline u32 read_word(unpack_ctx_t *uc) {
+  if (uc->src < uc->lo)
+    return read_word_slow(uc);
+  const u32 w = read32be(uc->src); uc->src -= 4;
+  return w;
+}
+
+static inline u32 next_word(unpack_ctx_t *uc) { // getnextlwd
+  const u32 w = read_word(uc);
+  uc->crc ^= w;
+  return bitrev32(w);
+}
+
+static inline u32 get_bits(unpack_ctx_t *uc, const int count) { // rdd1bits
+  u32 v;
+  if (uc->nbits >= count) {
+    v = uc->bits >> (32 - count);
+    uc->bits <<= count;
+    uc->nbits -= count;
+  } else {
+    // field straddles a word boundary: take what's left, then refill
+    const int rem = count - uc->nbits;
+    v = uc->nbits ? ((uc->bits >> (32 - uc->nbits)) << rem) : 0;
+    uc->bits = next_word(uc);
+    v |= uc->bits >> (32 - rem);
+    uc->bits <<= rem;
+    uc->nbits = 32 - rem;
   }
-  uc->dst -= count;
+  return v;
 }
 
-static void copy_reference(unpack_ctx_t *uc, int num_bits, int count) { // copyd3bytes
+static inline int clamp_count(unpack_ctx_t *uc, int count) {
   uc->size -= count;
   if (uc->size < 0) {
     count += uc->size;
     uc->size = 0;
   }
-  const int offset = get_bits(uc, num_bits);
-  for (int i = 0; i < count; ++i) {
-    *(uc->dst - i) = *(uc->dst - i + offset);
+  return count;
+}
+
+static inline void copy_literal(unpack_ctx_t *uc, int num_bits, int len) { // getd3chr
+  int count = clamp_count(uc, get_bits(uc, num_bits) + len + 1);
+  register u8 *dst = uc->dst;
+  uc->dst -= count;
+  while (count) {
+    if (uc->nbits >= 8) {
+      // whole bytes available in the buffer, drain as many as we can
+      register u32 bits = uc->bits;
+      register int n = uc->nbits >> 3;
+      if (n > count) n = count;
+      uc->nbits -= n << 3;
+      count -= n;
+      while (n--) {
+        *dst-- = bits >> 24;
+        bits <<= 8;
+      }
+      uc->bits = bits;
+    } else {
+      *dst-- = get_bits(uc, 8);
+      --count;
+    }
   }
+}
+
+static inline void copy_reference(unpack_ctx_t *uc, int num_bits, int count) { // copyd3bytes
+  count = clamp_count(uc, count);
+  register u8 *dst = uc->dst;
+  register const u8 *src = dst + get_bits(uc, num_bits);
   uc->dst -= count;
+  // can't use memmove here, the ranges overlap on purpose when offset < count
+  while (count--)
+    *dst-- = *src--;
 }
 
-int bytekiller_unpack(u8 *dst, int dstsize, const u8 *src, int srcsize) {
-  unpack_ctx_t uc;
-  uc.src = src + srcsize - 4;
-  uc.size = read32be(uc.src); uc.src -= 4;
-  if (uc.size > dstsize) {
-    printf("unpack(%p, %d, %p, %d): invalid unpack size %d, buffer size %d",
-      dst, dstsize, src, srcsize, uc.size, dstsize);
+static int unpack(unpack_ctx_t *uc, u8 *dst, int dstsize) {
+  uc->size = read_word(uc);
+  if (uc->size > dstsize) {
+    printf("unpack(%p, %d): invalid unpack size %d, buffer size %d",
+      dst, dstsize, uc->size, dstsize);
     return 0;
   }
-  uc.dst = dst + uc.size - 1;
-  uc.crc = read32be(uc.src); uc.src -= 4;
-  uc.bits = read32be(uc.src); uc.src -= 4;
-  uc.crc ^= uc.bits;
+  uc->dst = dst + uc->size - 1;
+  uc->crc = read_word(uc);
+  // the first word has no marker bit added to it, so its own top set bit acts
+  // as the end marker and only the bits below it are part of the stream
+  const u32 first = read_word(uc);
+  uc->crc ^= first;
+  uc->bits = bitrev32(first);
+  uc->nbits = 0;
+  for (u32 w = first; w > 1; w >>= 1)
+    ++uc->nbits;
   do {
-    if (!next_bit(&uc)) {
-      if (!next_bit(&uc)) {
-        copy_literal(&uc, 3, 0);
+    if (!get_bits(uc, 1)) {
+      if (!get_bits(uc, 1)) {
+        copy_literal(uc, 3, 0);
       } else {
-        copy_reference(&uc, 8, 2);
+        copy_reference(uc, 8, 2);
       }
     } else {
-      const int code = get_bits(&uc, 2);
-      switch (code) {
+      switch (get_bits(uc, 2)) {
       case 3:
-        copy_literal(&uc, 8, 8);
+        copy_literal(uc, 8, 8);
         break;
       case 2:
-        copy_reference(&uc, 12, get_bits(&uc, 8) + 1);
+        copy_reference(uc, 12, get_bits(uc, 8) + 1);
         break;
       case 1:
-        copy_reference(&uc, 10, 4);
+        copy_reference(uc, 10, 4);
         break;
       case 0:
-        copy_reference(&uc, 9, 3);
+        copy_reference(uc, 9, 3);
         break;
       }
     }
-  } while (uc.size > 0);
-  return uc.crc == 0;
+  } while (uc->size > 0 && !uc->err);
+  return uc->crc == 0 && !uc->err;
 }
 
+int bytekiller_unpack(u8 *dst, int dstsize, const u8 *src, int srcsize) {
+  unpack_ctx_t uc;
+  uc.src = src + srcsize - 4;
+  uc.lo = src;
+  uc.stream = NULL;
+  uc.err = 0;
+  return unpack(&uc, dst, dstsize);
+}
+
+int bytekiller_unpack_stream(u8 *dst, int dstsize, unpack_stream_t *s) {
+  unpack_ctx_t uc;
+  uc.src = s->hi - 4;
+  uc.lo = s->lo;
+  uc.stream = s;
+  uc.err = 0;
+  return unpack(&uc, dst, dstsize);
+}
@@ -2,4 +2,15 @@
 
 #include "types.h"
 
+// packed data that arrives in pieces; the decoder walks the stream backwards, so
+// the first window has to contain the end of the stream and every refill has to
+// provide the piece right before the current one
+typedef struct unpack_stream_s {
+  const u8 *lo; // current window is [lo, hi)
+  const u8 *hi;
+  int (*refill)(struct unpack_stream_s *s); // returns 0 if there's nothing left
+  void *user;
+} unpack_stream_t;
+
 int bytekiller_unpack(u8 *dst, int dstsize, const u8 *src, int srcsize);
+int bytekiller_unpack_stream(u8 *dst, int dstsize, unpack_stream_t *s);
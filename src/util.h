@@ -28,6 +28,19 @@ static inline u16 read16le(const u8 *p) {
   return p[0] | (p[1] << 8);
 }
 
+// 32-bit FNV-1a, used to tell whether a script segment is the one tools/aot.c compiled
+// and whether the data pack was built from this MEMLIST.BIN
+#define FNV1A_INIT 0x811C9DC5
+
+static inline u32 hash_fnv1a_update(u32 h, const u8 *p, u32 size) {
+  while (size--) h = (h ^ *p++) * 0x01000193;
+  return h;
+}
+
+static inline u32 hash_fnv1a(const u8 *p, u32 size) {
+  return hash_fnv1a_update(FNV1A_INIT, p, size);
+}
+
 // memcpy and memset operating on words (see mem.s)
 // addresses and byte count must be multiples of 4
 extern void *memcpy_w(void *dst, const void *src, int n);
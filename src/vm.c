@@ -12,6 +12,7 @@
 #include "res.h"
 #include "tables.h"
 #include "game.h"
+#include "jit.h"
 
 #define VM_NUM_VARS    0x100
 #define VM_STACK_DEPTH 0x40
@@ -169,9 +170,11 @@ static void op_copy_page(void) {
   gfx_copy_page(src, dst, vm.vars[VAR_SCROLL_Y]);
 }
 
-static void op_update_display(void) {
-  static u32 tstamp = 0;
+static u32 vm_frame_tstamp = 0; // vblank the last frame went up on
+static u32 vm_frame_start = 0;  // vblank the scripts started running this frame
+static u32 vm_frame_budget = 1; // vblanks to leave for the scripts, see vm_begin_frame()
 
+static void op_update_display(void) {
   const u8 page = vm_fetch_u8();
 
   vm_handle_special_input(pad_get_special_input());
@@ -179,14 +182,20 @@ static void op_update_display(void) {
   if (res_cur_part == 0x3E80 && vm.vars[0x67] == 1)
     vm.vars[0xDC] = 0x21;
 
-  const s32 delay = VSync(-1) - tstamp;
+  // next time leave as much time as this frame took to run, plus a bit in case the next one is slower
+  const u32 now = VSync(-1);
+  vm_frame_budget = now - vm_frame_start + 1;
+
+  // wait out whatever's left of the pause that vm_begin_frame() didn't
+  const s32 delay = now - vm_frame_tstamp;
   s32 pause = vm.vars[VAR_PAUSE_SLICES] - delay;
   for (; pause > 0; --pause) VSync(0);
-  tstamp = VSync(-1);
+  vm_frame_tstamp = VSync(-1);
 
   vm.vars[0xF7] = 0;
 
   gfx_update_display(page);
+  pad_latency_flip();
 }
 
 static void op_halt(void) {
@@ -252,14 +261,14 @@ static void op_play_sound(void) {
   if (vol > 63) {
     vol = 63;
   } else if (vol == 0) {
-    snd_stop_sound(channel);
+    snd_stop_sfx(channel & 3);
     return;
   }
 
   const mementry_t *me = res_get_entry(res);
   if (me && me->status == RS_LOADED) {
     ASSERT(freq < 40);
-    snd_play_sound(channel & 3, me->bufptr, freq_tab[freq], vol);
+    snd_play_sfx(channel & 3, me->sound, freq_tab[freq], vol);
   }
 }
 
@@ -278,6 +287,53 @@ static void op_play_music(void) {
   }
 }
 
+// the draw opcodes carry part of their operands in the opcode itself, so they're not in the table
+static void op_draw_shape_short(const u8 op) {
+  res_vidseg_idx = 0;
+  const u16 ofs = ((op << 8) | vm_fetch_u8()) << 1;
+  s16 x = vm_fetch_u8();
+  s16 y = vm_fetch_u8();
+  const s16 h = y - 199;
+  if (h > 0) {
+    y = 199;
+    x += h;
+  }
+  gfx_set_databuf(res_seg_video[0], ofs);
+  gfx_draw_shape(0xFF, 0x40, x, y);
+}
+
+static void op_draw_shape(const u8 op) {
+  res_vidseg_idx = 0;
+  const u16 ofs = vm_fetch_u16() << 1;
+  s16 x = vm_fetch_u8();
+  if ((op & 0x20) == 0) {
+    if ((op & 0x10) == 0)
+      x = (x << 8) | vm_fetch_u8();
+    else
+      x = vm.vars[x];
+  } else if (op & 0x10) {
+      x += 0x100;
+  }
+  s16 y = vm_fetch_u8();
+  if ((op & 8) == 0) {
+    if ((op & 4) == 0)
+      y = (y << 8) | vm_fetch_u8();
+    else
+      y = vm.vars[y];
+  }
+  u16 zoom = 0x40;
+  if ((op & 2) == 0) {
+    if (op & 1)
+      zoom = vm.vars[vm_fetch_u8()];
+  } else if (op & 1) {
+    res_vidseg_idx = 1;
+  } else {
+    zoom = vm_fetch_u8();
+  }
+  gfx_set_databuf(res_seg_video[res_vidseg_idx], ofs);
+  gfx_draw_shape(0xFF, zoom, x, y);
+}
+
 static op_func_t vm_op_table[] = {
   /* 0x00 */
   &op_mov_const,
@@ -315,12 +371,43 @@ static op_func_t vm_op_table[] = {
   &op_play_music
 };
 
+static void vm_step(void) {
+  const u8 op = vm_fetch_u8();
+  if (op & 0x80) {
+    op_draw_shape_short(op);
+  } else if (op & 0x40) {
+    op_draw_shape(op);
+  } else if (op < VM_NUM_OPCODES) {
+    vm_op_table[op]();
+  } else {
+    printf("vm_run_task(pc=%p): invalid opcode %02x\n", vm.pc, op);
+  }
+}
+
 int vm_init(void) {
   memset(vm.vars, 0, sizeof(vm.vars));
   vm.vars[0xE4] = 0x14; // copy protection checks this
   // 0x01 == "Another World", 0x81 == "Out of This World"
   vm.vars[0x54] = gfx_get_current_mode() == MODE_PAL ? 0x01 : 0x81;
   vm.vars[VAR_RANDOM_SEED] = 0x1337;
+#ifdef VM_JIT
+  const jit_vm_t jvm = {
+    .vars = vm.vars,
+    .callstack = vm.callstack,
+    .sp = &vm.sp,
+    .next_script_pos = vm.script_pos[1],
+    .pc = &vm.pc,
+    .halt = &vm.halt,
+    .ops = vm_op_table,
+    .draw_shape_short = op_draw_shape_short,
+    .draw_shape = op_draw_shape,
+    .step = vm_step,
+    .num_vars = VM_NUM_VARS,
+    .stack_depth = VM_STACK_DEPTH,
+    .num_tasks = VM_NUM_TASKS,
+  };
+  jit_init(&jvm);
+#endif
 #ifndef KEEP_COPY_PROTECTION
   // if the game was built to start at the intro, set all the copy protection related shit
   vm.vars[0xBC] = 0x10;
@@ -334,6 +421,9 @@ void vm_restart_at(const u16 part_id, const u16 pos) {
   mus_stop();
   snd_stop_all();
   res_setup_part(part_id);
+#ifdef VM_JIT
+  jit_reset(res_seg_code, res_seg_code_size);
+#endif
   memset(vm.script_pos, 0xFF, sizeof(vm.script_pos));
   memset(vm.script_paused, 0, sizeof(vm.script_paused));
   vm.script_pos[0][0] = 0;
@@ -341,6 +431,16 @@ void vm_restart_at(const u16 part_id, const u16 pos) {
   time_now = time_start = 0; // get_timestamp()
 }
 
+void vm_begin_frame(void) {
+  // the original waits out the frame pause right before showing the frame, by which point the
+  // input the scripts ran with is that much older; wait here instead, but leave enough time
+  // for the scripts to run before the frame is due, so it still goes up on the same vblank
+  // this assumes the pause stays the same as last frame, which it almost always does
+  const s32 left = (s32)vm.vars[VAR_PAUSE_SLICES] - (s32)(VSync(-1) - vm_frame_tstamp) - (s32)vm_frame_budget;
+  for (s32 i = 0; i < left; ++i) VSync(0);
+  vm_frame_start = VSync(-1);
+}
+
 void vm_setup_tasks(void) {
   if (res_next_part) {
     printf("vm_setup_tasks(): transitioning to part %05u\n", res_next_part);
@@ -358,59 +458,61 @@ void vm_setup_tasks(void) {
 }
 
 static void vm_run_task(void) {
+#ifdef VM_JIT
+  // blocks start where the task starts and after every jump
+  int entry = 1;
   while (!vm.halt) {
-    const u8 op = vm_fetch_u8();
-    if (op & 0x80) {
-      res_vidseg_idx = 0;
-      const u16 ofs = ((op << 8) | vm_fetch_u8()) << 1;
-      s16 x = vm_fetch_u8();
-      s16 y = vm_fetch_u8();
-      const s16 h = y - 199;
-      if (h > 0) {
-        y = 199;
-        x += h;
-      }
-      gfx_set_databuf(res_seg_video[0], ofs);
-      gfx_draw_shape(0xFF, 0x40, x, y);
-    } else if (op & 0x40) {
-      res_vidseg_idx = 0;
-      const u16 ofs = vm_fetch_u16() << 1;
-      s16 x = vm_fetch_u8();
-      if ((op & 0x20) == 0) {
-        if ((op & 0x10) == 0)
-          x = (x << 8) | vm_fetch_u8();
-        else
-          x = vm.vars[x];
-      } else if (op & 0x10) {
-          x += 0x100;
-      }
-      s16 y = vm_fetch_u8();
-      if ((op & 8) == 0) {
-        if ((op & 4) == 0)
-          y = (y << 8) | vm_fetch_u8();
-        else
-          y = vm.vars[y];
-      }
-      u16 zoom = 0x40;
-      if ((op & 2) == 0) {
-        if (op & 1)
-          zoom = vm.vars[vm_fetch_u8()];
-      } else if (op & 1) {
-        res_vidseg_idx = 1;
-      } else {
-        zoom = vm_fetch_u8();
-      }
-      gfx_set_databuf(res_seg_video[res_vidseg_idx], ofs);
-      gfx_draw_shape(0xFF, zoom, x, y);
-    } else if (op < VM_NUM_OPCODES) {
-      vm_op_table[op]();
-    } else {
-      printf("vm_run_task(pc=%p): invalid opcode %02x\n", vm.pc, op);
+    if (entry) {
+      jit_run();
+      if (vm.halt) break;
     }
+    entry = jit_ends_block(*vm.pc);
+    vm_step();
   }
+#else
+  while (!vm.halt)
+    vm_step();
+#endif
 }
 
+#ifdef VM_AOT
+
+// the scripts compiled to C by tools/aot.c; each function picks up the task at vm.pc and
+// leaves vm.pc where the interpreter would have, handing off to it for anything it doesn't know
+typedef struct {
+  u32 size;
+  u32 hash;
+  void (* run)(void);
+} vm_aot_seg_t;
+
+#include "vm_aot.h"
+
+static u16 vm_aot_part; // part vm_aot_run was picked for
+static void (* vm_aot_run)(void);
+
+static void vm_aot_select(void) {
+  vm_aot_part = res_cur_part;
+  vm_aot_run = NULL;
+  const u32 hash = hash_fnv1a(res_seg_code, res_seg_code_size);
+  for (u32 i = 0; i < sizeof(vm_aot_segs) / sizeof(*vm_aot_segs); ++i) {
+    if (vm_aot_segs[i].size == res_seg_code_size && vm_aot_segs[i].hash == hash) {
+      vm_aot_run = vm_aot_segs[i].run;
+      break;
+    }
+  }
+  printf("vm_aot_select(): part %05u (%u bytes, hash %08x) is %s\n", res_cur_part,
+    res_seg_code_size, hash, vm_aot_run ? "compiled" : "interpreted");
+}
+
+#endif
+
 void vm_run(void) {
+#ifdef VM_AOT
+  if (vm_aot_part != res_cur_part) vm_aot_select();
+  void (* const run_task)(void) = vm_aot_run ? vm_aot_run : vm_run_task;
+#else
+  void (* const run_task)(void) = vm_run_task;
+#endif
   for (int i = 0; i < VM_NUM_TASKS; ++i) {
     if (vm.script_paused[0][i] == 0) {
       const u16 pos = vm.script_pos[0][i];
@@ -418,7 +520,7 @@ void vm_run(void) {
         vm.pc = res_seg_code + pos;
         vm.sp = 0;
         vm.halt = 0;
-        vm_run_task();
+        run_task();
         vm.script_pos[0][i] = vm.pc - res_seg_code;
       }
     }
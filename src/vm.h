@@ -23,6 +23,8 @@ void vm_set_var(const u8 i, const s16 val);
 s16 vm_get_var(const u8 i);
 void vm_restart_at(const u16 part_id, const u16 pos);
 void vm_setup_tasks(void);
+// call right before sampling input for the frame
+void vm_begin_frame(void);
 void vm_run(void);
 void vm_update_input(u32 mask);
 void vm_handle_special_input(u32 mask);
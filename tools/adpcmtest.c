@@ -0,0 +1,377 @@
+// encodes every sound in MEMLIST.BIN with src/adpcm.c and with the psxsdk encoder the engine
+// used to have (kept below, with only its state initialized where it used to read garbage), the
+// same way mkpack does, and checks that the output is the same byte for byte; then times both
+// with -r <n> it also does n random sounds of random lengths and loop points, for when there's
+// no data at hand or to go beyond what the game has
+// returns non-zero if anything doesn't match
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "util.h"
+#include "adpcm.h"
+#include "memlist.h"
+
+// these have to match mkpack and the engine
+#define RT_SOUND 0
+#define PCM_DATA_OFFSET 8
+#define ADPCM_MAX_SIZE (64 * 1024)
+
+#define MAX_RANDOM_SIZE 0x10000
+
+/* the psxsdk encoder, as the engine had it */
+
+#define PCM_CHUNK_SIZE   28 // num pcm samples for one adpcm block
+#define PCM_BUFFER_SIZE  (PCM_CHUNK_SIZE * 128) // size of conversion buffer
+
+#define ADPCM_BLOCK_SIZE 16 // size of one ADPCM block in bytes
+#define FLAG_LOOP_END    (1 << 0)
+#define FLAG_LOOP_REPEAT (1 << 1)
+#define FLAG_LOOP_START  (1 << 2)
+
+static const int factors[5][2] = {
+  {   0,   0 },
+  {  60,   0 },
+  { 115, -52 },
+  {  98, -55 },
+  { 122, -60 }
+};
+
+static s16 pcm_buffer[PCM_BUFFER_SIZE];
+
+static s32 find_s1 = 0;
+static s32 find_s2 = 0;
+static s32 pack_s1 = 0;
+static s32 pack_s2 = 0;
+
+static inline void ref_find_predict(const s16 *pcm, s32 *d_samples, s32 *predict_nr, s32 *shift_factor) {
+  register int i, j;
+  register s32 s0, s1, s2;
+  s32 buffer[PCM_CHUNK_SIZE][5];
+  s32 min = 0x7FFFFFFF;
+  s32 max[5];
+  s32 ds;
+  s32 min2;
+  s32 shift_mask;
+
+  for (i = 0; i < 5; i++) {
+    max[i] = 0.0;
+    s1 = find_s1;
+    s2 = find_s2;
+    for (j = 0; j < PCM_CHUNK_SIZE; j ++) {
+      s0 = (s32)pcm[j];
+      if (s0 > 32767)
+        s0 = 32767;
+      if (s0 < - 32768)
+        s0 = -32768;
+      ds = s0 + s1 * factors[i][0] + s2 * factors[i][1];
+      buffer[j][i] = ds;
+      if (ds > max[i])
+        max[i] = ds;
+      s2 = s1;
+      s1 = s0;
+    }
+    if (max[i] <= min) {
+      min = max[i];
+      *predict_nr = i;
+    }
+    if (min <= 7) {
+      *predict_nr = 0;
+      break;
+    }
+  }
+
+  find_s1 = s1;
+  find_s2 = s2;
+
+  for ( i = 0; i < PCM_CHUNK_SIZE; i++ )
+    d_samples[i] = buffer[i][*predict_nr];
+
+  min2 = ( int ) min;
+  shift_mask = 0x4000;
+  *shift_factor = 0;
+
+  while (*shift_factor < 12) {
+    if (shift_mask & (min2 + (shift_mask >> 3)))
+      break;
+    (*shift_factor)++;
+    shift_mask = shift_mask >> 1;
+  }
+}
+
+static inline void ref_do_pack(const s32 *d_samples, s16 *four_bit, const s32 predict_nr, const s32 shift_factor) {
+  register int i;
+  register s32 s0, di, ds;
+  for (i = 0; i < PCM_CHUNK_SIZE; ++i) {
+    s0 = d_samples[i] + pack_s1 * factors[predict_nr][0] + pack_s2 * factors[predict_nr][1];
+    ds = s0 * (s32)(1 << shift_factor);
+    di = ((s32) ds + 0x800) & 0xFFFFF000;
+    if (di > 32767)
+      di = 32767;
+    if (di < -32768)
+      di = -32768;
+    four_bit[i] = (s32)di;
+    di = di >> shift_factor;
+    pack_s2 = pack_s1;
+    pack_s1 = (s32)di - s0;
+  }
+}
+
+static int ref_pack_mono_s8(u8 *out, int out_size, const s8 *pcm, int pcm_size, int loopstart, int loopend) {
+  register int i, j, k;
+  register s16 *inptr;
+  register u8 *outptr;
+  register u8 d;
+  register int pcmpos = 0;
+  s32 d_samples[PCM_CHUNK_SIZE];
+  s16 four_bit[PCM_CHUNK_SIZE];
+  // these were uninitialized, which only mattered for the end block of an empty sound
+  s32 predict_nr = 0;
+  s32 shift_factor = 0;
+  int flags = 0;
+  const int doloop = (loopstart >= 0 && loopend > loopstart && loopend <= pcm_size);
+
+  // convert to chunk numbers
+  if (doloop) {
+    loopstart /= PCM_CHUNK_SIZE;
+    loopend   /= PCM_CHUNK_SIZE;
+  }
+
+  // reset globals
+  pack_s1 = pack_s2 = 0;
+  find_s1 = find_s2 = 0;
+
+  outptr = out;
+  while (pcm_size > 0) {
+    // refill buffer
+    int size = (pcm_size >= PCM_BUFFER_SIZE) ? PCM_BUFFER_SIZE : pcm_size;
+    for (i = 0; i < size; ++i) {
+      pcm_buffer[i] = *pcm++;
+      pcm_buffer[i] <<= 8;
+    }
+    // round up to chunk size
+    i = size / PCM_CHUNK_SIZE;
+    j = size % PCM_CHUNK_SIZE;
+    if (j) {
+      // fill the rest of the last chunk with silence
+      for (; j < PCM_CHUNK_SIZE; ++j)
+        pcm_buffer[i * PCM_CHUNK_SIZE + j] = 0;
+      ++i;
+    }
+    // check if it's going to fit
+    if (outptr + i * ADPCM_BLOCK_SIZE > out + out_size)
+      return -1;
+    // write out the blocks
+    for (j = 0; j < i; ++j) {
+      inptr = pcm_buffer + j * PCM_CHUNK_SIZE;
+      ref_find_predict(inptr, d_samples, &predict_nr, &shift_factor);
+      ref_do_pack(d_samples, four_bit, predict_nr, shift_factor);
+      if (doloop) {
+        if (loopstart >= 0 && pcmpos >= loopstart) {
+          // reached block where the start of the loop is, set loop start flag
+          flags = FLAG_LOOP_START;
+          loopstart = -1;
+        } else if (loopend >= 0 && pcmpos >= loopend) {
+          // reached block where the end of the loop is, set loop end flag
+          flags = FLAG_LOOP_END | FLAG_LOOP_REPEAT;
+          loopend = -1;
+        }
+      }
+      d = (predict_nr << 4) | shift_factor;
+      *outptr++ = d;
+      *outptr++ = flags;
+      for (k = 0; k < PCM_CHUNK_SIZE; k += 2) {
+        d = ((four_bit[k + 1] >> 8) & 0xF0) | ((four_bit[k] >> 12) & 0xF);
+        *outptr++ = d;
+      }
+      flags = 0;
+      ++pcmpos; // in chunks
+      pcm_size -= PCM_CHUNK_SIZE;
+    }
+  }
+
+  // check if we've run out of space for our extra empty block
+  if (outptr + ADPCM_BLOCK_SIZE > out + out_size)
+    return -1;
+
+  // loop endlessly in this null block
+  flags = FLAG_LOOP_END | FLAG_LOOP_REPEAT;
+  if (!doloop) flags |= FLAG_LOOP_START;
+  *outptr++ = (predict_nr << 4) | shift_factor;
+  *outptr++ = flags;
+  for (i = 0; i < PCM_CHUNK_SIZE / 2; ++i)
+    *outptr++ = 0;
+
+  return outptr - out;
+}
+
+/* the test */
+
+typedef struct {
+  const s8 *pcm;
+  int size;
+  int loopstart;
+  int loopend;
+} sound_t;
+
+static u8 out_ref[ADPCM_MAX_SIZE];
+static u8 out_new[ADPCM_MAX_SIZE];
+
+static int check_sound(const char *name, const sound_t *snd) {
+  // the new one has to leave the rest of the buffer alone too
+  memset(out_ref, 0xA5, sizeof(out_ref));
+  memset(out_new, 0xA5, sizeof(out_new));
+  const int len_ref = ref_pack_mono_s8(out_ref, ADPCM_MAX_SIZE, snd->pcm, snd->size, snd->loopstart, snd->loopend);
+  const int len_new = adpcm_pack_mono_s8(out_new, ADPCM_MAX_SIZE, snd->pcm, snd->size, snd->loopstart, snd->loopend);
+  if (len_ref != len_new) {
+    printf("%s: %d samples, loop %d..%d: %d bytes, should be %d\n", name, snd->size, snd->loopstart, snd->loopend, len_new, len_ref);
+    return 0;
+  }
+  if (memcmp(out_ref, out_new, sizeof(out_ref))) {
+    int i = 0;
+    while (out_ref[i] == out_new[i]) ++i;
+    printf("%s: %d samples, loop %d..%d: differs at byte %d (block %d): %02x, should be %02x\n",
+      name, snd->size, snd->loopstart, snd->loopend, i, i / ADPCM_BLOCK_SIZE, out_new[i], out_ref[i]);
+    return 0;
+  }
+  return 1;
+}
+
+// returns seconds per pass over all sounds
+static double bench(const int old, const sound_t *snds, const int num, u32 *passes) {
+  const clock_t t0 = clock();
+  clock_t t;
+  *passes = 0;
+  do {
+    for (int i = 0; i < num; ++i) {
+      if (old)
+        ref_pack_mono_s8(out_ref, ADPCM_MAX_SIZE, snds[i].pcm, snds[i].size, snds[i].loopstart, snds[i].loopend);
+      else
+        adpcm_pack_mono_s8(out_new, ADPCM_MAX_SIZE, snds[i].pcm, snds[i].size, snds[i].loopstart, snds[i].loopend);
+    }
+    ++*passes;
+    t = clock();
+  } while ((double)(t - t0) / CLOCKS_PER_SEC < 1.0);
+  return (double)(t - t0) / CLOCKS_PER_SEC / *passes;
+}
+
+// see convert_sound() in mkpack.c
+static int load_sound(sound_t *snd, const u8 *data, const u32 size) {
+  snd->loopstart = -1;
+  snd->loopend = -1;
+  snd->pcm = (const s8 *)data + PCM_DATA_OFFSET;
+  if (size < PCM_DATA_OFFSET) {
+    snd->size = 0;
+    return size == 0;
+  }
+  const s32 lstart = read16be(data) << 1;
+  const s32 lsize = read16be(data + 2) << 1;
+  if (lsize) {
+    snd->loopstart = lstart;
+    snd->loopend = lstart + lsize;
+  }
+  snd->size = (u16)(lstart + lsize);
+  // the header is all there is to go on, but don't read past the data
+  return (u32)snd->size <= size - PCM_DATA_OFFSET;
+}
+
+// something between silence, quiet and clipping, with a bit of noise
+static void make_random(sound_t *snd, s8 *pcm) {
+  const int size = (rand() % 4) ? rand() % MAX_RANDOM_SIZE : rand() % (PCM_CHUNK_SIZE * 4);
+  const int style = rand() % 4;
+  int v = 0;
+  for (int i = 0; i < size; ++i) {
+    switch (style) {
+      case 0: v = (s8)rand(); break;
+      case 1: v += rand() % 9 - 4; break;
+      case 2: v = ((i / 50) & 1) ? 127 : -128; break;
+      default: v = (i % 300 < 100) ? 0 : (rand() % 7 - 3) * ((i / 700) % 4); break;
+    }
+    if (v > 127) v = 127;
+    if (v < -128) v = -128;
+    pcm[i] = v;
+  }
+  snd->pcm = pcm;
+  snd->size = size;
+  snd->loopstart = -1;
+  snd->loopend = -1;
+  if (size && rand() % 2) {
+    snd->loopstart = rand() % size;
+    snd->loopend = snd->loopstart + rand() % (size - snd->loopstart + 1);
+  }
+}
+
+int main(int argc, const char **argv) {
+  int num_random = 0;
+  int argi = 1;
+  if (argi + 1 < argc && !strcmp(argv[argi], "-r")) {
+    num_random = atoi(argv[argi + 1]);
+    argi += 2;
+  }
+
+  if (argi >= argc && !num_random) {
+    fprintf(stderr, "usage: %s [-r <count>] [<datadir>]\n", argv[0]);
+    return 1;
+  }
+
+  static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+  static sound_t sounds[MEMLIST_MAX_ENTRIES];
+  int num_sounds = 0;
+  int num_bad = 0;
+  u32 total_samples = 0;
+
+  if (argi < argc) {
+    const char *datadir = argv[argi];
+    const int num = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+    if (num <= 0) return 1;
+    for (int i = 0; i < num; ++i) {
+      if (memlist[i].type != RT_SOUND || memlist[i].bank == 0) continue;
+      u8 *data = memlist_read_unpacked(datadir, memlist + i);
+      if (!data) continue;
+      char name[32];
+      snprintf(name, sizeof(name), "res %03x", i);
+      sound_t *snd = sounds + num_sounds;
+      if (!load_sound(snd, data, memlist[i].unpacked_size)) {
+        printf("%s: bad header (%d samples in %u bytes)\n", name, snd->size, memlist[i].unpacked_size);
+        ++num_bad;
+        free(data);
+        continue;
+      }
+      if (!check_sound(name, snd))
+        ++num_bad;
+      // data stays around for the benchmark
+      total_samples += snd->size;
+      ++num_sounds;
+    }
+    printf("adpcmtest: %d sounds, %u samples, %d bad\n", num_sounds, total_samples, num_bad);
+  }
+
+  if (num_random) {
+    static s8 pcm[MAX_RANDOM_SIZE];
+    int num_bad_random = 0;
+    srand(1);
+    for (int i = 0; i < num_random; ++i) {
+      sound_t snd;
+      make_random(&snd, pcm);
+      char name[32];
+      snprintf(name, sizeof(name), "random %d", i);
+      if (!check_sound(name, &snd))
+        ++num_bad_random;
+    }
+    printf("adpcmtest: %d random sounds, %d bad\n", num_random, num_bad_random);
+    num_bad += num_bad_random;
+  }
+
+  if (num_sounds) {
+    u32 passes_old, passes_new;
+    const double t_old = bench(1, sounds, num_sounds, &passes_old);
+    const double t_new = bench(0, sounds, num_sounds, &passes_new);
+    printf("old encoder: %8.3f ms per pass (%u passes)\n", t_old * 1000.0, passes_old);
+    printf("new encoder: %8.3f ms per pass (%u passes), %.2fx\n", t_new * 1000.0, passes_new, t_old / t_new);
+  }
+
+  return num_bad != 0;
+}
@@ -0,0 +1,378 @@
+// compiles the bytecode of every script resource in the data to C ahead of time (see VM_AOT in src/vm.c)
+// the code is found by following the control flow from offset 0 and from every op_set_script_slot target,
+// so it only ever decodes what the interpreter could actually get to; each segment turns into one function
+// that starts with a switch over the places a task can be picked up at (the start of a script, right after
+// an op_break or an op_call), because tasks resume in the middle of their scripts and share subroutines,
+// which doesn't split up into one C function per entry point without a way to jump between them
+// arithmetic and control flow become plain C, everything else calls the interpreter's handler with vm.pc
+// pointing at the operands, same as the interpreter would; anything it can't make sense of, like an invalid
+// opcode or a jump out of the segment, hands the task over to vm_run_task() right there
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "util.h"
+#include "memlist.h"
+
+#define RT_BYTECODE 4
+#define MAX_CODE 0x10000 // offsets are 16-bit
+
+#define F_INSN  1 // an instruction starts here
+#define F_LABEL 2 // something jumps here
+#define F_ENTRY 4 // a task can start here
+
+#define OP_CALL         0x04
+#define OP_RET          0x05
+#define OP_BREAK        0x06
+#define OP_JMP          0x07
+#define OP_SET_SLOT     0x08
+#define OP_JNZ          0x09
+#define OP_CONDJMP      0x0A
+#define OP_RESET_SCRIPT 0x0C
+#define OP_HALT         0x11
+
+// operand bytes of opcodes 0x00-0x1A, -1 for the one that depends on the operands
+static const s8 op_len[0x1B] = {
+  3, 2, 2, 3, 2, 0, 0, 2, 3, 3, -1, 2, 3, 1, 2, 2, 1, 0, 5, 2, 3, 3, 3, 3, 5, 2, 5
+};
+
+// handlers in src/vm.c for the opcodes that aren't compiled inline
+static const char *op_names[0x1B] = {
+  "op_mov_const", "op_mov", "op_add", "op_add_const", "op_call", "op_ret", "op_break", "op_jmp",
+  "op_set_script_slot", "op_jnz", "op_condjmp", "op_set_palette", "op_reset_script", "op_select_page",
+  "op_fill_page", "op_copy_page", "op_update_display", "op_halt", "op_draw_string", "op_sub",
+  "op_and", "op_or", "op_shl", "op_shr", "op_play_sound", "op_update_memlist", "op_play_music"
+};
+
+static const char *cond_ops[6] = { "==", "!=", ">", ">=", "<", "<=" };
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static int num_memlist;
+
+static u8 flags[MAX_CODE];
+static u16 work[MAX_CODE];
+static int num_work;
+static int has_ret;
+
+typedef struct {
+  u32 len;     // including the opcode, 0 if it can't be compiled
+  s32 target;  // jump or call target, -1 if none
+  u8 falls;    // can continue to the next instruction
+} insn_t;
+
+static void decode(const u8 *code, const u32 size, const u32 pc, insn_t *in) {
+  in->len = 0;
+  in->target = -1;
+  in->falls = 0;
+  if (pc >= size) return;
+
+  const u8 op = code[pc];
+  u32 len;
+  if (op & 0x80) {
+    len = 3;
+  } else if (op & 0x40) {
+    len = 2;
+    len += ((op & 0x30) == 0) ? 2 : 1;
+    len += ((op & 0x0C) == 0) ? 2 : 1;
+    len += ((op & 3) == 1 || (op & 3) == 2) ? 1 : 0;
+  } else if (op == OP_CONDJMP) {
+    if (pc + 1 >= size) return;
+    len = 5 + (((code[pc + 1] & 0xC0) == 0x40) ? 1 : 0);
+  } else if (op < sizeof(op_len)) {
+    len = op_len[op];
+  } else {
+    return;
+  }
+  // op_reset_script() bails before reading its last operand if the range is backwards
+  if (op == OP_RESET_SCRIPT && pc + 2 < size && (s8)((code[pc + 2] & 0x3F) - code[pc + 1]) < 0)
+    len = 2;
+  if (pc + 1 + len > size) return;
+
+  in->len = len + 1;
+  in->falls = 1;
+  switch (op) {
+    case OP_CALL:
+    case OP_JMP:
+      in->target = read16be(code + pc + 1);
+      in->falls = (op == OP_CALL);
+      break;
+    case OP_JNZ:
+      in->target = read16be(code + pc + 2);
+      break;
+    case OP_CONDJMP:
+      // conditions 6 and 7 never jump
+      if ((code[pc + 1] & 7) < 6)
+        in->target = read16be(code + pc + in->len - 2);
+      break;
+    case OP_RET:
+    case OP_HALT:
+      in->falls = 0;
+      break;
+    default:
+      break;
+  }
+}
+
+static void enqueue(const u32 pc) {
+  if (flags[pc] & F_INSN) return;
+  flags[pc] |= F_INSN;
+  work[num_work++] = pc;
+}
+
+static void find_code(const u8 *code, const u32 size) {
+  insn_t in;
+  memset(flags, 0, sizeof(flags));
+  num_work = 0;
+  flags[0] |= F_ENTRY;
+  enqueue(0);
+  while (num_work) {
+    const u32 pc = work[--num_work];
+    decode(code, size, pc, &in);
+    if (!in.len) continue;
+    const u8 op = code[pc];
+    const u32 next = pc + in.len;
+    // tasks pick up from right after a break, and returns go through the entry switch
+    if ((op == OP_BREAK || op == OP_CALL) && next < MAX_CODE)
+      flags[next] |= F_ENTRY;
+    if (op == OP_SET_SLOT) {
+      const u16 val = read16be(code + pc + 2);
+      if (val < 0xFFFE) {
+        flags[val] |= F_ENTRY;
+        enqueue(val);
+      }
+    }
+    if (in.target >= 0)
+      enqueue(in.target);
+    if (in.falls && next < MAX_CODE)
+      enqueue(next);
+  }
+}
+
+// first pass (out == NULL) only marks the labels that are going to be jumped to
+static void ref(const u32 pc) {
+  flags[pc] |= F_LABEL;
+}
+
+static void emit_insn(FILE *out, const u8 *code, const u32 pc, const insn_t *in) {
+  if (!in->len) {
+    if (out) fprintf(out, "  vm.pc = res_seg_code + 0x%04x; vm_run_task(); return;\n", pc);
+    return;
+  }
+
+  const u8 op = code[pc];
+  const u8 *arg = code + pc + 1;
+  const u32 next = pc + in->len;
+
+  if (in->target >= 0)
+    ref(in->target);
+  if (!out) {
+    has_ret |= (op == OP_RET);
+    return;
+  }
+
+  if (op & 0x80) {
+    fprintf(out, "  vm.pc = res_seg_code + 0x%04x; op_draw_shape_short(0x%02x);\n", pc + 1, op);
+    return;
+  } else if (op & 0x40) {
+    fprintf(out, "  vm.pc = res_seg_code + 0x%04x; op_draw_shape(0x%02x);\n", pc + 1, op);
+    return;
+  }
+
+  switch (op) {
+    case 0x00:
+      fprintf(out, "  vm.vars[0x%02x] = %d;\n", arg[0], (s16)read16be(arg + 1));
+      break;
+    case 0x01:
+      fprintf(out, "  vm.vars[0x%02x] = vm.vars[0x%02x];\n", arg[0], arg[1]);
+      break;
+    case 0x02:
+      fprintf(out, "  vm.vars[0x%02x] += vm.vars[0x%02x];\n", arg[0], arg[1]);
+      break;
+    case 0x03:
+      fprintf(out, "  vm.vars[0x%02x] += %d;\n", arg[0], (s16)read16be(arg + 1));
+      break;
+    case OP_CALL:
+      fprintf(out, "  vm.callstack[vm.sp++] = 0x%04x; goto l_%04x;\n", next, in->target);
+      break;
+    case OP_RET:
+      fprintf(out, "  pos = vm.callstack[--vm.sp]; goto dispatch;\n");
+      break;
+    case OP_BREAK:
+      fprintf(out, "  vm.pc = res_seg_code + 0x%04x; return;\n", next);
+      break;
+    case OP_JMP:
+      fprintf(out, "  goto l_%04x;\n", in->target);
+      break;
+    case OP_SET_SLOT:
+      fprintf(out, "  vm.script_pos[1][0x%02x] = 0x%04x;\n", arg[0], read16be(arg + 1));
+      break;
+    case OP_JNZ:
+      fprintf(out, "  if (--vm.vars[0x%02x]) goto l_%04x;\n", arg[0], in->target);
+      break;
+    case OP_CONDJMP: {
+      const u8 cop = arg[0];
+      if ((cop & 7) >= 6) {
+        fprintf(out, "  // condition %d never jumps\n", cop & 7);
+        break;
+      }
+      char rhs[32];
+      if (cop & 0x80)
+        snprintf(rhs, sizeof(rhs), "vm.vars[0x%02x]", arg[2]);
+      else if (cop & 0x40)
+        snprintf(rhs, sizeof(rhs), "%d", (s16)((arg[2] << 8) | arg[3]));
+      else
+        snprintf(rhs, sizeof(rhs), "%d", arg[2]);
+      fprintf(out, "  if (vm.vars[0x%02x] %s %s) goto l_%04x;\n", arg[1], cond_ops[cop & 7], rhs, in->target);
+      break;
+    }
+    case OP_HALT:
+      fprintf(out, "  vm.pc = res_seg_code + 0xFFFF; return;\n");
+      break;
+    case 0x13:
+      fprintf(out, "  vm.vars[0x%02x] -= vm.vars[0x%02x];\n", arg[0], arg[1]);
+      break;
+    case 0x14:
+    case 0x15:
+      fprintf(out, "  vm.vars[0x%02x] = (u16)vm.vars[0x%02x] %c 0x%04x;\n", arg[0], arg[0], op == 0x14 ? '&' : '|', read16be(arg + 1));
+      break;
+    case 0x16:
+    case 0x17:
+      // the hardware only looks at the low 5 bits of the shift amount, leave the weird ones to the handler
+      if (read16be(arg + 1) < 16) {
+        fprintf(out, "  vm.vars[0x%02x] = (u16)vm.vars[0x%02x] %s %u;\n", arg[0], arg[0], op == 0x16 ? "<<" : ">>", read16be(arg + 1));
+        break;
+      }
+      // fallthrough
+    default:
+      fprintf(out, "  vm.pc = res_seg_code + 0x%04x; %s();\n", pc + 1, op_names[op]);
+      break;
+  }
+}
+
+// goes over the instructions in address order, jumping explicitly wherever the next one in the
+// output isn't the one that follows in the bytecode (instructions can overlap)
+static void emit_code(FILE *out, const u8 *code, const u32 size) {
+  insn_t in;
+  s32 fall = -1;
+  for (u32 pc = 0; pc < MAX_CODE; ++pc) {
+    if (!(flags[pc] & F_INSN)) continue;
+    if (fall >= 0 && (u32)fall != pc) {
+      ref(fall);
+      if (out) fprintf(out, "  goto l_%04x;\n", fall);
+    }
+    if (out && (flags[pc] & F_LABEL))
+      fprintf(out, "l_%04x:\n", pc);
+    decode(code, size, pc, &in);
+    emit_insn(out, code, pc, &in);
+    fall = (in.len && in.falls) ? (s32)(pc + in.len) : -1;
+  }
+  // only happens if a segment is exactly 64K and runs right off the end of it
+  if (fall >= 0 && out)
+    fprintf(out, "  vm.pc = res_seg_code + 0x%x; vm_run_task(); return;\n", fall);
+}
+
+static int compile(FILE *out, const int res, const u8 *code, const u32 size) {
+  if (size > MAX_CODE) {
+    fprintf(stderr, "script %03x: %u bytes is too big, skipping it\n", res, size);
+    return 0;
+  }
+
+  find_code(code, size);
+  has_ret = 0;
+  emit_code(NULL, code, size);
+
+  int ninsns = 0, nentries = 0, nstubs = 0;
+  insn_t in;
+  for (u32 pc = 0; pc < MAX_CODE; ++pc) {
+    if (flags[pc] & F_ENTRY) {
+      ref(pc);
+      ++nentries;
+    }
+    if (flags[pc] & F_INSN) {
+      decode(code, size, pc, &in);
+      ++ninsns;
+      nstubs += !in.len;
+    }
+  }
+
+  fprintf(out, "// script %03x, %u bytes\n", res, size);
+  fprintf(out, "static void vm_aot_%03x(void) {\n", res);
+  fprintf(out, "  u16 pos = vm.pc - res_seg_code;\n");
+  if (has_ret) fprintf(out, "dispatch:\n");
+  fprintf(out, "  switch (pos) {\n");
+  for (u32 pc = 0; pc < MAX_CODE; ++pc) {
+    if (flags[pc] & F_ENTRY)
+      fprintf(out, "    case 0x%04x: goto l_%04x;\n", pc, pc);
+  }
+  fprintf(out, "    default: break;\n  }\n");
+  fprintf(out, "  // never saw a task start there\n");
+  fprintf(out, "  vm.pc = res_seg_code + pos;\n  vm_run_task();\n  return;\n");
+  emit_code(out, code, size);
+  fprintf(out, "}\n\n");
+
+  fprintf(stderr, "script %03x: %u bytes, %d instructions, %d entry points, %d left to the interpreter\n",
+    res, size, ninsns, nentries, nstubs);
+  return 1;
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <datadir> <out.h>\n", argv[0]);
+    return 1;
+  }
+
+  const char *datadir = argv[1];
+  num_memlist = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+  if (num_memlist <= 0) {
+    fprintf(stderr, "could not read the memlist from %s\n", datadir);
+    return 1;
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out) {
+    fprintf(stderr, "could not open %s\n", argv[2]);
+    return 1;
+  }
+
+  fprintf(out, "// generated by tools/aot.c from %s, do not edit\n\n", datadir);
+
+  u32 sizes[MEMLIST_MAX_ENTRIES];
+  u32 hashes[MEMLIST_MAX_ENTRIES];
+  int done[MEMLIST_MAX_ENTRIES] = { 0 };
+  int count = 0;
+  for (int i = 0; i < num_memlist; ++i) {
+    if (memlist[i].type != RT_BYTECODE || memlist[i].bank == 0) continue;
+    u8 *code = memlist_read_unpacked(datadir, memlist + i);
+    if (!code) {
+      fprintf(stderr, "script %03x: could not read it\n", i);
+      continue;
+    }
+    const u32 size = memlist[i].unpacked_size;
+    if (compile(out, i, code, size)) {
+      sizes[i] = size;
+      hashes[i] = hash_fnv1a(code, size);
+      done[i] = 1;
+      ++count;
+    }
+    free(code);
+  }
+
+  if (!count) {
+    fprintf(stderr, "no scripts in %s\n", datadir);
+    fclose(out);
+    remove(argv[2]);
+    return 1;
+  }
+
+  fprintf(out, "static const vm_aot_seg_t vm_aot_segs[] = {\n");
+  for (int i = 0; i < num_memlist; ++i) {
+    if (done[i])
+      fprintf(out, "  { %u, 0x%08x, vm_aot_%03x },\n", sizes[i], hashes[i], i);
+  }
+  fprintf(out, "};\n");
+
+  fclose(out);
+  return 0;
+}
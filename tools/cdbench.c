@@ -0,0 +1,241 @@
+// runs the game's CD file layer (src/cd.c) on the host against a disc image or the data directory,
+// loading resources the same way the loader does, and reports how long that would take on a 2x drive
+// the load order is either the memlist order or the one in a trace from a TRACE_LOG build (see src/trace.c)
+// with -c it also checks every resource it reads against the data directory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "types.h"
+#include "util.h"
+#include "cd.h"
+#include "pack.h"
+#include "res.h"
+#include "memlist.h"
+#include "cdhost.h"
+
+#define MAX_TRACE 8192
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static int num_memlist;
+
+static pack_entry_t pack_index[MEMLIST_MAX_ENTRIES];
+static int pack_mode;
+static u32 ml_hash; // see res_open_pack()
+
+static u16 order[MAX_TRACE];
+static int num_order;
+
+void panic(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+void do_assert(const int expr, const char *strexpr, const char *file, const int line) {
+  if (!expr) panic("ASSERTION FAILED:\n`%s` at %s:%d", strexpr, file, line);
+}
+
+static int load_memlist(void) {
+  cd_file_t *f = cd_fopen(MEMLIST_FILENAME, 0);
+  if (!f) return -1;
+
+  u8 buf[20]; // on-disk entry size, see mementry_t in src/res.h
+  num_memlist = 0;
+  ml_hash = FNV1A_INIT;
+  while (!cd_feof(f) && num_memlist < MEMLIST_MAX_ENTRIES) {
+    if (cd_fread(buf, sizeof(buf), 1, f) != sizeof(buf))
+      break;
+    ml_hash = hash_fnv1a_update(ml_hash, buf, sizeof(buf));
+    if (buf[0] == 0xFF)
+      break;
+    memlist_entry_t *me = memlist + num_memlist++;
+    me->status = buf[0];
+    me->type = buf[1];
+    me->rank = buf[6];
+    me->bank = buf[7];
+    me->bank_pos = read32be(buf + 8);
+    me->packed_size = read32be(buf + 12);
+    me->unpacked_size = read32be(buf + 16);
+  }
+
+  cd_fclose(f);
+  return num_memlist;
+}
+
+static int load_pack_index(void) {
+  s32 lba, size;
+  if (!cdhost_backend.locate(PACK_FILENAME, &lba, &size))
+    return 0;
+
+  cd_file_t *f = cd_fopen(PACK_FILENAME, 0);
+  if (!f) return 0;
+
+  pack_header_t hdr;
+  cd_freadordie(&hdr, sizeof(hdr), 1, f);
+  if (hdr.magic != PACK_MAGIC || hdr.version != PACK_VERSION || hdr.num_entries != num_memlist || hdr.memlist_hash != ml_hash) {
+    fprintf(stderr, "pack does not match the memlist, ignoring it\n");
+    cd_fclose(f);
+    return 0;
+  }
+  cd_freadordie(pack_index, sizeof(*pack_index), num_memlist, f);
+  cd_fclose(f);
+  return 1;
+}
+
+static int load_trace(const char *fname) {
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "could not open trace %s\n", fname);
+    return -1;
+  }
+
+  char line[512];
+  num_order = 0;
+  while (fgets(line, sizeof(line), f) && num_order < MAX_TRACE) {
+    const char *rec = strstr(line, "trace: ");
+    const char *res = rec ? strstr(rec, " res=") : NULL;
+    if (!res) continue;
+    const int resnum = atoi(res + 5);
+    if (resnum >= 0 && resnum < num_memlist)
+      order[num_order++] = resnum;
+  }
+
+  fclose(f);
+  return num_order;
+}
+
+// reads the resource the way res_read_bank() and res_read_pack() do; returns bytes read or -1
+static s32 read_res(const int i, u8 *out) {
+  const memlist_entry_t *me = memlist + i;
+  char fname[64];
+  u32 ofs, size;
+
+  if (pack_mode) {
+    if (pack_index[i].format == PF_NONE) return 0;
+    strcpy(fname, PACK_FILENAME);
+    ofs = pack_index[i].offset;
+    size = pack_index[i].size;
+  } else {
+    if (me->bank == 0) return 0;
+    snprintf(fname, sizeof(fname), BANK_FILENAME, (int)me->bank);
+    ofs = me->bank_pos;
+    size = me->packed_size;
+  }
+
+  cd_file_t *f = cd_fopen(fname, 1);
+  if (!f) return -1;
+  cd_fseek(f, ofs, SEEK_SET);
+  const s32 count = cd_fread(out, size, 1, f);
+  cd_fclose(f);
+  return count;
+}
+
+static int check_res(const char *datadir, const int i, const u8 *data, const s32 size) {
+  u8 *ref = NULL;
+  u32 refsize = 0;
+  if (pack_mode) {
+    FILE *f = data_fopen(datadir, "rawpsx.pak", "rb");
+    if (f) {
+      refsize = pack_index[i].size;
+      ref = calloc(1, refsize ? refsize : 1);
+      fseek(f, pack_index[i].offset, SEEK_SET);
+      if (fread(ref, 1, refsize, f) != refsize) refsize = 0;
+      fclose(f);
+    }
+  } else {
+    ref = memlist_read_packed(datadir, memlist + i);
+    refsize = memlist[i].packed_size;
+  }
+  const int ok = ref && (u32)size == refsize && !memcmp(ref, data, size);
+  if (!ok)
+    fprintf(stderr, "res %03x: data does not match %s\n", i, datadir);
+  free(ref);
+  return ok;
+}
+
+int main(int argc, const char **argv) {
+  const char *tracefile = NULL;
+  const char *checkdir = NULL;
+  int argi = 1;
+  while (argi < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-t") && argi + 1 < argc) {
+      tracefile = argv[argi + 1];
+      argi += 2;
+    } else if (!strcmp(argv[argi], "-c") && argi + 1 < argc) {
+      checkdir = argv[argi + 1];
+      argi += 2;
+    } else {
+      break;
+    }
+  }
+
+  if (argc - argi < 1) {
+    fprintf(stderr, "usage: %s [-t <tracefile>] [-c <datadir>] <image.iso|image.bin|datadir>\n", argv[0]);
+    return 1;
+  }
+
+  if (!cdhost_open(argv[argi]))
+    return 1;
+  cd_init(&cdhost_backend);
+
+  if (load_memlist() <= 0) {
+    fprintf(stderr, "could not read the memlist from %s\n", argv[argi]);
+    return 1;
+  }
+  pack_mode = load_pack_index();
+
+  if (tracefile) {
+    if (load_trace(tracefile) <= 0) {
+      fprintf(stderr, "no trace records in %s\n", tracefile);
+      return 1;
+    }
+  } else {
+    for (num_order = 0; num_order < num_memlist; ++num_order)
+      order[num_order] = num_order;
+  }
+
+  const unsigned long long t_start = cdhost_get_time_us();
+  cdhost_reset_stats();
+
+  u8 *buf = malloc(1024 * 1024);
+  u32 bytes = 0;
+  int loads = 0, errors = 0;
+  for (int n = 0; n < num_order; ++n) {
+    const int i = order[n];
+    const s32 count = read_res(i, buf);
+    if (count < 0) {
+      fprintf(stderr, "res %03x: read failed\n", i);
+      ++errors;
+      continue;
+    }
+    if (!count) continue;
+    if (checkdir && !check_res(checkdir, i, buf, count))
+      ++errors;
+    bytes += count;
+    ++loads;
+  }
+  free(buf);
+
+  cdhost_stats_t st;
+  u32 hits, misses;
+  cdhost_get_stats(&st);
+  cd_get_cache_stats(&hits, &misses);
+  const unsigned long long total = cdhost_get_time_us() - t_start;
+
+  printf("%s mode, %d loads, %u bytes in %llu ms (%u KB/s)\n",
+    pack_mode ? "pack" : "bank", loads, bytes, total / 1000, total ? (u32)(bytes * 1000000ULL / 1024 / total) : 0);
+  printf("drive: %u reads, %u sectors, %u seeks over %u sectors, seek %llu ms, transfer %llu ms, waited %llu ms\n",
+    st.reads, st.sectors, st.seeks, st.seek_dist, st.seek_us / 1000, st.xfer_us / 1000, st.wait_us / 1000);
+  printf("cache: %u hits, %u misses\n", hits, misses);
+  if (checkdir)
+    printf("check: %d errors\n", errors);
+
+  cdhost_close();
+  return errors ? 2 : 0;
+}
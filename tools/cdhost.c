@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "cd.h"
+#include "memlist.h"
+#include "cdhost.h"
+
+#define SECSIZE 2048
+#define RAW_SECSIZE 2352
+#define MAX_DIR_FILES 64
+#define DIR_FIRST_LBA 24 // where mkpsxiso would put the first file, roughly
+
+enum cdhost_source_e {
+  SRC_NONE,
+  SRC_ISO, // cooked 2048-byte sectors
+  SRC_BIN, // raw 2352-byte sectors
+  SRC_DIR, // loose files
+};
+
+typedef struct {
+  char name[64];
+  s32 lba;
+  s32 size;
+} dirfile_t;
+
+static int src_type = SRC_NONE;
+static FILE *src_img;
+static u32 src_dataofs; // offset of the user data in a raw sector
+static char src_dir[1024];
+static dirfile_t src_files[MAX_DIR_FILES];
+static int src_num_files;
+
+// the drive
+static unsigned long long cur_us;  // virtual clock
+static s32 head_lba;               // sector the head will be over after the last read
+static int pending;                // read in progress
+static s32 pending_lba;
+static s32 pending_nsecs;
+static void *pending_buf;
+static unsigned long long pending_done_us;
+
+static cdhost_stats_t stats;
+
+u32 cdhost_seek_time_us(const s32 dist) {
+  if (dist == 0) return 0;
+  const u32 d = (dist < 0) ? -dist : dist;
+  u32 root = 0;
+  while ((root + 1) * (root + 1) <= d) ++root;
+  return 20000 + root * 500;
+}
+
+static int read_image_sector(const s32 lba, u8 *out) {
+  long ofs;
+  if (src_type == SRC_BIN)
+    ofs = (long)lba * RAW_SECSIZE + src_dataofs;
+  else
+    ofs = (long)lba * SECSIZE;
+  if (fseek(src_img, ofs, SEEK_SET) != 0 || fread(out, SECSIZE, 1, src_img) != 1) {
+    memset(out, 0, SECSIZE);
+    return 0;
+  }
+  return 1;
+}
+
+static int read_dir_sector(const s32 lba, u8 *out) {
+  memset(out, 0, SECSIZE);
+  for (int i = 0; i < src_num_files; ++i) {
+    const dirfile_t *df = src_files + i;
+    const s32 secs = (df->size + SECSIZE - 1) / SECSIZE;
+    if (lba < df->lba || lba >= df->lba + secs) continue;
+    FILE *f = data_fopen(src_dir, df->name, "rb");
+    if (!f) return 0;
+    const int ok = (fseek(f, (long)(lba - df->lba) * SECSIZE, SEEK_SET) == 0);
+    if (ok) fread(out, 1, SECSIZE, f); // last sector of a file is zero padded
+    fclose(f);
+    return ok;
+  }
+  // gap between files or past the end
+  return 0;
+}
+
+static void read_sectors(const s32 lba, const s32 nsecs, u8 *buf) {
+  for (s32 i = 0; i < nsecs; ++i, buf += SECSIZE) {
+    if (src_type == SRC_DIR)
+      read_dir_sector(lba + i, buf);
+    else
+      read_image_sector(lba + i, buf);
+  }
+}
+
+static inline u32 read32le(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+// compares an ISO 9660 name to a path component, ignoring case and the ";1" version suffix
+static int iso_name_eq(const char *isoname, const int isolen, const char *name, const int len) {
+  int a = isolen, b = len;
+  for (int i = 0; i < isolen; ++i) if (isoname[i] == ';') { a = i; break; }
+  for (int i = 0; i < len; ++i) if (name[i] == ';') { b = i; break; }
+  // directory entries for files without an extension sometimes end in a dot
+  if (a > 0 && isoname[a - 1] == '.') --a;
+  return a == b && !strncasecmp(isoname, name, a);
+}
+
+static int iso_locate(const char *fname, s32 *lba, s32 *size) {
+  u8 sec[SECSIZE];
+
+  // the root directory record lives in the primary volume descriptor
+  if (!read_image_sector(16, sec) || sec[0] != 1 || memcmp(sec + 1, "CD001", 5))
+    return 0;
+  s32 cur_lba = read32le(sec + 156 + 2);
+  s32 cur_size = read32le(sec + 156 + 10);
+  int cur_dir = 1;
+
+  const char *p = fname;
+  while (*p) {
+    while (*p == '\\' || *p == '/') ++p;
+    if (!*p) break;
+    const char *end = p;
+    while (*end && *end != '\\' && *end != '/') ++end;
+    if (!cur_dir) return 0; // path goes through a file
+
+    int found = 0;
+    const s32 nsecs = (cur_size + SECSIZE - 1) / SECSIZE;
+    for (s32 s = 0; s < nsecs && !found; ++s) {
+      if (!read_image_sector(cur_lba + s, sec)) return 0;
+      for (int ofs = 0; ofs < SECSIZE && sec[ofs]; ofs += sec[ofs]) {
+        const u8 *rec = sec + ofs;
+        const int namelen = rec[32];
+        if (namelen == 1 && rec[33] <= 1) continue; // . and ..
+        if (iso_name_eq((const char *)rec + 33, namelen, p, end - p)) {
+          cur_lba = read32le(rec + 2);
+          cur_size = read32le(rec + 10);
+          cur_dir = (rec[25] & 2) != 0;
+          found = 1;
+          break;
+        }
+      }
+    }
+    if (!found) return 0;
+    p = end;
+  }
+
+  if (cur_dir) return 0;
+  *lba = cur_lba;
+  *size = cur_size;
+  return 1;
+}
+
+static int dir_locate(const char *fname, s32 *lba, s32 *size) {
+  // everything is in one directory, so just look at the last path component
+  const char *name = fname;
+  for (const char *p = fname; *p; ++p)
+    if (*p == '\\' || *p == '/') name = p + 1;
+  int len = strlen(name);
+  for (int i = 0; i < len; ++i) if (name[i] == ';') { len = i; break; }
+
+  for (int i = 0; i < src_num_files; ++i) {
+    if ((int)strlen(src_files[i].name) == len && !strncasecmp(src_files[i].name, name, len)) {
+      *lba = src_files[i].lba;
+      *size = src_files[i].size;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int dirfile_cmp(const void *a, const void *b) {
+  return strcasecmp(((const dirfile_t *)a)->name, ((const dirfile_t *)b)->name);
+}
+
+static int open_dir(const char *path) {
+  DIR *d = opendir(path);
+  if (!d) return 0;
+
+  strncpy(src_dir, path, sizeof(src_dir) - 1);
+  src_num_files = 0;
+
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    char fpath[2048];
+    struct stat st;
+    snprintf(fpath, sizeof(fpath), "%s/%s", path, de->d_name);
+    if (de->d_name[0] == '.' || stat(fpath, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (strlen(de->d_name) >= sizeof(src_files[0].name))
+      continue;
+    if (src_num_files >= MAX_DIR_FILES) {
+      fprintf(stderr, "cdhost_open(%s): too many files, ignoring the rest\n", path);
+      break;
+    }
+    dirfile_t *df = src_files + src_num_files++;
+    strcpy(df->name, de->d_name);
+    df->size = st.st_size;
+  }
+  closedir(d);
+
+  qsort(src_files, src_num_files, sizeof(*src_files), dirfile_cmp);
+  s32 lba = DIR_FIRST_LBA;
+  for (int i = 0; i < src_num_files; ++i) {
+    src_files[i].lba = lba;
+    lba += (src_files[i].size + SECSIZE - 1) / SECSIZE;
+  }
+
+  src_type = SRC_DIR;
+  return 1;
+}
+
+static int open_image(const char *path) {
+  static const u8 sync[12] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+  u8 raw[16];
+
+  src_img = fopen(path, "rb");
+  if (!src_img) return 0;
+
+  // raw images start every sector with the sync pattern and a header that tells the mode
+  src_type = SRC_ISO;
+  src_dataofs = 0;
+  if (fread(raw, sizeof(raw), 1, src_img) == 1 && !memcmp(raw, sync, sizeof(sync))) {
+    src_type = SRC_BIN;
+    src_dataofs = (raw[15] == 2) ? 24 : 16; // mode 2 form 1 has an 8-byte subheader
+  }
+
+  return 1;
+}
+
+int cdhost_open(const char *path) {
+  struct stat st;
+  cdhost_close();
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "cdhost_open(%s): does not exist\n", path);
+    return 0;
+  }
+  const int ok = S_ISDIR(st.st_mode) ? open_dir(path) : open_image(path);
+  if (!ok)
+    fprintf(stderr, "cdhost_open(%s): could not open\n", path);
+  return ok;
+}
+
+void cdhost_close(void) {
+  if (src_img) fclose(src_img);
+  src_img = NULL;
+  src_type = SRC_NONE;
+  src_num_files = 0;
+}
+
+unsigned long long cdhost_get_time_us(void) {
+  return cur_us;
+}
+
+void cdhost_advance_us(const u32 us) {
+  cur_us += us;
+}
+
+void cdhost_get_stats(cdhost_stats_t *st) {
+  *st = stats;
+}
+
+void cdhost_reset_stats(void) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+static void cdhost_complete(void) {
+  // the data only shows up in the buffer once the read is done, same as with DMA
+  read_sectors(pending_lba, pending_nsecs, pending_buf);
+  pending = 0;
+}
+
+static int cdhost_init(void) {
+  if (src_type == SRC_NONE) {
+    fprintf(stderr, "cdhost_init(): call cdhost_open() first\n");
+    return 0;
+  }
+  cur_us = 0;
+  head_lba = 0;
+  pending = 0;
+  cdhost_reset_stats();
+  return 1;
+}
+
+static int cdhost_locate(const char *fname, s32 *lba, s32 *size) {
+  return (src_type == SRC_DIR) ? dir_locate(fname, lba, size) : iso_locate(fname, lba, size);
+}
+
+static void cdhost_read(const s32 lba, const s32 nsecs, void *buf) {
+  // cd.c always waits for the last read before starting a new one, but just in case
+  if (pending) cdhost_complete();
+
+  const s32 dist = lba - head_lba;
+  const u32 seek = cdhost_seek_time_us(dist);
+  const unsigned long long xfer = (unsigned long long)nsecs * CDHOST_SECTOR_US;
+  if (dist) {
+    ++stats.seeks;
+    stats.seek_dist += (dist < 0) ? -dist : dist;
+    stats.seek_us += seek;
+  }
+  ++stats.reads;
+  stats.sectors += nsecs;
+  stats.xfer_us += xfer;
+
+  pending = 1;
+  pending_lba = lba;
+  pending_nsecs = nsecs;
+  pending_buf = buf;
+  pending_done_us = cur_us + seek + xfer;
+  head_lba = lba + nsecs;
+}
+
+static int cdhost_sync(const int mode) {
+  if (!pending) return 0;
+
+  if (mode == 0) {
+    if (cur_us < pending_done_us) {
+      stats.wait_us += pending_done_us - cur_us;
+      cur_us = pending_done_us;
+    }
+    cdhost_complete();
+    return 0;
+  }
+
+  ++stats.polls;
+  cur_us += CDHOST_POLL_US;
+  if (cur_us >= pending_done_us) {
+    cdhost_complete();
+    return 0;
+  }
+
+  const s32 left = (pending_done_us - cur_us + CDHOST_SECTOR_US - 1) / CDHOST_SECTOR_US;
+  return (left > pending_nsecs) ? pending_nsecs : left;
+}
+
+const cd_backend_t cdhost_backend = {
+  cdhost_init,
+  cdhost_locate,
+  cdhost_read,
+  cdhost_sync,
+};
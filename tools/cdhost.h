@@ -0,0 +1,39 @@
+#pragma once
+
+// host-side CD backend for src/cd.c: serves sectors from a disc image or the data directory
+// and keeps a virtual clock that advances like a 2x drive would, so the file buffering,
+// read-ahead and loader scheduling can be run and timed on the build machine
+
+#include "types.h"
+#include "cd.h"
+
+#define CDHOST_SECTOR_US 6667 // 150 sectors per second at 2x
+#define CDHOST_POLL_US   20   // what a sync(1) poll costs, so polling loops still make progress
+
+typedef struct {
+  u32 reads;
+  u32 sectors;
+  u32 seeks;
+  u32 seek_dist;       // in sectors
+  unsigned long long seek_us;
+  unsigned long long xfer_us;
+  unsigned long long wait_us; // time spent blocked in sync(0)
+  u32 polls;
+} cdhost_stats_t;
+
+extern const cd_backend_t cdhost_backend;
+
+// `path` is either an .iso with 2048-byte sectors, a .bin with raw 2352-byte sectors,
+// or a directory with the data files, which get laid out one after another in name order;
+// returns 0 on failure
+int cdhost_open(const char *path);
+void cdhost_close(void);
+
+// the virtual clock; advance it to account for the CPU doing other stuff between reads
+unsigned long long cdhost_get_time_us(void);
+void cdhost_advance_us(const u32 us);
+void cdhost_get_stats(cdhost_stats_t *st);
+void cdhost_reset_stats(void);
+
+// estimated seek time over `dist` sectors, also used by the layout tool
+u32 cdhost_seek_time_us(const s32 dist);
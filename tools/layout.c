@@ -0,0 +1,546 @@
+// lays out the data files on the disc in the order the game actually reads them,
+// based on a load trace from a build with TRACE_LOG defined (see src/trace.c);
+// just capture the TTY output of a playthrough, everything that's not a trace line is ignored
+// reads the existing iso.xml and writes a new one with the data directory reordered
+// with -s <outdir> it also rewrites the data itself so that each part's resources are
+// contiguous and in access order:
+//   bank mode: the banks are split into one file per part and a new MEMLIST.BIN is written
+//   pack mode: the pack is rewritten with the entries in access order
+// the estimated seek time of the trace is reported for the old and the new layout
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "util.h"
+#include "pack.h"
+#include "trace.h"
+#include "memlist.h"
+#include "cdhost.h"
+
+#define MAX_TRACE 8192
+#define MAX_FILES 64
+#define MAX_LINES 256
+#define SECSIZE 2048
+#define SPLIT_BANK_BASE 0x10 // split banks are numbered from here, so they never clash with the original ones
+
+typedef struct {
+  u16 part;
+  u16 res;
+} access_t;
+
+typedef struct {
+  char name[64];    // name on the disc
+  char source[256]; // path for mkpsxiso
+  u32 size;
+} isofile_t;
+
+typedef struct {
+  isofile_t files[MAX_FILES];
+  int num_files;
+  // where every memlist entry is
+  int res_file[MEMLIST_MAX_ENTRIES]; // -1 if it's not on the disc
+  u32 res_ofs[MEMLIST_MAX_ENTRIES];
+  u32 res_size[MEMLIST_MAX_ENTRIES];
+} layout_t;
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static int num_memlist;
+
+static pack_entry_t pack_index[MEMLIST_MAX_ENTRIES];
+static int pack_mode;
+static u32 pack_hash; // the memlist stays the same in pack mode, so this carries over
+
+static access_t trace[MAX_TRACE];
+static int num_trace;
+
+static int first_access[MEMLIST_MAX_ENTRIES]; // index into trace, -1 if never accessed
+static u16 first_part[MEMLIST_MAX_ENTRIES];
+
+static char *xml_lines[MAX_LINES];
+static int num_xml_lines;
+static int xml_dir_start; // first line after <dir name="data">
+static int xml_dir_end;   // the </dir> line
+
+static layout_t layout_old;
+static layout_t layout_new;
+
+static const char *get_field(const char *line, const char *key) {
+  const char *p = strstr(line, key);
+  return p ? p + strlen(key) : NULL;
+}
+
+static int load_trace(const char *fname) {
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "could not open trace %s\n", fname);
+    return -1;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    const char *rec = strstr(line, "trace: ");
+    if (!rec) continue;
+    const char *part = get_field(rec, " part=");
+    const char *res = get_field(rec, " res=");
+    const char *src = get_field(rec, " src=");
+    const char *ok = get_field(rec, " ok=");
+    if (!part || !res || !src || !ok || !atoi(ok))
+      continue;
+    if (num_trace >= MAX_TRACE) {
+      fprintf(stderr, "trace too long, only using the first %d loads\n", MAX_TRACE);
+      break;
+    }
+    const int resnum = atoi(res);
+    if (resnum < 0 || resnum >= num_memlist)
+      continue;
+    if (atoi(src) == TRACE_SRC_PACK)
+      pack_mode = 1;
+    trace[num_trace].part = atoi(part);
+    trace[num_trace].res = resnum;
+    ++num_trace;
+  }
+
+  fclose(f);
+  return num_trace;
+}
+
+static inline u32 read32le(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+static int load_pack_index(const char *datadir) {
+  FILE *f = data_fopen(datadir, "rawpsx.pak", "rb");
+  if (!f) {
+    fprintf(stderr, "trace was recorded with a pack, but there's no rawpsx.pak in %s\n", datadir);
+    return -1;
+  }
+
+  u8 buf[sizeof(pack_entry_t)];
+  if (memlist_hash(datadir, &pack_hash) < 0 || fread(buf, sizeof(pack_header_t), 1, f) != 1 ||
+      read32le(buf) != PACK_MAGIC || read16le(buf + 4) != PACK_VERSION || read16le(buf + 6) != num_memlist || read32le(buf + 8) != pack_hash) {
+    fprintf(stderr, "rawpsx.pak does not match memlist, rebuild it with mkpack\n");
+    fclose(f);
+    return -1;
+  }
+
+  for (int i = 0; i < num_memlist; ++i) {
+    if (fread(buf, sizeof(buf), 1, f) != 1) {
+      fclose(f);
+      return -1;
+    }
+    pack_index[i].offset = read32le(buf + 0);
+    pack_index[i].size = read32le(buf + 4);
+    pack_index[i].format = buf[8];
+  }
+
+  fclose(f);
+  return 0;
+}
+
+static char *copy_attr(const char *line, const char *attr, char *out, const int outsize) {
+  const char *p = get_field(line, attr);
+  if (!p || *p != '"') return NULL;
+  ++p;
+  int i = 0;
+  while (*p && *p != '"' && i < outsize - 1)
+    out[i++] = *p++;
+  out[i] = 0;
+  return out;
+}
+
+static void add_file(layout_t *l, const char *name, const char *source) {
+  if (l->num_files >= MAX_FILES) {
+    fprintf(stderr, "too many files\n");
+    exit(1);
+  }
+  isofile_t *f = l->files + l->num_files++;
+  strncpy(f->name, name, sizeof(f->name) - 1);
+  strncpy(f->source, source, sizeof(f->source) - 1);
+  struct stat st;
+  f->size = (stat(source, &st) == 0) ? st.st_size : 0;
+}
+
+static int find_file(const layout_t *l, const char *name) {
+  for (int i = 0; i < l->num_files; ++i) {
+    if (!strcasecmp(l->files[i].name, name))
+      return i;
+  }
+  return -1;
+}
+
+// reads iso.xml and takes the data directory from it as the old layout
+static int load_xml(const char *fname) {
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "could not open %s\n", fname);
+    return -1;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f) && num_xml_lines < MAX_LINES) {
+    xml_lines[num_xml_lines] = strdup(line);
+    if (strstr(line, "<dir") && strstr(line, "name=\"data\""))
+      xml_dir_start = num_xml_lines + 1;
+    else if (xml_dir_start && !xml_dir_end && strstr(line, "</dir>"))
+      xml_dir_end = num_xml_lines;
+    ++num_xml_lines;
+  }
+  fclose(f);
+
+  if (!xml_dir_start || !xml_dir_end) {
+    fprintf(stderr, "%s has no data directory\n", fname);
+    return -1;
+  }
+
+  for (int i = xml_dir_start; i < xml_dir_end; ++i) {
+    char name[64], source[256];
+    if (strstr(xml_lines[i], "<file") && copy_attr(xml_lines[i], "name=", name, sizeof(name)) && copy_attr(xml_lines[i], "source=", source, sizeof(source)))
+      add_file(&layout_old, name, source);
+  }
+
+  return layout_old.num_files;
+}
+
+// puts every memlist entry where the engine is going to look for it
+static void locate_entries(layout_t *l) {
+  const int pak = find_file(l, "rawpsx.pak");
+  for (int i = 0; i < num_memlist; ++i) {
+    l->res_file[i] = -1;
+    if (pack_mode) {
+      if (pak < 0 || pack_index[i].format == PF_NONE) continue;
+      l->res_file[i] = pak;
+      l->res_ofs[i] = pack_index[i].offset;
+      l->res_size[i] = pack_index[i].size;
+    } else {
+      char name[16];
+      snprintf(name, sizeof(name), "bank%02x", (int)memlist[i].bank);
+      l->res_file[i] = memlist[i].bank ? find_file(l, name) : -1;
+      l->res_ofs[i] = memlist[i].bank_pos;
+      l->res_size[i] = memlist[i].packed_size;
+    }
+  }
+}
+
+// very rough seek time model: nothing for contiguous reads, otherwise a fixed cost
+// for settling and waiting for the sector to come around, plus a part that grows
+// with the distance the head has to travel
+static void simulate(const layout_t *l, const char *title) {
+  // file start sectors
+  u32 lba[MAX_FILES];
+  u32 sec = 0;
+  for (int i = 0; i < l->num_files; ++i) {
+    lba[i] = sec;
+    sec += (l->files[i].size + SECSIZE - 1) / SECSIZE;
+  }
+
+  // startup reads the memlist (and the pack header) before anything else
+  const int ml = find_file(l, "memlist.bin");
+  s32 pos = (ml >= 0) ? lba[ml] + (l->files[ml].size + SECSIZE - 1) / SECSIZE : 0;
+
+  u32 total_us = 0;
+  u32 total_dist = 0;
+  u32 num_seeks = 0;
+  for (int i = 0; i < num_trace; ++i) {
+    const int res = trace[i].res;
+    const int file = l->res_file[res];
+    if (file < 0) continue;
+    const s32 start = lba[file] + l->res_ofs[res] / SECSIZE;
+    const s32 end = lba[file] + (l->res_ofs[res] + l->res_size[res] + SECSIZE - 1) / SECSIZE;
+    const s32 dist = start - pos;
+    if (dist) {
+      ++num_seeks;
+      total_dist += (dist < 0) ? -dist : dist;
+      total_us += cdhost_seek_time_us(dist);
+    }
+    pos = end;
+  }
+
+  printf("%s: %u sectors total, %d loads, %u seeks over %u sectors, est. seek time %u ms\n",
+    title, sec, num_trace, num_seeks, total_dist, total_us / 1000);
+}
+
+static int cmp_first_access(const void *a, const void *b) {
+  const int ra = *(const int *)a;
+  const int rb = *(const int *)b;
+  const int fa = (first_access[ra] < 0) ? MAX_TRACE + ra : first_access[ra];
+  const int fb = (first_access[rb] < 0) ? MAX_TRACE + rb : first_access[rb];
+  return fa - fb;
+}
+
+// memlist entries sorted by first access, never accessed ones last in memlist order
+static void sort_entries(int *order) {
+  for (int i = 0; i < num_memlist; ++i)
+    order[i] = i;
+  qsort(order, num_memlist, sizeof(*order), cmp_first_access);
+}
+
+// same files, ordered by when they're first read from
+static void layout_reorder(void) {
+  int file_first[MAX_FILES];
+  for (int i = 0; i < layout_old.num_files; ++i)
+    file_first[i] = MAX_TRACE + i;
+  for (int i = 0; i < num_memlist; ++i) {
+    const int file = layout_old.res_file[i];
+    if (file >= 0 && first_access[i] >= 0 && first_access[i] < file_first[file])
+      file_first[file] = first_access[i];
+  }
+  // the memlist is read at startup, so it goes first
+  const int ml = find_file(&layout_old, "memlist.bin");
+  if (ml >= 0) file_first[ml] = -1;
+
+  int done[MAX_FILES] = { 0 };
+  for (int n = 0; n < layout_old.num_files; ++n) {
+    int best = -1;
+    for (int i = 0; i < layout_old.num_files; ++i) {
+      if (!done[i] && (best < 0 || file_first[i] < file_first[best]))
+        best = i;
+    }
+    done[best] = 1;
+    add_file(&layout_new, layout_old.files[best].name, layout_old.files[best].source);
+  }
+
+  locate_entries(&layout_new);
+}
+
+static u8 *read_pack_data(const char *datadir, const int res) {
+  FILE *f = data_fopen(datadir, "rawpsx.pak", "rb");
+  if (!f) return NULL;
+  u8 *buf = malloc(pack_index[res].size ? pack_index[res].size : 1);
+  if (fseek(f, pack_index[res].offset, SEEK_SET) != 0 || fread(buf, 1, pack_index[res].size, f) != pack_index[res].size) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+static void write_u32le(u8 *p, const u32 x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// rewrites the pack with the entries in access order
+static int split_pack(const char *datadir, const char *outdir, const int *order) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/rawpsx.pak", outdir);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "could not open %s for writing\n", path);
+    return -1;
+  }
+
+  static const u8 zero[SECSIZE];
+  static pack_entry_t new_index[MEMLIST_MAX_ENTRIES];
+  u32 ofs = ALIGN(sizeof(pack_header_t) + num_memlist * sizeof(pack_entry_t), SECSIZE);
+  fseek(f, ofs, SEEK_SET);
+
+  for (int n = 0; n < num_memlist; ++n) {
+    const int i = order[n];
+    new_index[i] = pack_index[i];
+    if (pack_index[i].format == PF_NONE) continue;
+    u8 *data = read_pack_data(datadir, i);
+    if (!data) {
+      fprintf(stderr, "could not read pack entry %d\n", i);
+      fclose(f);
+      return -1;
+    }
+    new_index[i].offset = ofs;
+    fwrite(data, 1, pack_index[i].size, f);
+    free(data);
+    const u32 padded = ALIGN(pack_index[i].size, SECSIZE);
+    fwrite(zero, 1, padded - pack_index[i].size, f);
+    ofs += padded;
+  }
+
+  u8 buf[sizeof(pack_entry_t)];
+  fseek(f, 0, SEEK_SET);
+  write_u32le(buf + 0, PACK_MAGIC);
+  buf[4] = PACK_VERSION; buf[5] = PACK_VERSION >> 8;
+  buf[6] = num_memlist; buf[7] = num_memlist >> 8;
+  write_u32le(buf + 8, pack_hash);
+  fwrite(buf, 1, sizeof(pack_header_t), f);
+  for (int i = 0; i < num_memlist; ++i) {
+    memset(buf, 0, sizeof(buf));
+    write_u32le(buf + 0, new_index[i].offset);
+    write_u32le(buf + 4, new_index[i].size);
+    buf[8] = new_index[i].format;
+    fwrite(buf, 1, sizeof(buf), f);
+  }
+  fclose(f);
+
+  memcpy(pack_index, new_index, sizeof(pack_index));
+
+  // the memlist stays the same, but still goes first
+  const int ml = find_file(&layout_old, "memlist.bin");
+  if (ml >= 0)
+    add_file(&layout_new, "memlist.bin", layout_old.files[ml].source);
+  add_file(&layout_new, "rawpsx.pak", path);
+  return 0;
+}
+
+// moves all present entries into new banks, one per part in access order,
+// plus one more for everything that was never loaded
+static int split_banks(const char *datadir, const char *outdir, const int *order) {
+  static memlist_entry_t new_memlist[MEMLIST_MAX_ENTRIES];
+  memcpy(new_memlist, memlist, sizeof(new_memlist));
+
+  char path[1024];
+  FILE *f = NULL;
+  int bank = SPLIT_BANK_BASE - 1;
+  int cur_group = -1;
+  u32 ofs = 0;
+  static char banknames[0x100][16];
+  static char bankpaths[0x100][1024];
+
+  for (int n = 0; n < num_memlist; ++n) {
+    const int i = order[n];
+    u8 *data = memlist_read_packed(datadir, memlist + i);
+    if (!data)
+      continue; // stays pointing at a bank that doesn't exist, same as before
+
+    const int group = (first_access[i] < 0) ? 0x10000 : first_part[i];
+    if (group != cur_group) {
+      if (f) fclose(f);
+      if (++bank > 0xFF) {
+        fprintf(stderr, "too many banks\n");
+        free(data);
+        return -1;
+      }
+      snprintf(banknames[bank], sizeof(banknames[bank]), "bank%02x", bank);
+      snprintf(bankpaths[bank], sizeof(bankpaths[bank]), "%s/%s", outdir, banknames[bank]);
+      f = fopen(bankpaths[bank], "wb");
+      if (!f) {
+        fprintf(stderr, "could not open %s for writing\n", bankpaths[bank]);
+        free(data);
+        return -1;
+      }
+      cur_group = group;
+      ofs = 0;
+    }
+
+    fwrite(data, 1, memlist[i].packed_size, f);
+    free(data);
+    new_memlist[i].bank = bank;
+    new_memlist[i].bank_pos = ofs;
+    ofs += memlist[i].packed_size;
+  }
+  if (f) fclose(f);
+
+  snprintf(path, sizeof(path), "%s/memlist.bin", outdir);
+  if (memlist_save(path, new_memlist, num_memlist) < 0)
+    return -1;
+
+  memcpy(memlist, new_memlist, sizeof(memlist));
+
+  add_file(&layout_new, "memlist.bin", path);
+  for (int b = SPLIT_BANK_BASE; b <= bank; ++b)
+    add_file(&layout_new, banknames[b], bankpaths[b]);
+  return 0;
+}
+
+static void add_remaining_files(void) {
+  // anything else that was in the data dir goes after, except the files that got replaced
+  for (int i = 0; i < layout_old.num_files; ++i) {
+    const char *name = layout_old.files[i].name;
+    if (find_file(&layout_new, name) >= 0) continue;
+    if (!pack_mode && !strncasecmp(name, "bank", 4)) continue;
+    add_file(&layout_new, name, layout_old.files[i].source);
+  }
+}
+
+static int write_xml(const char *fname) {
+  FILE *f = fopen(fname, "w");
+  if (!f) {
+    fprintf(stderr, "could not open %s for writing\n", fname);
+    return -1;
+  }
+
+  // figure out the indentation of the file entries
+  char indent[64] = "        ";
+  for (int i = xml_dir_start; i < xml_dir_end; ++i) {
+    if (strstr(xml_lines[i], "<file")) {
+      const int n = strspn(xml_lines[i], " \t");
+      if (n < (int)sizeof(indent)) {
+        memcpy(indent, xml_lines[i], n);
+        indent[n] = 0;
+      }
+      break;
+    }
+  }
+
+  for (int i = 0; i < xml_dir_start; ++i)
+    fputs(xml_lines[i], f);
+  for (int i = 0; i < layout_new.num_files; ++i)
+    fprintf(f, "%s<file name=\"%s\" type=\"data\" source=\"%s\"/>\n", indent, layout_new.files[i].name, layout_new.files[i].source);
+  for (int i = xml_dir_end; i < num_xml_lines; ++i)
+    fputs(xml_lines[i], f);
+
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, const char **argv) {
+  const char *outdir = NULL;
+  const char *inxml = "iso.xml";
+  int argi = 1;
+  while (argi < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-s") && argi + 1 < argc) {
+      outdir = argv[argi + 1];
+      argi += 2;
+    } else if (!strcmp(argv[argi], "-i") && argi + 1 < argc) {
+      inxml = argv[argi + 1];
+      argi += 2;
+    } else {
+      break;
+    }
+  }
+
+  if (argc - argi < 3) {
+    fprintf(stderr, "usage: %s [-i <in.xml>] [-s <outdir>] <datadir> <tracefile> <out.xml>\n", argv[0]);
+    return 1;
+  }
+
+  const char *datadir = argv[argi];
+  num_memlist = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+  if (num_memlist <= 0) return 1;
+
+  if (load_trace(argv[argi + 1]) <= 0) {
+    fprintf(stderr, "no trace records in %s\n", argv[argi + 1]);
+    return 1;
+  }
+
+  if (pack_mode && load_pack_index(datadir) < 0)
+    return 1;
+
+  if (load_xml(inxml) <= 0)
+    return 1;
+
+  for (int i = 0; i < num_memlist; ++i)
+    first_access[i] = -1;
+  for (int i = num_trace - 1; i >= 0; --i) {
+    first_access[trace[i].res] = i;
+    first_part[trace[i].res] = trace[i].part;
+  }
+
+  locate_entries(&layout_old);
+
+  if (outdir) {
+    int order[MEMLIST_MAX_ENTRIES];
+    sort_entries(order);
+    if ((pack_mode ? split_pack(datadir, outdir, order) : split_banks(datadir, outdir, order)) < 0)
+      return 1;
+    add_remaining_files();
+    locate_entries(&layout_new);
+  } else {
+    layout_reorder();
+  }
+
+  printf("layout: %s mode, %d trace records\n", pack_mode ? "pack" : "bank", num_trace);
+  simulate(&layout_old, "before");
+  simulate(&layout_new, "after ");
+
+  return write_xml(argv[argi + 2]) ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "types.h"
+#include "util.h"
+#include "unpack.h"
+#include "memlist.h"
+
+#define MEMLIST_ENTRY_SIZE 20 // on-disk size, see mementry_t in src/res.h
+
+static inline void write32be(u8 *p, const u32 x) {
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+FILE *data_fopen(const char *datadir, const char *name, const char *mode) {
+  char path[1024];
+  char fname[256];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/%s", datadir, name);
+  if ((f = fopen(path, mode))) return f;
+
+  strncpy(fname, name, sizeof(fname) - 1);
+  fname[sizeof(fname) - 1] = 0;
+  for (char *p = fname; *p; ++p) *p = tolower(*p);
+  snprintf(path, sizeof(path), "%s/%s", datadir, fname);
+  if ((f = fopen(path, mode))) return f;
+
+  for (char *p = fname; *p; ++p) *p = toupper(*p);
+  snprintf(path, sizeof(path), "%s/%s", datadir, fname);
+  return fopen(path, mode);
+}
+
+int memlist_load(const char *datadir, memlist_entry_t *out, const int max) {
+  FILE *f = data_fopen(datadir, "memlist.bin", "rb");
+  if (!f) {
+    fprintf(stderr, "memlist_load(%s): could not open memlist.bin\n", datadir);
+    return -1;
+  }
+
+  u8 buf[MEMLIST_ENTRY_SIZE];
+  int num = 0;
+  while (fread(buf, sizeof(buf), 1, f) == 1) {
+    // terminating entry
+    if (buf[0] == 0xFF) break;
+    if (num >= max) {
+      fprintf(stderr, "memlist_load(%s): too many entries\n", datadir);
+      fclose(f);
+      return -1;
+    }
+    memlist_entry_t *me = out + num++;
+    me->status = buf[0];
+    me->type = buf[1];
+    me->rank = buf[6];
+    me->bank = buf[7];
+    me->bank_pos = read32be(buf + 8);
+    me->packed_size = read32be(buf + 12);
+    me->unpacked_size = read32be(buf + 16);
+  }
+
+  fclose(f);
+  return num;
+}
+
+int memlist_save(const char *path, const memlist_entry_t *in, const int num) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "memlist_save(%s): could not open for writing\n", path);
+    return -1;
+  }
+
+  u8 buf[MEMLIST_ENTRY_SIZE];
+  for (int i = 0; i < num; ++i) {
+    const memlist_entry_t *me = in + i;
+    memset(buf, 0, sizeof(buf));
+    buf[0] = me->status;
+    buf[1] = me->type;
+    buf[6] = me->rank;
+    buf[7] = me->bank;
+    write32be(buf + 8, me->bank_pos);
+    write32be(buf + 12, me->packed_size);
+    write32be(buf + 16, me->unpacked_size);
+    fwrite(buf, sizeof(buf), 1, f);
+  }
+
+  // terminating entry
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 0xFF;
+  fwrite(buf, sizeof(buf), 1, f);
+
+  fclose(f);
+  return num;
+}
+
+int memlist_hash(const char *datadir, u32 *hash) {
+  FILE *f = data_fopen(datadir, "memlist.bin", "rb");
+  if (!f) {
+    fprintf(stderr, "memlist_hash(%s): could not open memlist.bin\n", datadir);
+    return -1;
+  }
+
+  // same as what res_init() reads: whole entries up to and including the terminator
+  u8 buf[MEMLIST_ENTRY_SIZE];
+  u32 h = FNV1A_INIT;
+  while (fread(buf, sizeof(buf), 1, f) == 1) {
+    h = hash_fnv1a_update(h, buf, sizeof(buf));
+    if (buf[0] == 0xFF) break;
+  }
+
+  fclose(f);
+  *hash = h;
+  return 0;
+}
+
+u8 *memlist_read_packed(const char *datadir, const memlist_entry_t *me) {
+  if (me->bank == 0) return NULL;
+
+  char fname[16];
+  snprintf(fname, sizeof(fname), "bank%02x", (int)me->bank);
+  FILE *f = data_fopen(datadir, fname, "rb");
+  if (!f) return NULL;
+
+  // unpacked size is never smaller, so this can be unpacked in place
+  const u32 bufsize = (me->unpacked_size > me->packed_size) ? me->unpacked_size : me->packed_size;
+  u8 *buf = calloc(1, bufsize ? bufsize : 1);
+  if (!buf) {
+    fclose(f);
+    return NULL;
+  }
+
+  if (fseek(f, me->bank_pos, SEEK_SET) != 0 || fread(buf, 1, me->packed_size, f) != me->packed_size) {
+    fclose(f);
+    free(buf);
+    return NULL;
+  }
+
+  fclose(f);
+  return buf;
+}
+
+u8 *memlist_read_unpacked(const char *datadir, const memlist_entry_t *me) {
+  u8 *buf = memlist_read_packed(datadir, me);
+  if (buf && me->packed_size != me->unpacked_size) {
+    if (!bytekiller_unpack(buf, me->unpacked_size, buf, me->packed_size)) {
+      fprintf(stderr, "memlist_read_unpacked(): bank %02x ofs %u: bad crc\n", (int)me->bank, me->bank_pos);
+      free(buf);
+      return NULL;
+    }
+  }
+  return buf;
+}
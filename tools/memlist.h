@@ -0,0 +1,31 @@
+#pragma once
+
+// host-side access to the original data files, shared by the tools in here
+
+#include <stdio.h>
+#include "types.h"
+
+#define MEMLIST_MAX_ENTRIES 256
+
+typedef struct {
+  u8 status;
+  u8 type;
+  u8 rank;
+  u8 bank;
+  u32 bank_pos;
+  u32 packed_size;
+  u32 unpacked_size;
+} memlist_entry_t;
+
+// opens `name` in `datadir`, trying the name as is, then lowercase, then uppercase
+FILE *data_fopen(const char *datadir, const char *name, const char *mode);
+// returns number of entries read, not counting the terminator, or -1 on error
+int memlist_load(const char *datadir, memlist_entry_t *out, const int max);
+// writes entries in the original format, returns number of entries written or -1 on error
+int memlist_save(const char *path, const memlist_entry_t *in, const int num);
+// hashes the memlist the way the pack header stores it (see src/pack.h), returns 0 or -1 on error
+int memlist_hash(const char *datadir, u32 *hash);
+// reads the packed data of the entry as is, returns malloc'd buffer or NULL if missing
+u8 *memlist_read_packed(const char *datadir, const memlist_entry_t *me);
+// reads and unpacks the entry, returns malloc'd buffer of unpacked_size bytes or NULL
+u8 *memlist_read_unpacked(const char *datadir, const memlist_entry_t *me);
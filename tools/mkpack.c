@@ -0,0 +1,209 @@
+// builds the load-ready data pack (see src/pack.h) out of MEMLIST.BIN and BANKxx
+// everything the engine would otherwise do on every load happens here instead:
+// unpacking, palette conversion, planar to chunky conversion and ADPCM encoding
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "util.h"
+#include "adpcm.h"
+#include "pack.h"
+#include "memlist.h"
+
+// these have to match what the engine does at runtime
+#define RT_SOUND   0
+#define RT_BITMAP  2
+#define RT_PALETTE 3
+
+#define PAGE_W 320
+#define PAGE_H 200
+#define BITMAP_PLANE_SIZE (PAGE_W * PAGE_H / 8)
+#define PCM_DATA_OFFSET 8
+#define ADPCM_MAX_SIZE (64 * 1024)
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static pack_entry_t index_tab[MEMLIST_MAX_ENTRIES];
+
+static void write_u16le(u8 *p, const u16 x) {
+  p[0] = x; p[1] = x >> 8;
+}
+
+static void write_u32le(u8 *p, const u32 x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// see gfx_load_palette()
+static u8 *convert_palette(const u8 *data, const u32 size, u32 *outsize) {
+  u8 *out = malloc(size);
+  for (u32 i = 0; i + 1 < size; i += 2) {
+    u16 c = read16be(data + i); // BGR444
+    c = ((c & 0xF) << 11) | (((c >> 4) & 0xF) << 6) | (((c >> 8) & 0xF) << 1);
+    write_u16le(out + i, c ? c : 0x8000);
+  }
+  *outsize = size & ~1;
+  return out;
+}
+
+// see gfx_blit_bitmap()
+static u8 *convert_bitmap(const u8 *data, const u32 size, u32 *outsize) {
+  if (size < BITMAP_PLANE_SIZE * 4) {
+    fprintf(stderr, "convert_bitmap(): bitmap too small (%u)\n", size);
+    return NULL;
+  }
+  u8 *out = malloc(PAGE_W * PAGE_H);
+  u8 *dst = out;
+  const u8 *src = data;
+  for (int y = 0; y < PAGE_H; ++y) {
+    for (int x = 0; x < PAGE_W; x += 8) {
+      for (int b = 0; b < 8; ++b) {
+        const int mask = 1 << (7 - b);
+        u8 c = 0;
+        if (src[0 * BITMAP_PLANE_SIZE] & mask) c |= 1 << 0;
+        if (src[1 * BITMAP_PLANE_SIZE] & mask) c |= 1 << 1;
+        if (src[2 * BITMAP_PLANE_SIZE] & mask) c |= 1 << 2;
+        if (src[3 * BITMAP_PLANE_SIZE] & mask) c |= 1 << 3;
+        *dst++ = c;
+      }
+      ++src;
+    }
+  }
+  *outsize = PAGE_W * PAGE_H;
+  return out;
+}
+
+// see snd_cache_sound() with SND_TYPE_PCM_WITH_HEADER
+static u8 *convert_sound(const u8 *data, const u32 size, u32 *outsize) {
+  if (size == 0) {
+    // NULL sound
+    *outsize = 0;
+    return malloc(1);
+  }
+  int loopstart = -1;
+  int loopend = -1;
+  const s32 lstart = read16be(data) << 1;
+  const s32 lsize = read16be(data + 2) << 1;
+  if (lsize) {
+    loopstart = lstart;
+    loopend = lstart + lsize;
+  }
+  const int pcmsize = (u16)(lstart + lsize); // engine passes this around as u16
+  u8 *out = calloc(1, ADPCM_MAX_SIZE);
+  const int adpcm_size = adpcm_pack_mono_s8(out, ADPCM_MAX_SIZE, (const s8 *)data + PCM_DATA_OFFSET, pcmsize, loopstart, loopend);
+  if (adpcm_size < 0) {
+    free(out);
+    return NULL;
+  }
+  *outsize = ALIGN(adpcm_size, 64);
+  return out;
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <datadir> <outfile>\n", argv[0]);
+    return 1;
+  }
+
+  const char *datadir = argv[1];
+  const int num = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+  if (num <= 0) return 1;
+
+  u32 ml_hash;
+  if (memlist_hash(datadir, &ml_hash) < 0) return 1;
+
+  FILE *fout = fopen(argv[2], "wb");
+  if (!fout) {
+    fprintf(stderr, "could not open %s for writing\n", argv[2]);
+    return 1;
+  }
+
+  // data starts right after the header and index
+  u32 ofs = ALIGN(sizeof(pack_header_t) + num * sizeof(pack_entry_t), PACK_SECSIZE);
+  u32 total_in = 0;
+  u32 total_out = 0;
+  int num_missing = 0;
+
+  static const u8 zero[PACK_SECSIZE];
+  fseek(fout, ofs, SEEK_SET);
+
+  for (int i = 0; i < num; ++i) {
+    const memlist_entry_t *me = memlist + i;
+    pack_entry_t *pe = index_tab + i;
+    memset(pe, 0, sizeof(*pe));
+
+    u8 *data = memlist_read_unpacked(datadir, me);
+    if (!data) {
+      // missing resource, the engine treats it the same as a missing bank
+      pe->format = PF_NONE;
+      ++num_missing;
+      continue;
+    }
+
+    u8 *out = NULL;
+    u32 outsize = 0;
+    switch (me->type) {
+      case RT_SOUND:
+        out = convert_sound(data, me->unpacked_size, &outsize);
+        pe->format = PF_ADPCM;
+        break;
+      case RT_BITMAP:
+        out = convert_bitmap(data, me->unpacked_size, &outsize);
+        pe->format = PF_BITMAP;
+        break;
+      case RT_PALETTE:
+        out = convert_palette(data, me->unpacked_size, &outsize);
+        pe->format = PF_PALETTE;
+        break;
+      default:
+        out = data;
+        outsize = me->unpacked_size;
+        data = NULL;
+        pe->format = PF_RAW;
+        break;
+    }
+    free(data);
+
+    if (!out) {
+      fprintf(stderr, "could not convert resource %d (type %d)\n", i, (int)me->type);
+      fclose(fout);
+      return 1;
+    }
+
+    pe->offset = ofs;
+    pe->size = outsize;
+    fwrite(out, 1, outsize, fout);
+    free(out);
+
+    // pad to next sector
+    const u32 padded = ALIGN(outsize, PACK_SECSIZE);
+    fwrite(zero, 1, padded - outsize, fout);
+    ofs += padded;
+
+    total_in += me->packed_size;
+    total_out += outsize;
+  }
+
+  // now that we know where everything is, write header and index
+  u8 buf[sizeof(pack_entry_t)];
+  fseek(fout, 0, SEEK_SET);
+  write_u32le(buf + 0, PACK_MAGIC);
+  write_u16le(buf + 4, PACK_VERSION);
+  write_u16le(buf + 6, num);
+  write_u32le(buf + 8, ml_hash);
+  fwrite(buf, 1, sizeof(pack_header_t), fout);
+  for (int i = 0; i < num; ++i) {
+    memset(buf, 0, sizeof(buf));
+    write_u32le(buf + 0, index_tab[i].offset);
+    write_u32le(buf + 4, index_tab[i].size);
+    buf[8] = index_tab[i].format;
+    fwrite(buf, 1, sizeof(buf), fout);
+  }
+
+  fclose(fout);
+
+  printf("mkpack: %d entries (%d missing), %u bytes packed -> %u bytes converted, pack size %u\n",
+    num, num_missing, total_in, total_out, ofs);
+
+  return 0;
+}
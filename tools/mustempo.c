@@ -0,0 +1,218 @@
+// checks how well the music player keeps tempo: for every module in the data and every delay
+// the scripts start it with, compares the period the original player used (delay * 60 / 7050 ms)
+// to what RCnt1 actually gets programmed with, for all four video mode / BIOS region combinations,
+// and reports how far off the music is by the end of the module
+// "old" is the ms -> BPM -> hblanks conversion the player used to do, "new" is the
+// fractional scheduler in src/music.c
+// with -d it just does that for the given delay values and a track of -n ticks instead
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "util.h"
+#include "music.h"
+#include "memlist.h"
+
+#define MAX_USES 256
+#define PAT_ROWS 64
+#define RT_MUSIC 1
+#define RT_BYTECODE 4
+#define OP_PLAY_MUSIC 0x1A
+
+typedef struct {
+  u16 res;    // module, 0 if unknown
+  u16 delay;  // 0 means the one in the module header
+  u16 script; // bytecode resource it came from
+  u8 set_only; // changes the tempo of whatever is playing
+} music_use_t;
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static int num_memlist;
+
+static music_use_t uses[MAX_USES];
+static int num_uses;
+
+static const char *mode_names[4] = { "ntsc", "ntsc (pal bios)", "pal (ntsc bios)", "pal" };
+
+// operand bytes of opcodes 0x00-0x1A, -1 for the one that depends on the operands
+static const s8 op_len[0x1B] = {
+  3, 2, 2, 3, 2, 0, 0, 2, 3, 3, -1, 2, 3, 1, 2, 2, 1, 0, 5, 2, 3, 3, 3, 3, 5, 2, 5
+};
+
+static void add_use(const u16 res, const u16 delay, const u16 script, const u8 set_only) {
+  for (int i = 0; i < num_uses; ++i) {
+    if (uses[i].res == res && uses[i].delay == delay && uses[i].set_only == set_only)
+      return;
+  }
+  if (num_uses < MAX_USES)
+    uses[num_uses++] = (music_use_t){ res, delay, script, set_only };
+}
+
+// goes through the script linearly and picks out every op_play_music, see vm_run_task()
+static void scan_script(const u16 script, const u8 *code, const u32 size) {
+  u32 pc = 0;
+  while (pc < size) {
+    const u8 op = code[pc++];
+    u32 len;
+    if (op & 0x80) {
+      len = 3;
+    } else if (op & 0x40) {
+      len = 2;
+      len += ((op & 0x30) == 0) ? 2 : 1;
+      len += ((op & 0x0C) == 0) ? 2 : 1;
+      len += ((op & 3) == 1 || (op & 3) == 2) ? 1 : 0;
+    } else if (op == 0x0A) {
+      if (pc >= size) break;
+      len = 5 + (((code[pc] & 0xC0) == 0x40) ? 1 : 0);
+    } else if (op < sizeof(op_len)) {
+      len = op_len[op];
+    } else {
+      fprintf(stderr, "script %03x: invalid opcode %02x at %04x, skipping the rest\n", script, op, pc - 1);
+      break;
+    }
+    if (pc + len > size) break;
+    if (op == OP_PLAY_MUSIC) {
+      const u16 res = read16be(code + pc);
+      const u16 delay = read16be(code + pc + 2);
+      if (res)
+        add_use(res, delay, script, 0);
+      else if (delay)
+        add_use(0, delay, script, 1);
+    }
+    pc += len;
+  }
+}
+
+static u32 old_period(const u32 base_clock, const u32 delay) {
+  // what mus_get_delay_ticks() used to do
+  const u32 ms = delay * 60 / 7050;
+  if (ms == 0) return 0;
+  const u32 bpm = 60000 / ms;
+  return base_clock * 60 / bpm;
+}
+
+// total RCnt1 ticks the fractional scheduler counts for the given number of music ticks
+static unsigned long long new_total(const u32 base_clock, const u32 delay, const u32 nticks) {
+  const u32 fx = mus_delay_to_period_fx(base_clock, delay);
+  unsigned long long total = 0;
+  u32 acc = 0;
+  for (u32 i = 0; i < nticks; ++i) {
+    acc += fx;
+    total += acc >> 16;
+    acc &= 0xFFFF;
+  }
+  return total;
+}
+
+static void report(const char *name, const u32 delay, const u32 nticks) {
+  const double want_us = delay * 60.0 * 1000.0 / 7050.0;
+  printf("%s, delay %u (%u ticks, %.3f ms per tick, %.1f s):\n", name, delay, nticks, want_us / 1000.0, want_us * nticks / 1e6);
+  for (int m = 0; m < 4; ++m) {
+    const u32 clk = mus_base_clock_for_mode(m >> 1, m & 1);
+    const u32 old = old_period(clk, delay);
+    const double new_us = new_total(clk, delay, nticks) * 1e6 / clk;
+    if (old) {
+      const double old_us = (double)old * 1e6 / clk;
+      printf("  %-16s old %5u hblanks, drift %+9.2f ms (%+.3f%%)   new drift %+7.3f ms\n", mode_names[m], old,
+        (old_us - want_us) * nticks / 1000.0, (old_us - want_us) * 100.0 / want_us, (new_us - want_us * nticks) / 1000.0);
+    } else {
+      printf("  %-16s old: divides by zero   new drift %+7.3f ms\n", mode_names[m], (new_us - want_us * nticks) / 1000.0);
+    }
+  }
+}
+
+static int load_data(const char *datadir) {
+  num_memlist = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+  if (num_memlist <= 0) return 0;
+  for (int i = 0; i < num_memlist; ++i) {
+    if (memlist[i].type != RT_BYTECODE || memlist[i].bank == 0) continue;
+    u8 *code = memlist_read_unpacked(datadir, memlist + i);
+    if (!code) {
+      fprintf(stderr, "script %03x: could not read it\n", i);
+      continue;
+    }
+    scan_script(i, code, memlist[i].unpacked_size);
+    free(code);
+  }
+  return 1;
+}
+
+static void report_module(const char *datadir, const int res) {
+  const memlist_entry_t *me = memlist + res;
+  u8 *mod = memlist_read_unpacked(datadir, me);
+  if (!mod || me->unpacked_size < 0xC0) {
+    fprintf(stderr, "module %03x: could not read it\n", res);
+    free(mod);
+    return;
+  }
+  const u16 hdr_delay = read16be(mod);
+  const u16 num_order = read16be(mod + 0x3E);
+  free(mod);
+
+  char name[64];
+  int found = 0;
+  for (int i = 0; i < num_uses; ++i) {
+    if (uses[i].set_only || uses[i].res != res) continue;
+    const u16 delay = uses[i].delay ? uses[i].delay : hdr_delay;
+    snprintf(name, sizeof(name), "module %03x from script %03x", res, uses[i].script);
+    report(name, delay, num_order * PAT_ROWS);
+    // tempo changes in the same script most likely apply to this module
+    int seen = 0;
+    for (int k = 0; k < i; ++k)
+      seen |= !uses[k].set_only && uses[k].res == res && uses[k].script == uses[i].script;
+    for (int j = 0; j < num_uses && !seen; ++j) {
+      if (uses[j].set_only && uses[j].script == uses[i].script) {
+        snprintf(name, sizeof(name), "module %03x after a tempo change", res);
+        report(name, uses[j].delay, num_order * PAT_ROWS);
+      }
+    }
+    found = 1;
+  }
+  if (!found) {
+    snprintf(name, sizeof(name), "module %03x (not started by any script)", res);
+    report(name, hdr_delay, num_order * PAT_ROWS);
+  }
+}
+
+int main(int argc, const char **argv) {
+  u32 nticks = 64 * 32;
+  int argi = 1;
+  int delays = 0;
+  while (argi < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-n") && argi + 1 < argc) {
+      nticks = strtoul(argv[argi + 1], NULL, 0);
+      argi += 2;
+    } else if (!strcmp(argv[argi], "-d")) {
+      delays = 1;
+      ++argi;
+    } else {
+      break;
+    }
+  }
+
+  if (argi >= argc) {
+    fprintf(stderr, "usage: %s <datadir>\n       %s [-n <ticks>] -d <delay> [<delay> ...]\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  if (delays) {
+    for (; argi < argc; ++argi)
+      report("given", strtoul(argv[argi], NULL, 0), nticks);
+    return 0;
+  }
+
+  const char *datadir = argv[argi];
+  if (!load_data(datadir)) {
+    fprintf(stderr, "could not read the memlist from %s\n", datadir);
+    return 1;
+  }
+
+  for (int i = 0; i < num_memlist; ++i) {
+    if (memlist[i].type == RT_MUSIC && memlist[i].bank != 0)
+      report_module(datadir, i);
+  }
+
+  return 0;
+}
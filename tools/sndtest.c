@@ -0,0 +1,1091 @@
+// runs src/snd.c on the host against a fake SPU and checks its bookkeeping as it goes:
+// - the SPU RAM free list stays sorted and coalesced, and used plus free is always all of it
+// - sounds only become ready once their upload has landed, and only ready ones get keyed on
+// - key ons go out in one KON write per music tick or frame, and from nowhere else
+// - no voice is on two sound channels at once, and sound effects never get music voices 0-3
+// - voices get retired when their one-shot hits ENDX or their release is over, and not before,
+//   and fades can be cancelled
+// the fake SPU walks the ADPCM blocks that were actually uploaded, so ENDX, loops and releases
+// happen when they would on hardware; time moves on with every register access, so uploads finish
+// while snd.c is waiting on them and the music IRQ can land in the middle of any snd.c call
+// first runs a few fixed cases, then random parts, sound effects and music for a while
+// usage: sndtest [-s <seed>] [-n <frames>]
+// returns non-zero if anything is off
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "types.h"
+
+typedef unsigned long long u64;
+
+/* the fake hardware snd.c gets built against */
+
+#define IO_BASE 0x1F801000
+#define IO_SIZE 0x1000
+
+static u8 hw_io[IO_SIZE] __attribute__((aligned(4)));
+static u8 *hw_io_access(void);
+
+#define SNDTEST
+#define IO_ADDR(addr) (hw_io_access() + ((addr) - IO_BASE))
+#define SPU_TRANSFER_BY_DMA 0
+#define SPU_VOICECH(x) (1 << (x))
+void SpuInit(void);
+void SpuSetTransferMode(int mode);
+void SpuWrite(void *data, int size);
+
+#include "snd.c"
+
+// the same registers, for the fake SPU's side, without going through hw_io_access()
+#define HW16(addr) (*(volatile u16 *)(hw_io + ((addr) - IO_BASE)))
+#define HW32(addr) (*(volatile u32 *)(hw_io + ((addr) - IO_BASE)))
+#define HWV(v, reg) HW16(0x1F801C00 + (v) * 16 + (reg))
+#define HW_KON_LO   0x1F801D88
+#define HW_KON_HI   0x1F801D8A
+#define HW_KOFF_LO  0x1F801D8C
+#define HW_KOFF_HI  0x1F801D8E
+#define HW_ENDX_LO  0x1F801D9C
+#define HW_ENDX_HI  0x1F801D9E
+#define HW_STATUS   0x1F801DAE
+#define HW_SPU_CHCR 0x1F8010C8
+#define HW_IRQ_MASK 0x1F801074
+#define VREG_VOL    0
+#define VREG_PITCH  4
+#define VREG_ADDR   6
+#define VREG_SR     10
+#define VREG_ENV    12
+
+#define HW_ACCESS_NS  100       // how long a register access takes
+#define HW_SAMPLE_NS  22676     // 44.1 kHz
+#define HW_DMA_BYTE_NS 500      // ~2 MB/s, so the big sounds take a frame or so
+#define FRAME_NS      16683333
+#define MUS_TICK_NS   20000000  // music IRQ period, about what the modules use
+
+#define ADPCM_BLOCK_SAMPLES 28
+#define ENV_MAX 0x7FFF
+
+#define MAX_FAILS 20
+
+static int num_fails = 0;
+static u32 frame_num = 0;
+
+static void fail(const char *fmt, ...) {
+  va_list args;
+  printf("frame %u: ", frame_num);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+  if (++num_fails >= MAX_FAILS) {
+    printf("too many problems, giving up\n");
+    exit(1);
+  }
+}
+
+void panic(const char *fmt, ...) {
+  va_list args;
+  printf("frame %u: panic: ", frame_num);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+  exit(1);
+}
+
+void do_assert(const int expr, const char *strexpr, const char *file, const int line) {
+  if (!expr) panic("ASSERTION FAILED:\n`%s` at %s:%d", strexpr, file, line);
+}
+
+typedef struct {
+  int on;         // running, keyed on at some point
+  int kon_latch;  // keyed on, starts on the next sample
+  int koff_latch; // ... and keyed off again before that
+  int releasing;  // keyed off
+  int silent;     // stuck in the end block of a one-shot
+  int reported;   // already complained about what it's playing since it was keyed on
+  u32 start;      // address it was keyed on with
+  u32 addr;       // current block
+  u32 repeat;
+  u32 frac;       // position in the current block, in 1/4096 samples
+  s32 env;
+  u32 done_frames; // frames it's been finished for while still in snd_key_mask
+  const sound_t *snd; // what it was keyed on with, and what that was back then
+  u16 resid;
+  s32 spuaddr;
+} hw_voice_t;
+
+static struct {
+  int busy;
+  u32 addr;
+  u32 size;
+  const u8 *src;
+  u8 copy[SND_CVTBUF_SIZE + 0x10000]; // what src had when the transfer started
+  u64 end;
+} hw_dma;
+
+static u8 hw_ram[SPU_MEM_MAX];
+static hw_voice_t hw_voices[SPU_NUM_VOICES];
+static u32 hw_endx = 0;
+static u32 hw_xfer_addr = 0;
+static u64 hw_time = 0;
+static u64 hw_next_sample = HW_SAMPLE_NS;
+static u32 hw_kon_lo = 0; // KON writes since the start of the current call or tick
+static u32 hw_kon_hi = 0;
+
+// the music IRQ, fired by the timer when it's on, or at a random register access to see
+// what happens when it lands in the middle of something; held off while it's masked
+static int mus_on = 0;
+static int hw_in_irq = 0;
+static int hw_irq_pending = 0;
+static u32 hw_preempt = 0;  // register accesses until the IRQ fires, 0 if not armed
+static u64 hw_irq_next = 0;
+static u8 mus_inst[4];      // handles the music plays
+static u32 mus_num_inst = 0;
+static u32 mus_plays = 0;   // plays on voices 0-3 that came from the music
+static u32 num_ticks = 0;
+static u32 num_preempts = 0;
+
+static void mus_tick(void);
+
+static void hw_set_endx(void) {
+  HW16(HW_ENDX_LO) = hw_endx;
+  HW16(HW_ENDX_HI) = hw_endx >> 16;
+}
+
+static int sound_landed(const sound_t *snd);
+
+static void hw_key_on(const u32 v) {
+  hw_voice_t *hv = hw_voices + v;
+  const u32 addr = (u32)HWV(v, VREG_ADDR) << 3;
+  const sound_t *snd = NULL;
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    if (snd_cache[i].resid != SND_NO_RES && snd_cache[i].size && snd_cache[i].spuaddr == (s32)addr)
+      snd = snd_cache + i;
+  }
+  if (!snd)
+    fail("voice %u keyed on at %05x, which isn't where any sound is", v, addr);
+  else if (!snd->ready)
+    fail("voice %u keyed on sound %04x before its upload was done", v, snd->resid);
+  else if (!sound_landed(snd))
+    fail("voice %u keyed on sound %04x, but its data isn't in SPU RAM", v, snd->resid);
+  hv->kon_latch = 1;
+  hv->koff_latch = 0;
+  hv->start = addr;
+  hv->snd = snd;
+  hv->resid = snd ? snd->resid : SND_NO_RES;
+  hv->spuaddr = addr;
+}
+
+static void hw_key_off(const u32 v) {
+  if (hw_voices[v].kon_latch)
+    hw_voices[v].koff_latch = 1;
+  else
+    hw_voices[v].releasing = 1;
+}
+
+// picks up what snd.c wrote to the key registers since the last access
+static void hw_process(void) {
+  u32 koff = 0, kon = 0;
+  if (HW16(HW_KOFF_LO)) { koff |= HW16(HW_KOFF_LO); HW16(HW_KOFF_LO) = 0; }
+  if (HW16(HW_KOFF_HI)) { koff |= (u32)HW16(HW_KOFF_HI) << 16; HW16(HW_KOFF_HI) = 0; }
+  if (HW16(HW_KON_LO)) { kon |= HW16(HW_KON_LO); HW16(HW_KON_LO) = 0; ++hw_kon_lo; }
+  if (HW16(HW_KON_HI)) { kon |= (u32)HW16(HW_KON_HI) << 16; HW16(HW_KON_HI) = 0; ++hw_kon_hi; }
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    if (koff & SPU_VOICECH(v)) hw_key_off(v);
+    if (kon & SPU_VOICECH(v)) hw_key_on(v);
+  }
+}
+
+// the block the voice just got to; complains if it's audible and that isn't its sound anymore
+static void hw_enter_block(const u32 v) {
+  hw_voice_t *hv = hw_voices + v;
+  if (hv->addr + 16 > SPU_MEM_MAX) {
+    // a silent voice can wander off over whatever got uploaded where its sound was, which is
+    // fine; the SPU just wraps around
+    if (!hv->reported && hv->env > 0 && (s16)HWV(v, VREG_VOL) != 0) {
+      fail("voice %u ran off the end of SPU RAM", v);
+      hv->reported = 1;
+    }
+    hv->addr = 0;
+  }
+  if (hw_ram[hv->addr + 1] & ADPCM_FLAG_START)
+    hv->repeat = hv->addr;
+  if (hv->reported || !hv->snd || hv->env == 0 || (s16)HWV(v, VREG_VOL) == 0)
+    return;
+  const sound_t *snd = hv->snd;
+  if (snd->resid != hv->resid || snd->spuaddr != hv->spuaddr) {
+    fail("voice %u can still be heard, but sound %04x it was playing has been evicted", v, hv->resid);
+    hv->reported = 1;
+  } else if (hv->addr < (u32)snd->spuaddr || hv->addr >= (u32)(snd->spuaddr + snd->alloc_size)) {
+    fail("voice %u is playing %05x, outside of sound %04x", v, hv->addr, hv->resid);
+    hv->reported = 1;
+  }
+}
+
+static void hw_voice_sample(const u32 v) {
+  hw_voice_t *hv = hw_voices + v;
+  if (hv->kon_latch) {
+    // this is the first sample after the key on, the old ENDX goes away only now
+    hv->kon_latch = 0;
+    hv->on = 1;
+    hv->releasing = hv->koff_latch;
+    hv->silent = 0;
+    hv->reported = 0;
+    hv->addr = hv->repeat = hv->start;
+    hv->frac = 0;
+    hv->env = ENV_MAX;
+    hw_endx &= ~SPU_VOICECH(v);
+    hw_enter_block(v);
+  }
+  if (!hv->on)
+    return;
+
+  if (hv->releasing && hv->env > 0) {
+    // linear release, 2 << rate samples from the top
+    const u32 rate = HWV(v, VREG_SR) & 0x1F;
+    const s32 step = (ENV_MAX + (2 << rate) - 1) / (2 << rate);
+    hv->env = (hv->env > step) ? hv->env - step : 0;
+  }
+
+  u32 pitch = HWV(v, VREG_PITCH);
+  if (pitch > 0x3FFF) pitch = 0x3FFF;
+  hv->frac += pitch;
+  while (hv->on && hv->frac >= (ADPCM_BLOCK_SAMPLES << 12)) {
+    hv->frac -= ADPCM_BLOCK_SAMPLES << 12;
+    const u8 flags = hw_ram[hv->addr + 1];
+    if (flags & ADPCM_FLAG_END) {
+      hw_endx |= SPU_VOICECH(v);
+      if (!(flags & ADPCM_FLAG_REPEAT)) {
+        // no repeat means mute
+        hv->env = 0;
+        hv->releasing = 1;
+      } else if (hv->repeat == hv->addr) {
+        hv->silent = 1;
+      }
+      hv->addr = hv->repeat;
+    } else {
+      hv->addr += 16;
+    }
+    hw_enter_block(v);
+  }
+  HWV(v, VREG_ENV) = hv->env;
+}
+
+static void hw_dma_finish(void) {
+  if (memcmp(hw_dma.src, hw_dma.copy, hw_dma.size))
+    fail("the data for the upload to %05x changed while it was running", hw_dma.addr);
+  memcpy(hw_ram + hw_dma.addr, hw_dma.src, hw_dma.size);
+  hw_dma.busy = 0;
+  HW32(HW_SPU_CHCR) &= ~DMA_CHCR_BUSY;
+  HW16(HW_STATUS) &= ~SPU_STATUS_XFER_BUSY;
+}
+
+static void hw_try_irq(void) {
+  if (!hw_irq_pending || hw_in_irq || !(HW32(HW_IRQ_MASK) & IRQ_RCNT1))
+    return;
+  hw_irq_pending = 0;
+  if (!mus_on)
+    return;
+  // whatever the main thread wrote so far is its own
+  hw_process();
+  const u32 kon_lo = hw_kon_lo, kon_hi = hw_kon_hi;
+  hw_kon_lo = hw_kon_hi = 0;
+  hw_in_irq = 1;
+  mus_tick();
+  hw_process();
+  hw_in_irq = 0;
+  if (hw_kon_lo > 1 || hw_kon_hi > 1)
+    fail("music tick wrote KON %u+%u times", hw_kon_lo, hw_kon_hi);
+  hw_kon_lo = kon_lo;
+  hw_kon_hi = kon_hi;
+}
+
+static void hw_advance(const u64 ns) {
+  const u64 end = hw_time + ns;
+  while (1) {
+    u64 next = hw_next_sample;
+    if (hw_dma.busy && hw_dma.end < next) next = hw_dma.end;
+    if (mus_on && hw_irq_next < next) next = hw_irq_next;
+    if (next > end) break;
+    if (next > hw_time) hw_time = next;
+    if (hw_dma.busy && hw_dma.end <= hw_time)
+      hw_dma_finish();
+    if (hw_next_sample <= hw_time) {
+      for (u32 v = 0; v < SPU_NUM_VOICES; ++v)
+        hw_voice_sample(v);
+      hw_set_endx();
+      hw_next_sample += HW_SAMPLE_NS;
+    }
+    if (mus_on && hw_irq_next <= hw_time) {
+      hw_irq_next += MUS_TICK_NS;
+      hw_irq_pending = 1;
+      hw_try_irq();
+    }
+  }
+  // an IRQ in there might have moved time on past the end already
+  if (hw_time < end)
+    hw_time = end;
+}
+
+static u8 *hw_io_access(void) {
+  hw_process();
+  hw_advance(HW_ACCESS_NS);
+  if (hw_preempt && !--hw_preempt) {
+    hw_irq_pending = 1;
+    if (!hw_in_irq) ++num_preempts;
+  }
+  hw_try_irq();
+  return hw_io;
+}
+
+u32 spu_set_transfer_addr(const u32 addr) {
+  hw_xfer_addr = addr;
+  return addr;
+}
+
+void SpuInit(void) {
+  memset(hw_io + 0xC00, 0, 0x200);
+  memset(hw_voices, 0, sizeof(hw_voices));
+  hw_endx = 0;
+  hw_set_endx();
+}
+
+void SpuSetTransferMode(int mode) {
+  (void)mode;
+}
+
+void SpuWrite(void *data, int size) {
+  if (hw_dma.busy)
+    fail("SpuWrite() while the last transfer is still running");
+  // has to be for the sound at the head of the upload queue, into its own block
+  const sound_t *snd = snd_upq[snd_upq_head].snd;
+  if (!snd_upq_num || snd->spuaddr != (s32)hw_xfer_addr || snd->size != size)
+    fail("upload of %d bytes to %05x isn't for the sound at the head of the queue", size, hw_xfer_addr);
+  if (hw_xfer_addr < SPU_MEM_START || hw_xfer_addr + size > SPU_MEM_MAX || size > (int)sizeof(hw_dma.copy)) {
+    fail("upload of %d bytes to %05x is out of bounds", size, hw_xfer_addr);
+    return;
+  }
+  hw_dma.busy = 1;
+  hw_dma.addr = hw_xfer_addr;
+  hw_dma.size = size;
+  hw_dma.src = data;
+  memcpy(hw_dma.copy, data, size);
+  hw_dma.end = hw_time + (u64)size * HW_DMA_BYTE_NS;
+  HW32(HW_SPU_CHCR) |= DMA_CHCR_BUSY;
+  HW16(HW_STATUS) |= SPU_STATUS_XFER_BUSY;
+}
+
+/* test sounds */
+
+#define NUM_RES 200 // for the random part, the fixed cases have a few of their own after these
+#define NUM_CASE_RES 5
+#define MAX_LOADED 64
+// sounds never move once they're in, and the ones a part keeps stay wherever the last one put
+// them, so a part that needs most of SPU RAM can run out to fragmentation; keep them to half
+#define MAX_ATTACHED_SIZE ((SPU_MEM_MAX - SPU_MEM_START) / 2)
+#define MAX_PCM_SIZE (0xFFFF - PCM_DATA_OFFSET) // the size has to fit in a u16 with the header
+
+typedef struct {
+  int type;
+  u8 *data;     // what gets passed to snd_cache_sound()
+  u16 size;
+  u8 *adpcm;    // what should end up in SPU RAM
+  s32 adpcm_size;
+  s32 alloc_size;
+  int loops;
+} res_t;
+
+typedef struct {
+  u16 resid;
+  u8 handle;
+  u8 *buf;      // this load's copy of the resource, scribbled over once it's dropped
+} loaded_t;
+
+static res_t res[NUM_RES + NUM_CASE_RES];
+static loaded_t loaded[MAX_LOADED];
+static int num_loaded = 0;
+static u8 prev_ready[MAX_SOUNDS];
+
+// one-shots and loops, in both the formats the engine loads: PCM with the original header, and
+// ADPCM out of the pack; the odd empty one, and every so often one that's nearly as big as they get
+static void make_res(const u16 resid, int len, int loops, const int type) {
+  res_t *r = res + resid;
+  len &= ~1;
+  if (len > MAX_PCM_SIZE) len = MAX_PCM_SIZE & ~1;
+  if (len < 2) loops = 0;
+  u8 *pcm = malloc(PCM_DATA_OFFSET + len + 1);
+  const u32 lstart = loops ? (rand() % (len / 2)) : len / 2; // in words, like the header
+  const u32 lsize = loops ? len / 2 - lstart : 0;
+  pcm[0] = lstart >> 8; pcm[1] = lstart;
+  pcm[2] = lsize >> 8;  pcm[3] = lsize;
+  pcm[4] = pcm[5] = pcm[6] = pcm[7] = 0;
+  s8 s = 0;
+  for (int i = 0; i < len; ++i) {
+    s += rand() % 9 - 4;
+    pcm[PCM_DATA_OFFSET + i] = (u8)s;
+  }
+
+  r->loops = loops && lsize;
+  r->adpcm = malloc(SND_CVTBUF_SIZE);
+  r->adpcm_size = len ? adpcm_pack_mono_s8(r->adpcm, SND_CVTBUF_SIZE, (const s8 *)pcm + PCM_DATA_OFFSET, len,
+    r->loops ? (int)lstart * 2 : -1, r->loops ? len : -1) : 0;
+  r->type = type;
+  if (type == SND_TYPE_ADPCM) {
+    r->data = r->adpcm;
+    r->size = r->adpcm_size;
+    r->alloc_size = ALIGN(r->adpcm_size, 8);
+    free(pcm);
+  } else {
+    r->data = pcm;
+    r->size = len ? PCM_DATA_OFFSET + len : 0;
+    r->alloc_size = ALIGN(r->adpcm_size, 64);
+  }
+}
+
+static void make_all_res(void) {
+  for (u16 i = 0; i < NUM_RES; ++i) {
+    const int kind = rand() % 20;
+    const int len = (kind == 0) ? 0 : (kind < 2) ? 30000 + rand() % 35000 : 200 + rand() % 12000;
+    make_res(i, len, rand() % 3 == 0, (rand() % 2) ? SND_TYPE_ADPCM : SND_TYPE_PCM_WITH_HEADER);
+  }
+}
+
+static int sound_landed(const sound_t *snd) {
+  if (snd->resid >= NUM_RES + NUM_CASE_RES)
+    return 1;
+  const res_t *r = res + snd->resid;
+  return snd->spuaddr >= 0 && !memcmp(hw_ram + snd->spuaddr, r->adpcm, r->adpcm_size);
+}
+
+/* checks */
+
+static int cmp_block(const void *a, const void *b) {
+  return ((const spu_block_t *)a)->addr - ((const spu_block_t *)b)->addr;
+}
+
+static void check_spu_ram(void) {
+  static spu_block_t blocks[MAX_SOUNDS + SPU_MAX_FREE_BLOCKS];
+  int n = 0;
+  u32 used = 0, free = 0;
+  for (int i = 0; i < spu_num_free; ++i) {
+    const spu_block_t *b = spu_free + i;
+    if (b->size <= 0 || (b->addr & 7) || (b->size & 7))
+      fail("free block %d is %05x+%x", i, b->addr, b->size);
+    if (i > 0 && spu_free[i - 1].addr + spu_free[i - 1].size >= b->addr)
+      fail("free list isn't sorted and coalesced at %d: %05x+%x, %05x+%x",
+        i, spu_free[i - 1].addr, spu_free[i - 1].size, b->addr, b->size);
+    free += b->size;
+    blocks[n++] = *b;
+  }
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    const sound_t *snd = snd_cache + i;
+    if (snd->resid == SND_NO_RES || !snd->alloc_size)
+      continue;
+    if (snd->spuaddr & 7)
+      fail("sound %04x is at %05x", snd->resid, snd->spuaddr);
+    blocks[n].addr = snd->spuaddr;
+    blocks[n].size = snd->alloc_size;
+    used += snd->alloc_size;
+    ++n;
+  }
+  if (used != snd_stats.used)
+    fail("snd_stats.used is %u, the sounds add up to %u", snd_stats.used, used);
+  if (used + free != SPU_MEM_MAX - SPU_MEM_START)
+    fail("%u used plus %u free isn't all of SPU RAM", used, free);
+
+  // together they have to cover SPU RAM exactly once
+  qsort(blocks, n, sizeof(*blocks), cmp_block);
+  s32 at = SPU_MEM_START;
+  for (int i = 0; i < n; ++i) {
+    if (blocks[i].addr != at) {
+      if (blocks[i].addr < at)
+        fail("blocks overlap at %05x", blocks[i].addr);
+      else
+        fail("%x bytes at %05x are neither used nor free", blocks[i].addr - at, at);
+      break;
+    }
+    at += blocks[i].size;
+  }
+  if (at != SPU_MEM_MAX && !num_fails)
+    fail("SPU RAM ends at %05x", at);
+}
+
+static void check_uploads(void) {
+  u8 queued[MAX_SOUNDS] = { 0 };
+  u8 bufs[SND_CVTBUF_COUNT] = { 0 };
+  for (int i = 0; i < snd_upq_num; ++i) {
+    const snd_upload_t *up = snd_upq + (snd_upq_head + i) % SND_UPLOAD_QUEUE;
+    ++queued[up->snd - snd_cache];
+    if (up->snd->resid == SND_NO_RES)
+      fail("upload %d is for a sound that was evicted", i);
+    if (up->cvtbuf >= 0)
+      ++bufs[up->cvtbuf];
+  }
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    const sound_t *snd = snd_cache + i;
+    if (snd->resid == SND_NO_RES || !snd->size)
+      continue;
+    if (!snd->ready && queued[i] != 1)
+      fail("sound %04x isn't ready, but it's queued %d times", snd->resid, queued[i]);
+    else if (snd->ready && queued[i])
+      fail("sound %04x is ready, but still queued", snd->resid);
+  }
+  for (int b = 0; b < SND_CVTBUF_COUNT; ++b) {
+    if (snd_cvtbuf_busy[b] != (bufs[b] != 0))
+      fail("conversion buffer %d is %s, but %d uploads use it", b, snd_cvtbuf_busy[b] ? "busy" : "free", bufs[b]);
+  }
+  if (hw_dma.busy && !snd_upq_active)
+    fail("a transfer is running that snd.c doesn't know about");
+}
+
+static void check_voices(void) {
+  for (u32 ch = 0; ch < CH_SOUND_COUNT; ++ch) {
+    const u32 v = sfx_ch_voice[ch];
+    if (v == CH_NONE)
+      continue;
+    if (v < CH_SOUND_BASE || v >= SPU_NUM_VOICES)
+      fail("sound channel %u is on voice %u", ch, v);
+    else if (sfx_voices[v].ch != ch)
+      fail("sound channel %u is on voice %u, which is on channel %d", ch, v, (int)sfx_voices[v].ch);
+  }
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    const sfx_voice_t *sv = sfx_voices + v;
+    if (v < CH_SOUND_BASE && (sv->ch != CH_NONE || sv->releasing))
+      fail("music voice %u is being used for sound channel %d", v, (int)sv->ch);
+    else if (sv->ch != CH_NONE && (sv->ch >= CH_SOUND_COUNT || sfx_ch_voice[sv->ch] != v))
+      fail("voice %u is on sound channel %d, which is on voice %d", v, (int)sv->ch,
+        sv->ch < CH_SOUND_COUNT ? (int)sfx_ch_voice[sv->ch] : -1);
+  }
+
+  u32 music_plays = 0;
+  for (u32 v = CH_MUSIC_BASE; v < CH_MUSIC_BASE + CH_MUSIC_COUNT; ++v)
+    music_plays += snd_voice_plays[v];
+  if (music_plays != mus_plays)
+    fail("voices 0-3 were keyed on %u times, the music only did it %u times", music_plays, mus_plays);
+
+  if (snd_ramp_mask & ~snd_key_mask)
+    fail("voices %06x are fading out, but aren't active", snd_ramp_mask & ~snd_key_mask);
+  if (snd_release_mask & ~snd_key_mask)
+    fail("voices %06x are releasing, but aren't active", snd_release_mask & ~snd_key_mask);
+}
+
+static void check_loaded(void) {
+  for (int i = 0; i < num_loaded; ++i) {
+    const sound_t *snd = snd_cache + loaded[i].handle;
+    if (snd->resid != loaded[i].resid || snd->addr != loaded[i].buf)
+      fail("handle %u for loaded sound %04x is now %04x (%p, not %p)", loaded[i].handle, loaded[i].resid, snd->resid, snd->addr, loaded[i].buf);
+  }
+}
+
+static void check_state(void) {
+  check_spu_ram();
+  check_uploads();
+  check_voices();
+  check_loaded();
+  if (!(HW32(HW_IRQ_MASK) & IRQ_RCNT1))
+    fail("the music IRQ was left masked");
+}
+
+// once a frame, after snd_update(): everything's been sent to the SPU, so the voices there
+// have to agree with what snd.c thinks they're doing
+static void check_frame(void) {
+  for (u32 v = 0; v < SPU_NUM_VOICES; ++v) {
+    const spu_shadow_t *sh = spu_shadow + v;
+    if ((s16)HWV(v, VREG_VOL) != sh->vol || HWV(v, VREG_PITCH) != sh->pitch || HWV(v, VREG_ADDR) != sh->addr)
+      fail("voice %u registers don't match the shadow after snd_update()", v);
+
+    hw_voice_t *hv = hw_voices + v;
+    const int keyed = (snd_key_mask & SPU_VOICECH(v)) != 0;
+    const int sounding = hv->on && !hv->kon_latch && hv->env > 0 && !hv->silent && (s16)HWV(v, VREG_VOL) != 0;
+    const int finished = !hv->kon_latch && (!hv->on || hv->env == 0 || hv->silent);
+    if (sounding && !keyed && !hv->releasing)
+      fail("voice %u is still playing sound %04x, but isn't in snd_key_mask", v, hv->resid);
+    if (keyed && finished) {
+      // a release counts from the key off, the voice itself might have been silent for a while by then
+      const u32 limit = (snd_release_mask & SPU_VOICECH(v)) ? SFX_RELEASE_FRAMES + 1 : 2;
+      if (++hv->done_frames == limit + 1)
+        fail("voice %u finished %u frames ago, but is still in snd_key_mask", v, hv->done_frames);
+    } else {
+      hv->done_frames = 0;
+    }
+  }
+
+  // sounds that just became ready have to have all their data in place
+  for (int i = 0; i < MAX_SOUNDS; ++i) {
+    const sound_t *snd = snd_cache + i;
+    const u8 ready = snd->resid != SND_NO_RES && snd->size && snd->ready;
+    if (ready && !prev_ready[i] && !sound_landed(snd))
+      fail("sound %04x is ready, but its data isn't in SPU RAM", snd->resid);
+    prev_ready[i] = ready;
+  }
+}
+
+/* driving it */
+
+// every call into snd.c goes between these; only the ones that flush get to write KON, once
+static void op_begin(void) {
+  hw_process();
+  hw_kon_lo = hw_kon_hi = 0;
+}
+
+static void op_end(const u32 max_kon) {
+  hw_process();
+  if (hw_kon_lo > max_kon || hw_kon_hi > max_kon)
+    fail("wrote KON %u+%u times, %u allowed", hw_kon_lo, hw_kon_hi, max_kon);
+  hw_preempt = 0;
+  check_state();
+}
+
+static void mus_tick(void) {
+  ++num_ticks;
+  u32 plays = 0;
+  for (u32 v = CH_MUSIC_BASE; v < CH_MUSIC_BASE + CH_MUSIC_COUNT; ++v)
+    plays -= snd_voice_plays[v];
+  for (u32 ch = CH_MUSIC_BASE; ch < CH_MUSIC_BASE + CH_MUSIC_COUNT; ++ch) {
+    switch (rand() % 8) {
+      case 0:
+      case 1:
+        if (mus_num_inst)
+          snd_play_sound_pitch(ch, mus_inst[rand() % mus_num_inst], snd_get_pitch(4000 + rand() % 20000), rand() % 64);
+        break;
+      case 2:
+        snd_set_sound_vol(ch, rand() % 64);
+        break;
+      case 3:
+        snd_stop_sound(ch);
+        break;
+      default:
+        break;
+    }
+  }
+  snd_flush();
+  for (u32 v = CH_MUSIC_BASE; v < CH_MUSIC_BASE + CH_MUSIC_COUNT; ++v)
+    plays += snd_voice_plays[v];
+  mus_plays += plays;
+}
+
+static void step_frame(void) {
+  op_begin();
+  snd_update();
+  op_end(1);
+  check_frame();
+  hw_advance(FRAME_NS);
+  ++frame_num;
+}
+
+static int attached_size(void) {
+  int size = 0;
+  for (int i = 0; i < num_loaded; ++i)
+    size += res[loaded[i].resid].alloc_size;
+  return size;
+}
+
+static int is_loaded(const u16 resid) {
+  for (int i = 0; i < num_loaded; ++i)
+    if (loaded[i].resid == resid)
+      return 1;
+  return 0;
+}
+
+// like res_do_load(): a fresh copy of the resource every time it gets loaded
+static u8 load_res(const u16 resid) {
+  const res_t *r = res + resid;
+  loaded_t *l = loaded + num_loaded++;
+  l->resid = resid;
+  l->buf = malloc(r->size ? r->size : 1);
+  memcpy(l->buf, r->data, r->size);
+  op_begin();
+  l->handle = snd_cache_sound(resid, l->buf, r->size, r->type);
+  op_end(0);
+  return l->handle;
+}
+
+static void flush_uploads(void) {
+  op_begin();
+  snd_flush_uploads();
+  op_end(0);
+}
+
+// like res_invalidate_*(): the resources are gone, and so is whatever they were loaded into
+static void drop_all(void) {
+  op_begin();
+  snd_detach_all();
+  for (int i = 0; i < num_loaded; ++i) {
+    memset(loaded[i].buf, 0xEE, res[loaded[i].resid].size);
+    free(loaded[i].buf);
+  }
+  num_loaded = 0;
+  mus_num_inst = 0;
+  op_end(0);
+}
+
+static void stop_all(void) {
+  op_begin();
+  snd_stop_all();
+  op_end(1);
+}
+
+static void play_sfx(const u8 ch, const u8 handle, const u16 freq, const u8 vol) {
+  const int playable = handle < MAX_SOUNDS && snd_cache[handle].addr && snd_cache[handle].ready && snd_cache[handle].size;
+  const u8 prev = sfx_ch_voice[ch];
+  op_begin();
+  snd_play_sfx(ch, handle, freq, vol);
+  op_end(0);
+  const u8 v = sfx_ch_voice[ch];
+  if (!playable && v != prev)
+    fail("sound channel %u moved to voice %u for handle %u, which can't be played", ch, v, handle);
+  else if (playable && (v == CH_NONE || snd_voice_sound[v] != snd_cache + handle))
+    fail("sound channel %u didn't get a voice for handle %u", ch, handle);
+}
+
+static void stop_sfx(const u8 ch) {
+  op_begin();
+  snd_stop_sfx(ch);
+  op_end(0);
+}
+
+// what the music IRQ does, only straight from here
+static void mus_play(const u8 ch, const u8 handle, const u16 freq, const u8 vol) {
+  op_begin();
+  const u32 plays = snd_voice_plays[ch];
+  snd_play_sound(ch, handle, freq, vol);
+  snd_flush();
+  mus_plays += snd_voice_plays[ch] - plays;
+  op_end(1);
+}
+
+static void mus_stop_sound(const u8 ch) {
+  op_begin();
+  snd_stop_sound(ch);
+  snd_flush();
+  op_end(1);
+}
+
+static void mus_set_vol(const u8 ch, const u8 vol) {
+  op_begin();
+  snd_set_sound_vol(ch, vol);
+  snd_flush();
+  op_end(1);
+}
+
+static void reset_all(void) {
+  mus_on = 0;
+  stop_all();
+  drop_all();
+  for (int i = 0; i < 8; ++i)
+    step_frame();
+}
+
+/* fixed cases */
+
+#define RES_ONESHOT (NUM_RES + 0)
+#define RES_LOOP    (NUM_RES + 1)
+#define RES_BIG     (NUM_RES + 2)
+#define RES_LOOP11  (NUM_RES + 3) // the block that jumps back ends up at 176
+#define RES_SHORT8  (NUM_RES + 4) // 144 bytes with the end block, padded to 192
+
+static u32 frames_until(const u32 max, int (*cond)(u32), const u32 arg) {
+  for (u32 i = 0; i < max; ++i) {
+    if (cond(arg))
+      return i;
+    step_frame();
+  }
+  return cond(arg) ? max : max + 1;
+}
+
+static int voice_off(const u32 v) {
+  return !(snd_key_mask & SPU_VOICECH(v));
+}
+
+static int sound_ready(const u32 handle) {
+  return snd_cache[handle].ready;
+}
+
+static void case_oneshot(void) {
+  const u8 h = load_res(RES_ONESHOT);
+  flush_uploads();
+  const u32 retired = snd_stats.voices_retired;
+  play_sfx(0, h, 22050, 63);
+  const u32 v = sfx_ch_voice[0];
+  // 3000 samples at half speed take a bit over 8 frames
+  const u32 n = frames_until(30, voice_off, v);
+  if (n > 30)
+    fail("oneshot: one-shot on voice %u never got retired", v);
+  else if (n < 8)
+    fail("oneshot: one-shot on voice %u got retired after %u frames", v, n);
+  if (snd_stats.voices_retired != retired + 1)
+    fail("oneshot: retired %u voices, not 1", snd_stats.voices_retired - retired);
+  step_frame();
+  if (sfx_ch_voice[0] != CH_NONE || sfx_voices[v].ch != CH_NONE)
+    fail("oneshot: sound channel 0 still has voice %u", v);
+}
+
+static void case_loop_release(void) {
+  const u8 h = load_res(RES_LOOP);
+  flush_uploads();
+  const u32 retired = snd_stats.voices_retired;
+  play_sfx(1, h, 44100, 63);
+  const u32 v = sfx_ch_voice[1];
+  // goes through the loop a few times
+  for (int i = 0; i < 30; ++i)
+    step_frame();
+  if (!(hw_endx & SPU_VOICECH(v)))
+    fail("loop: voice %u never got to the end of the loop", v);
+  if (voice_off(v) || snd_stats.voices_retired != retired)
+    fail("loop: looping sound on voice %u got retired", v);
+
+  stop_sfx(1);
+  if (!(snd_release_mask & SPU_VOICECH(v)))
+    fail("loop: voice %u isn't releasing after snd_stop_sfx()", v);
+  const u32 n = frames_until(SFX_RELEASE_FRAMES + 2, voice_off, v);
+  if (n > SFX_RELEASE_FRAMES + 2)
+    fail("loop: voice %u is still active after its release", v);
+  if (hw_voices[v].env != 0)
+    fail("loop: voice %u got retired before its release was over", v);
+  step_frame();
+  if (sfx_voices[v].releasing)
+    fail("loop: voice %u is still marked as releasing", v);
+}
+
+static void case_fade(void) {
+  const u8 h = load_res(RES_LOOP);
+  flush_uploads();
+  mus_play(0, h, 22050, 63);
+  step_frame();
+  step_frame();
+
+  // stop fades out over SND_RAMP_FRAMES
+  mus_stop_sound(0);
+  step_frame();
+  const s16 vol = (s16)HWV(0, VREG_VOL);
+  if (vol <= 0 || vol >= (63 << 8))
+    fail("fade: volume is %d a frame after snd_stop_sound()", vol);
+  // setting the volume cancels it
+  mus_set_vol(0, 40);
+  for (int i = 0; i < SND_RAMP_FRAMES + 2; ++i)
+    step_frame();
+  if ((s16)HWV(0, VREG_VOL) != (40 << 8) || voice_off(0))
+    fail("fade: snd_set_sound_vol() didn't cancel the fade (volume %d)", (s16)HWV(0, VREG_VOL));
+
+  // and so does playing something else
+  mus_stop_sound(0);
+  step_frame();
+  mus_play(0, h, 22050, 50);
+  for (int i = 0; i < SND_RAMP_FRAMES + 2; ++i)
+    step_frame();
+  if ((s16)HWV(0, VREG_VOL) != (50 << 8) || voice_off(0))
+    fail("fade: playing a sound didn't cancel the fade (volume %d)", (s16)HWV(0, VREG_VOL));
+
+  // left alone it goes all the way
+  mus_stop_sound(0);
+  for (int i = 0; i < SND_RAMP_FRAMES + 1; ++i)
+    step_frame();
+  if (HWV(0, VREG_VOL) != 0 || !voice_off(0))
+    fail("fade: voice 0 still at volume %d after the fade", (s16)HWV(0, VREG_VOL));
+}
+
+// the music IRQ keys a voice on just before snd_update(), before the SPU has had a sample
+// to clear the ENDX the voice still has from its last one-shot
+static void case_stale_endx(void) {
+  const u8 h = load_res(RES_ONESHOT);
+  flush_uploads();
+  mus_play(1, h, 44100, 63);
+  if (frames_until(30, voice_off, 1) > 30)
+    fail("stale endx: one-shot on voice 1 never got retired");
+  if (!(hw_endx & SPU_VOICECH(1)))
+    fail("stale endx: voice 1 doesn't have ENDX set");
+
+  mus_play(1, h, 44100, 63);
+  op_begin();
+  snd_update();
+  op_end(1);
+  if (voice_off(1))
+    fail("stale endx: voice 1 got retired right after it was keyed on");
+  check_frame();
+  hw_advance(FRAME_NS);
+  ++frame_num;
+  step_frame();
+  if (voice_off(1))
+    fail("stale endx: voice 1 got retired while it's still playing");
+  mus_stop_sound(1);
+}
+
+// a converted sound gets padded to 64 bytes with whatever the last one left in the buffer,
+// which mustn't make a one-shot look like a loop
+static void case_padding(void) {
+  load_res(RES_LOOP11);
+  flush_uploads();
+  const u8 h = load_res(RES_SHORT8);
+  flush_uploads();
+  if (snd_cache[h].loops)
+    fail("padding: one-shot got taken for a loop");
+  play_sfx(3, h, 44100, 63);
+  const u32 v = sfx_ch_voice[3];
+  if (frames_until(3, voice_off, v) > 3)
+    fail("padding: one-shot on voice %u never got retired", v);
+}
+
+static void case_upload(void) {
+  const u32 sfx_ch = 2;
+  const u8 h = load_res(RES_BIG);
+  if (snd_cache[h].ready)
+    fail("upload: a big sound is ready right after snd_cache_sound()");
+  play_sfx(sfx_ch, h, 22050, 63); // has to do nothing
+  if (frames_until(10, sound_ready, h) > 10)
+    fail("upload: sound %u never got ready", h);
+  play_sfx(sfx_ch, h, 22050, 63);
+
+  // more than fit in the queue at once, all needing conversion
+  for (u16 i = 0; i < SND_UPLOAD_QUEUE + 4; ++i) {
+    if (res[i].type == SND_TYPE_PCM_WITH_HEADER && !is_loaded(i))
+      load_res(i);
+  }
+  flush_uploads();
+  stop_sfx(sfx_ch);
+}
+
+static void run_cases(void) {
+  make_res(RES_ONESHOT, 3000, 0, SND_TYPE_PCM_WITH_HEADER);
+  make_res(RES_LOOP, 6000, 1, SND_TYPE_ADPCM);
+  make_res(RES_BIG, MAX_PCM_SIZE, 0, SND_TYPE_PCM_WITH_HEADER);
+  make_res(RES_LOOP11, 11 * 28, 1, SND_TYPE_PCM_WITH_HEADER);
+  make_res(RES_SHORT8, 8 * 28, 0, SND_TYPE_PCM_WITH_HEADER);
+  const int fails = num_fails;
+  case_oneshot();
+  case_loop_release();
+  reset_all();
+  case_fade();
+  case_stale_endx();
+  reset_all();
+  case_padding();
+  reset_all();
+  case_upload();
+  reset_all();
+  printf("sndtest: fixed cases %s\n", (num_fails == fails) ? "ok" : "failed");
+}
+
+/* random */
+
+static u16 random_res(void) {
+  for (int tries = 0; tries < 16; ++tries) {
+    const u16 resid = rand() % NUM_RES;
+    if (!is_loaded(resid) && attached_size() + res[resid].alloc_size <= MAX_ATTACHED_SIZE)
+      return resid;
+  }
+  return SND_NO_RES;
+}
+
+static void load_part(void) {
+  const int count = 10 + rand() % 30;
+  for (int i = 0; i < count && num_loaded < MAX_LOADED; ++i) {
+    const u16 resid = random_res();
+    if (resid != SND_NO_RES)
+      load_res(resid);
+  }
+  // res_do_load() waits for them, but not every path that caches sounds does
+  if (rand() % 5)
+    flush_uploads();
+}
+
+static void start_music(void) {
+  mus_num_inst = 0;
+  for (int i = 0; i < num_loaded && mus_num_inst < 4; ++i) {
+    if (rand() % 2)
+      mus_inst[mus_num_inst++] = loaded[i].handle;
+  }
+  hw_irq_next = hw_time + MUS_TICK_NS;
+  mus_on = 1;
+}
+
+static void stop_music(void) {
+  // mus_stop()
+  mus_on = 0;
+  stop_all();
+}
+
+static void run_random(const u32 frames) {
+  const int fails = num_fails;
+  load_part();
+  start_music();
+  for (u32 f = 0; f < frames; ++f) {
+    const int num_ops = rand() % 4;
+    for (int op = 0; op < num_ops; ++op) {
+      // now and then the music IRQ lands somewhere in the middle of the next call
+      if (mus_on && rand() % 2)
+        hw_preempt = 1 + rand() % 48;
+      const int r = rand() % 100;
+      if (r < 40) {
+        u8 handle = SND_NONE;
+        if (num_loaded && rand() % 10)
+          handle = loaded[rand() % num_loaded].handle;
+        else if (rand() % 2)
+          handle = rand() % MAX_SOUNDS;
+        play_sfx(rand() % CH_SOUND_COUNT, handle, 2000 + rand() % 30000, rand() % 64);
+      } else if (r < 55) {
+        stop_sfx(rand() % CH_SOUND_COUNT);
+      } else if (r < 60) {
+        const u16 resid = random_res();
+        if (resid != SND_NO_RES && num_loaded < MAX_LOADED)
+          load_res(resid);
+      } else if (r < 61) {
+        // part switch, see vm_restart_at()
+        stop_music();
+        drop_all();
+        load_part();
+        if (rand() % 4)
+          start_music();
+      } else if (r < 62) {
+        // resources dropped mid-part, see op_update_memlist(); the script loads more after,
+        // and whatever's still in its release is detached while it's playing
+        stop_music();
+        drop_all();
+      } else if (r < 63) {
+        if (mus_on)
+          stop_music();
+        else
+          start_music();
+      } else if (r < 64) {
+        stop_all();
+      }
+    }
+    step_frame();
+  }
+  printf("sndtest: %u random frames %s\n", frames, (num_fails == fails) ? "ok" : "failed");
+}
+
+int main(int argc, const char **argv) {
+  u32 seed = 1;
+  u32 frames = 20000;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      frames = strtoul(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "usage: %s [-s <seed>] [-n <frames>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(seed);
+  HW32(HW_IRQ_MASK) = IRQ_RCNT1 | 1;
+  op_begin();
+  snd_init();
+  op_end(1);
+  make_all_res();
+
+  run_cases();
+  run_random(frames);
+
+  snd_stats_t st;
+  snd_get_stats(&st);
+  printf("sndtest: seed %u, %u uploads, %u reuses, %u evictions, peak %u bytes in SPU RAM\n",
+    seed, st.uploads, st.reuses, st.evictions, st.peak);
+  printf("sndtest: %u one-shots retired, %u voice steals, %u music ticks (%u in the middle of a call)\n",
+    st.voices_retired, st.voice_steals, num_ticks, num_preempts);
+  printf("sndtest: %d problems\n", num_fails);
+  return num_fails != 0;
+}
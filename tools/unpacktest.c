@@ -0,0 +1,295 @@
+// unpacks every packed entry in MEMLIST.BIN with src/unpack.c and checks it against the original
+// bytekiller decoder the engine used to have (kept below as is): the size and checksum have to be
+// right and the output has to match byte for byte, unpacked in place like res_read_bank() does and
+// streamed through sector-aligned windows like res_read_bank_pipelined() does
+// then times both decoders over all of it
+// returns non-zero if anything doesn't match
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "util.h"
+#include "unpack.h"
+#include "memlist.h"
+
+#define SECSIZE 2048
+#define MIN_BENCH_TIME 1.0 // seconds each decoder gets timed for, at least
+
+static memlist_entry_t memlist[MEMLIST_MAX_ENTRIES];
+static int num_memlist;
+
+typedef struct {
+  u8 *packed;
+  u8 *ref; // what the old decoder made of it
+  const memlist_entry_t *me;
+} entry_t;
+
+static entry_t entries[MEMLIST_MAX_ENTRIES];
+static int num_entries;
+
+/* the original decoder, one bit at a time */
+
+typedef struct {
+  int size;
+  u32 crc;
+  u32 bits;
+  u8 *dst;
+  const u8 *src;
+} ref_ctx_t;
+
+static int ref_next_bit(ref_ctx_t *uc) {
+  int carry = (uc->bits & 1) != 0;
+  uc->bits >>= 1;
+  if (uc->bits == 0) { // getnextlwd
+    uc->bits = read32be(uc->src); uc->src -= 4;
+    uc->crc ^= uc->bits;
+    carry = (uc->bits & 1) != 0;
+    uc->bits = (1 << 31) | (uc->bits >> 1);
+  }
+  return carry;
+}
+
+static int ref_get_bits(ref_ctx_t *uc, int count) { // rdd1bits
+  int bits = 0;
+  for (int i = 0; i < count; ++i) {
+    bits <<= 1;
+    if (ref_next_bit(uc)) {
+      bits |= 1;
+    }
+  }
+  return bits;
+}
+
+static void ref_copy_literal(ref_ctx_t *uc, int num_bits, int len) { // getd3chr
+  int count = ref_get_bits(uc, num_bits) + len + 1;
+  uc->size -= count;
+  if (uc->size < 0) {
+    count += uc->size;
+    uc->size = 0;
+  }
+  for (int i = 0; i < count; ++i) {
+    *(uc->dst - i) = (u8)ref_get_bits(uc, 8);
+  }
+  uc->dst -= count;
+}
+
+static void ref_copy_reference(ref_ctx_t *uc, int num_bits, int count) { // copyd3bytes
+  uc->size -= count;
+  if (uc->size < 0) {
+    count += uc->size;
+    uc->size = 0;
+  }
+  const int offset = ref_get_bits(uc, num_bits);
+  for (int i = 0; i < count; ++i) {
+    *(uc->dst - i) = *(uc->dst - i + offset);
+  }
+  uc->dst -= count;
+}
+
+static int ref_unpack(u8 *dst, int dstsize, const u8 *src, int srcsize) {
+  ref_ctx_t uc;
+  uc.src = src + srcsize - 4;
+  uc.size = read32be(uc.src); uc.src -= 4;
+  if (uc.size > dstsize)
+    return 0;
+  uc.dst = dst + uc.size - 1;
+  uc.crc = read32be(uc.src); uc.src -= 4;
+  uc.bits = read32be(uc.src); uc.src -= 4;
+  uc.crc ^= uc.bits;
+  do {
+    if (!ref_next_bit(&uc)) {
+      if (!ref_next_bit(&uc)) {
+        ref_copy_literal(&uc, 3, 0);
+      } else {
+        ref_copy_reference(&uc, 8, 2);
+      }
+    } else {
+      const int code = ref_get_bits(&uc, 2);
+      switch (code) {
+      case 3:
+        ref_copy_literal(&uc, 8, 8);
+        break;
+      case 2:
+        ref_copy_reference(&uc, 12, ref_get_bits(&uc, 8) + 1);
+        break;
+      case 1:
+        ref_copy_reference(&uc, 10, 4);
+        break;
+      case 0:
+        ref_copy_reference(&uc, 9, 3);
+        break;
+      }
+    }
+  } while (uc.size > 0);
+  return uc.crc == 0;
+}
+
+/* streaming, see res_read_bank_pipelined() */
+
+typedef struct {
+  const u8 *data; // whole packed entry
+  u32 len;
+  u32 skip;       // offset of the entry in its first sector
+  u32 chunk_size;
+  int chunk;      // next one to hand out
+  u8 *buf[2];
+} stream_src_t;
+
+static int stream_refill(unpack_stream_t *s) {
+  stream_src_t *p = s->user;
+  if (p->chunk < 0)
+    return 0;
+  // every window gets its own copy and the old one gets trashed, so reads from a window
+  // that was already given back show up as mismatches
+  u8 *buf = p->buf[p->chunk & 1];
+  memset(buf, 0xA5, p->chunk_size);
+  const s32 start = p->chunk * (s32)p->chunk_size - (s32)p->skip; // stream offset of buf[0]
+  const s32 lo = (start < 0) ? 0 : start;
+  const s32 hi = (start + (s32)p->chunk_size > (s32)p->len) ? (s32)p->len : start + (s32)p->chunk_size;
+  memcpy(buf + (lo - start), p->data + lo, hi - lo);
+  s->lo = buf + (lo - start);
+  s->hi = buf + (hi - start);
+  --p->chunk;
+  return 1;
+}
+
+static int unpack_streamed(u8 *out, const entry_t *e, const u32 chunk_size) {
+  const memlist_entry_t *me = e->me;
+  stream_src_t p;
+  p.data = e->packed;
+  p.len = me->packed_size;
+  p.skip = me->bank_pos % SECSIZE;
+  p.chunk_size = chunk_size;
+  p.chunk = (p.skip + p.len + chunk_size - 1) / chunk_size - 1;
+  p.buf[0] = malloc(chunk_size);
+  p.buf[1] = malloc(chunk_size);
+  unpack_stream_t s;
+  s.refill = stream_refill;
+  s.user = &p;
+  stream_refill(&s);
+  const int ret = bytekiller_unpack_stream(out, me->unpacked_size, &s);
+  free(p.buf[0]);
+  free(p.buf[1]);
+  return ret;
+}
+
+static int check_entry(const int i, const entry_t *e) {
+  const memlist_entry_t *me = e->me;
+  const u32 bufsize = (me->unpacked_size > me->packed_size) ? me->unpacked_size : me->packed_size;
+  u8 *out = malloc(bufsize + 8);
+  int ok = 1;
+
+  if (read32be(e->packed + me->packed_size - 4) != me->unpacked_size) {
+    printf("res %03x: unpacked size in the stream is %u, memlist says %u\n", i, read32be(e->packed + me->packed_size - 4), me->unpacked_size);
+    ok = 0;
+  }
+
+  // in place, the way the loader does it
+  memset(out, 0xA5, bufsize + 8);
+  memcpy(out, e->packed, me->packed_size);
+  if (!bytekiller_unpack(out, me->unpacked_size, out, me->packed_size)) {
+    printf("res %03x: bad checksum\n", i);
+    ok = 0;
+  } else if (memcmp(out, e->ref, me->unpacked_size)) {
+    printf("res %03x: does not match the old decoder\n", i);
+    ok = 0;
+  }
+
+  // through the pipelined loader's chunks and single sectors
+  static const u32 chunk_sizes[] = { 8 * SECSIZE, SECSIZE };
+  for (u32 c = 0; c < sizeof(chunk_sizes) / sizeof(*chunk_sizes); ++c) {
+    memset(out, 0xA5, bufsize + 8);
+    if (!unpack_streamed(out, e, chunk_sizes[c]) || memcmp(out, e->ref, me->unpacked_size)) {
+      printf("res %03x: streamed in %u byte chunks, does not match\n", i, chunk_sizes[c]);
+      ok = 0;
+    }
+  }
+
+  // nothing past the end gets touched
+  for (u32 k = me->unpacked_size; k < bufsize + 8 && ok; ++k) {
+    if (out[k] != 0xA5) {
+      printf("res %03x: wrote past the end at %u\n", i, k);
+      ok = 0;
+    }
+  }
+
+  free(out);
+  return ok;
+}
+
+// returns seconds per pass over all entries
+static double bench(const int old, u32 *passes) {
+  static u8 out[0x100000];
+  const clock_t t0 = clock();
+  clock_t t;
+  *passes = 0;
+  do {
+    for (int i = 0; i < num_entries; ++i) {
+      const memlist_entry_t *me = entries[i].me;
+      if (old)
+        ref_unpack(out, sizeof(out), entries[i].packed, me->packed_size);
+      else
+        bytekiller_unpack(out, sizeof(out), entries[i].packed, me->packed_size);
+    }
+    ++*passes;
+    t = clock();
+  } while ((double)(t - t0) / CLOCKS_PER_SEC < MIN_BENCH_TIME);
+  return (double)(t - t0) / CLOCKS_PER_SEC / *passes;
+}
+
+int main(int argc, const char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <datadir>\n", argv[0]);
+    return 1;
+  }
+
+  const char *datadir = argv[1];
+  num_memlist = memlist_load(datadir, memlist, MEMLIST_MAX_ENTRIES);
+  if (num_memlist <= 0) return 1;
+
+  int num_missing = 0;
+  int num_bad = 0;
+  u32 total_in = 0;
+  u32 total_out = 0;
+  for (int i = 0; i < num_memlist; ++i) {
+    const memlist_entry_t *me = memlist + i;
+    if (me->bank == 0 || me->packed_size == me->unpacked_size)
+      continue;
+    if (me->packed_size < 12 || me->unpacked_size > 0x100000) {
+      printf("res %03x: bogus sizes %u -> %u\n", i, me->packed_size, me->unpacked_size);
+      ++num_bad;
+      continue;
+    }
+    entry_t *e = entries + num_entries;
+    e->me = me;
+    e->packed = memlist_read_packed(datadir, me);
+    if (!e->packed) {
+      ++num_missing;
+      continue;
+    }
+    e->ref = calloc(1, me->unpacked_size ? me->unpacked_size : 1);
+    if (!ref_unpack(e->ref, me->unpacked_size, e->packed, me->packed_size))
+      printf("res %03x: the old decoder doesn't like it either\n", i);
+    if (!check_entry(i, e))
+      ++num_bad;
+    total_in += me->packed_size;
+    total_out += me->unpacked_size;
+    ++num_entries;
+  }
+
+  printf("unpacktest: %d packed entries (%d missing), %u -> %u bytes, %d bad\n",
+    num_entries, num_missing, total_in, total_out, num_bad);
+  if (num_entries == 0)
+    return num_bad != 0;
+
+  u32 passes_old, passes_new;
+  const double t_old = bench(1, &passes_old);
+  const double t_new = bench(0, &passes_new);
+  printf("old decoder: %8.3f ms per pass, %6.1f MB/s (%u passes)\n", t_old * 1000.0, total_out / t_old / 1e6, passes_old);
+  printf("new decoder: %8.3f ms per pass, %6.1f MB/s (%u passes), %.2fx\n", t_new * 1000.0, total_out / t_new / 1e6, passes_new, t_old / t_new);
+
+  return num_bad != 0;
+}